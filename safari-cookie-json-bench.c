@@ -0,0 +1,338 @@
+// A benchmark of the worst case files, built by make bench as safari-cookie-json-bench, apart from the tool
+//
+//     ./safari-cookie-json-bench [--kernel KERNEL] [--utf8 MODE] [--window BYTES] [--locators]
+//         [--corpus DIRECTORY] BYTES
+//
+// It includes the verify harness, and so the tool, for the file generators.
+
+#define SAFARI_COOKIE_JSON_VERIFY_NO_MAIN
+#include "safari-cookie-json-verify.c"
+
+// This times files built to be as slow as possible for the walk and the json output, next to a typical
+// one, so there's a bound on how long one file can stall a batch. Each is about the requested size, and the
+// report gives the time and how much output that turned into. Output goes down a pipe to a thread which just
+// counts it, as it would to a consumer, since some cases write far more than they read.
+enum BenchCase {
+    // Random pages from the generator
+    BENCH_CASE_TYPICAL,
+    // One page of as many cookies as fit, each with only an empty value
+    BENCH_CASE_MANY_COOKIES,
+    // A page per cookie, each with only an empty value
+    BENCH_CASE_TINY_PAGES,
+    // A few huge values of control characters, each of which is written as a \u escape
+    BENCH_CASE_ESCAPES,
+    // One cookie with one huge clean value
+    BENCH_CASE_GIANT_VALUE,
+    // Every offset in the page is the same cookie, and all six of its strings are the same string, so each
+    // byte of the file is written many times over
+    BENCH_CASE_REPEATED_OFFSETS,
+    BENCH_CASE_COUNT,
+};
+
+const char * const BENCH_CASE_NAMES[] = {
+    "typical", "manyCookies", "tinyPages", "escapes", "giantValue", "repeatedOffsets",
+};
+
+enum {
+    BENCH_SEED = 1,
+    BENCH_REPEAT_COUNT = 3,
+    BENCH_ESCAPES_COOKIE_COUNT = 16,
+    BENCH_REPEATED_STRING_SIZE = 64,
+    BENCH_COOKIE_HEADER_SIZE = 10 * sizeof(uint32_t) + 2 * sizeof(double),
+};
+
+// A page of cookieCount cookies with just a value, or with repeated, the offsets all to the one cookie, which
+// has the value for all its strings. valueSize includes the null.
+int generateBenchPage(uint32_t cookieCount, int repeated, const char * value, size_t valueSize, char ** page,
+    size_t * pageSize) {
+    FILE * out = open_memstream(page, pageSize);
+    if (!out) {
+        return 0;
+    }
+    const uint32_t headerSize = sizeof(COOKIE_PAGE_TAG) + (cookieCount + 1) * sizeof(uint32_t)
+        + sizeof(COOKIE_PAGE_HEADER_END);
+    const uint32_t cookieSize = BENCH_COOKIE_HEADER_SIZE + valueSize;
+    fwrite(COOKIE_PAGE_TAG, 1, sizeof(COOKIE_PAGE_TAG), out);
+    write32Lo(out, cookieCount);
+    for (uint32_t cookieIdx = 0; cookieIdx < cookieCount; ++cookieIdx) {
+        write32Lo(out, headerSize + (repeated ? 0 : cookieIdx * cookieSize));
+    }
+    fwrite(COOKIE_PAGE_HEADER_END, 1, sizeof(COOKIE_PAGE_HEADER_END), out);
+    for (uint32_t cookieIdx = 0; cookieIdx < (repeated ? 1 : cookieCount); ++cookieIdx) {
+        write32Lo(out, cookieSize);
+        write32Lo(out, 0);
+        write32Lo(out, 0);
+        write32Lo(out, 0);
+        for (int stringIdx = 0; stringIdx < 6; ++stringIdx) {
+            write32Lo(out, repeated || 3 == stringIdx ? BENCH_COOKIE_HEADER_SIZE : 0);
+        }
+        writeDouble(out, 800000000);
+        writeDouble(out, 700000000.125);
+        fwrite(value, 1, valueSize, out);
+    }
+    return !fclose(out);
+}
+
+// Returns the file in a malloced buffer
+int generateBenchFile(enum BenchCase benchCase, uint64_t * random, size_t size, char ** data, size_t * length,
+    uint32_t * pageCount) {
+    uint32_t cookieCount = 1;
+    size_t valueSize = 1;
+    char fill = 'a';
+    *pageCount = 1;
+    switch (benchCase) {
+        case BENCH_CASE_TYPICAL:
+            *pageCount = 0;
+            break;
+        case BENCH_CASE_MANY_COOKIES:
+            cookieCount = size / (sizeof(uint32_t) + BENCH_COOKIE_HEADER_SIZE + 1);
+            break;
+        case BENCH_CASE_TINY_PAGES:
+            *pageCount = size / (2 * sizeof(uint32_t) + sizeof(COOKIE_PAGE_TAG) + 2 * sizeof(uint32_t)
+                + sizeof(COOKIE_PAGE_HEADER_END) + BENCH_COOKIE_HEADER_SIZE + 1);
+            break;
+        case BENCH_CASE_ESCAPES:
+            cookieCount = BENCH_ESCAPES_COOKIE_COUNT;
+            valueSize = size / BENCH_ESCAPES_COOKIE_COUNT + 1;
+            fill = 0;
+            break;
+        case BENCH_CASE_GIANT_VALUE:
+            valueSize = size + 1;
+            break;
+        default:
+            cookieCount = size / sizeof(uint32_t);
+            valueSize = BENCH_REPEATED_STRING_SIZE;
+            break;
+    }
+    // Every page is the same, apart from the typical ones, which are generated until there's enough
+    char * page = 0;
+    size_t pageSize = 0;
+    char * value = malloc(valueSize);
+    if (!value) {
+        return 0;
+    }
+    for (size_t i = 0; i + 1 < valueSize; ++i) {
+        value[i] = fill ? fill + i % 26 : 1 + i % 31;
+    }
+    value[valueSize - 1] = 0;
+    const int generated = BENCH_CASE_TYPICAL == benchCase
+        || generateBenchPage(cookieCount, BENCH_CASE_REPEATED_OFFSETS == benchCase, value, valueSize, &page,
+            &pageSize);
+    free(value);
+    uint32_t capacity = *pageCount ? *pageCount : 64;
+    char ** pages = generated ? malloc(capacity * sizeof(*pages)) : 0;
+    size_t * pageSizes = pages ? malloc(capacity * sizeof(*pageSizes)) : 0;
+    int assembled = 0;
+    if (pageSizes) {
+        for (uint32_t pageIdx = 0; pageIdx < *pageCount; ++pageIdx) {
+            pages[pageIdx] = page;
+            pageSizes[pageIdx] = pageSize;
+        }
+        size_t total = 0;
+        assembled = 1;
+        while (BENCH_CASE_TYPICAL == benchCase && total < size && assembled) {
+            if (capacity == *pageCount) {
+                capacity *= 2;
+                char ** grownPages = realloc(pages, capacity * sizeof(*pages));
+                pages = grownPages ? grownPages : pages;
+                size_t * grownPageSizes = grownPages ? realloc(pageSizes, capacity * sizeof(*pageSizes)) : 0;
+                pageSizes = grownPageSizes ? grownPageSizes : pageSizes;
+                assembled = grownPageSizes != 0;
+            }
+            if (assembled && (assembled = generatePage(random, &pages[*pageCount], &pageSizes[*pageCount]))) {
+                total += pageSizes[(*pageCount)++];
+            }
+        }
+        assembled = assembled && assembleCookieFile(pages, pageSizes, *pageCount, data, length);
+    }
+    if (BENCH_CASE_TYPICAL == benchCase && pages) {
+        for (uint32_t pageIdx = 0; pageIdx < *pageCount; ++pageIdx) {
+            free(pages[pageIdx]);
+        }
+    }
+    free(page);
+    free(pages);
+    free(pageSizes);
+    return assembled;
+}
+
+struct OutputCounter {
+    int fd;
+    pthread_t thread;
+    uint64_t bytes;
+};
+
+void * countOutput(void * argument) {
+    struct OutputCounter * counter = argument;
+    char buffer[SINK_BUFFER_SIZE];
+    for (;;) {
+        const ssize_t got = read(counter->fd, buffer, sizeof(buffer));
+        if (0 < got) {
+            counter->bytes += got;
+        } else if (!got || EINTR != errno) {
+            return 0;
+        }
+    }
+}
+
+struct BenchResult {
+    int exitCode;
+    double seconds;
+    uint64_t outputBytes;
+    uint64_t cookieCount;
+};
+
+// One walk of the file, with the time until the last of the output has been read
+int runBenchCase(const char * filename, off_t windowSize, int locators, struct BenchResult * result) {
+    int fds[2];
+    if (pipe(fds)) {
+        perror("Cannot create pipe");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    struct OutputCounter counter = { .fd = fds[0] };
+    FILE * out = fdopen(fds[1], "w");
+    if (!out || pthread_create(&counter.thread, 0, countOutput, &counter)) {
+        perror("Cannot start output thread");
+        out ? fclose(out) : close(fds[1]);
+        close(fds[0]);
+        return EXIT_CODE_BAD_THREAD;
+    }
+    setvbuf(out, 0, _IOFBF, SINK_BUFFER_SIZE);
+    struct Run run = { .windowSize = windowSize, .sinkCount = 1 };
+    openSink(&run.sinks[0], "json");
+    run.sinks[0].out = out;
+    run.sinks[0].locators = locators;
+    const uint64_t started = monotonicNanoseconds();
+    result->exitCode = runFinishFile(&run, filename, printCookiesFromFilename(&run, filename));
+    const int closeExitCode = closeSink(&run.sinks[0]);
+    result->exitCode = result->exitCode ? result->exitCode : closeExitCode;
+    fclose(out);
+    pthread_join(counter.thread, 0);
+    result->seconds = (monotonicNanoseconds() - started) / 1e9;
+    close(fds[0]);
+    result->outputBytes = counter.bytes;
+    result->cookieCount = atomic_load(&run.cookieCount);
+    return EXIT_CODE_OK;
+}
+
+// Kept as DIRECTORY/NAME.binarycookies, for trying other tools and later fast paths on
+char * writeCorpusFile(const char * directory, const char * name, const char * data, size_t length) {
+    char * filename = malloc(strlen(directory) + strlen(name) + strlen("/.binarycookies") + 1);
+    if (!filename) {
+        perror("Cannot write corpus file");
+        return 0;
+    }
+    sprintf(filename, "%s/%s.binarycookies", directory, name);
+    FILE * out = fopen(filename, "w");
+    if (!out || length != fwrite(data, 1, length, out) || fclose(out)) {
+        perror("Cannot write corpus file");
+        free(filename);
+        return 0;
+    }
+    return filename;
+}
+
+int benchWorstCases(size_t size, const char * corpusDirectory, off_t windowSize, int locators) {
+    if (corpusDirectory && mkdir(corpusDirectory, 0777) && EEXIST != errno) {
+        perror("Cannot create corpus directory");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    printf("%-16s %12s %8s %10s %10s %14s %14s %8s\n", "case", "fileBytes", "pages", "cookies", "seconds",
+        "bytesPerSecond", "outputBytes", "ratio");
+    uint64_t random = BENCH_SEED;
+    int exitCode = EXIT_CODE_OK;
+    for (enum BenchCase benchCase = 0; !exitCode && benchCase < BENCH_CASE_COUNT; ++benchCase) {
+        char * data;
+        size_t length;
+        uint32_t pageCount;
+        if (!generateBenchFile(benchCase, &random, size, &data, &length, &pageCount)) {
+            perror("Cannot generate file");
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+            break;
+        }
+        char * filename = corpusDirectory ? writeCorpusFile(corpusDirectory, BENCH_CASE_NAMES[benchCase], data, length)
+            : writeTemporaryFile(data, length, "bench");
+        free(data);
+        if (!filename) {
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+            break;
+        }
+        // The best of a few, since what's wanted is the cost of the file rather than of whatever else is running
+        struct BenchResult best = { 0 };
+        for (int repeatIdx = 0; !exitCode && repeatIdx < BENCH_REPEAT_COUNT; ++repeatIdx) {
+            struct BenchResult result;
+            exitCode = runBenchCase(filename, windowSize, locators, &result);
+            if (!exitCode && result.exitCode) {
+                fprintf(stderr, "Case %s failed with exit code %d\n", BENCH_CASE_NAMES[benchCase], result.exitCode);
+                exitCode = result.exitCode;
+            } else if (!exitCode && (!repeatIdx || result.seconds < best.seconds)) {
+                best = result;
+            }
+        }
+        if (!exitCode) {
+            printf("%-16s %12zu %8u %10llu %10.6f %14.0f %14llu %8.2f\n", BENCH_CASE_NAMES[benchCase], length,
+                pageCount, (unsigned long long)best.cookieCount, best.seconds,
+                best.seconds > 0 ? length / best.seconds : 0, (unsigned long long)best.outputBytes,
+                (double)best.outputBytes / length);
+            fflush(stdout);
+        }
+        if (!corpusDirectory) {
+            unlink(filename);
+        }
+        free(filename);
+    }
+    return exitCode;
+}
+
+void usage(const char * argv0) {
+    fprintf(stderr, "Usage: %s [--kernel KERNEL] [--utf8 pass|replace|ascii] [--window BYTES] [--locators]\n", argv0);
+    fprintf(stderr, "    [--corpus DIRECTORY] BYTES\n");
+    fprintf(stderr, "  Times the json output of worst case files of about BYTES, which --corpus keeps.\n");
+}
+
+int main(int argc, const char **argv) {
+    const char * corpusDirectory = 0;
+    off_t windowSize = 0;
+    int locators = 0;
+    selectKernels(0);
+    int argIdx = 1;
+    while (argIdx < argc && '-' == argv[argIdx][0]) {
+        if (!strcmp(argv[argIdx], "--kernel") && argIdx + 1 < argc) {
+            if (!selectKernels(argv[argIdx + 1])) {
+                fprintf(stderr, "No %s kernels for this CPU\n", argv[argIdx + 1]);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--utf8") && argIdx + 1 < argc) {
+            if (!strcmp(argv[argIdx + 1], "pass")) {
+                utf8Mode = UTF8_MODE_PASS;
+            } else if (!strcmp(argv[argIdx + 1], "replace")) {
+                utf8Mode = UTF8_MODE_REPLACE;
+            } else if (!strcmp(argv[argIdx + 1], "ascii")) {
+                utf8Mode = UTF8_MODE_ASCII;
+            } else {
+                usage(*argv);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--window") && argIdx + 1 < argc) {
+            windowSize = strtoll(argv[argIdx + 1], 0, 0);
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--locators")) {
+            locators = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--corpus") && argIdx + 1 < argc) {
+            corpusDirectory = argv[argIdx + 1];
+            argIdx += 2;
+        } else {
+            usage(*argv);
+            return EXIT_CODE_BAD_INVOCATION;
+        }
+    }
+    const unsigned long long size = argIdx + 1 == argc ? strtoull(argv[argIdx], 0, 0) : 0;
+    if (!size) {
+        usage(*argv);
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+    return benchWorstCases(size, corpusDirectory, windowSize, locators);
+}
@@ -0,0 +1,55 @@
+#ifndef SAFARI_COOKIE_JSON_PLUGIN_H
+#define SAFARI_COOKIE_JSON_PLUGIN_H
+
+// The C ABI for plugins loaded via --plugin PATH[=ARGUMENT]. A plugin is a shared library exporting
+// safariCookiePluginInit, which fills in the callbacks it wants. Cookies are delivered in batches of
+// one page, straight out of the record walk, and the strings point into the mapped file - so they are
+// only valid until the callback returns. Copy anything you want to keep.
+//
+// Only ever add fields to the end of these structs, and bump SAFARI_COOKIE_PLUGIN_ABI_VERSION when you do.
+
+#include <stdint.h>
+
+enum {
+    SAFARI_COOKIE_PLUGIN_ABI_VERSION = 2,
+};
+
+// A cookie record as decoded from a page. Strings are null when the record has no offset for them.
+// The times are doubles in seconds since the Mac epoch, 2001-01-01T00:00:00Z.
+struct SafariCookie {
+    uint32_t version;
+    uint32_t flags;
+    const char * domain;
+    const char * name;
+    const char * path;
+    const char * value;
+    const char * comment;
+    const char * commentUrl;
+    double expiry;
+    double creation;
+};
+
+// Any callback may be left null. The context is passed back untouched.
+struct SafariCookiePlugin {
+    // Set by the tool before init, to the version it was built with
+    uint32_t abiVersion;
+    void * context;
+    void (*beginFile)(void * context, const char * filename);
+    void (*beginPage)(void * context, uint32_t pageIdx);
+    void (*cookies)(void * context, const struct SafariCookie * cookies, uint32_t cookieCount);
+    void (*endPage)(void * context, uint32_t pageIdx);
+    // Only called once the file checksum and footer have been validated
+    void (*endFile)(void * context, const char * filename);
+    void (*close)(void * context);
+    // Since version 2. Only called with --plist, just before endFile, with the raw binary plist from the
+    // end of the file, which has been checked to be well formed.
+    void (*plist)(void * context, const void * data, uint32_t length);
+};
+
+#define SAFARI_COOKIE_PLUGIN_INIT_SYMBOL "safariCookiePluginInit"
+
+// Return zero on success, anything else aborts the run. The argument is whatever followed = in the
+// --plugin option, or null.
+typedef int (*SafariCookiePluginInit)(struct SafariCookiePlugin * plugin, const char * argument);
+
+#endif
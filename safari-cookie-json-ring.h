@@ -0,0 +1,242 @@
+#ifndef SAFARI_COOKIE_JSON_RING_H
+#define SAFARI_COOKIE_JSON_RING_H
+
+// The shared memory ring written by --ring NAME[=BYTES], and a small consumer library for reading it.
+//
+// The ring is a POSIX shared memory object holding a single producer single consumer queue of framed
+// binary records, so a co-located consumer gets the cookies without a pipe copy or a JSON parse. Frames
+// are contiguous and 8 byte aligned, and a padding frame fills the gap at the end of the ring when the
+// next frame doesn't fit. When the ring is full the producer waits for the consumer, so a slow consumer
+// slows the tool down rather than losing records.
+//
+// A consumer which has gone away would leave the producer waiting forever, so the consumer beats a heartbeat
+// whenever it takes or releases a frame, and the producer gives up on the ring, and fails with an error exit
+// code, once the ring has been full and the heartbeat still for SAFARI_COOKIE_RING_CONSUMER_TIMEOUT_SECONDS.
+// That includes a consumer which never attached. Closing the ring tells the producer at once. A consumer
+// which can spend longer than that on one frame should call safariCookieRingHeartbeat as it goes.
+//
+// A consumer looks like
+//
+//     struct SafariCookieRing * ring = safariCookieRingOpen("/cookies");
+//     struct SafariCookieRingFrame frame;
+//     while (safariCookieRingNext(ring, &frame)) {
+//         struct SafariCookie cookie;
+//         if (SAFARI_COOKIE_RING_FRAME_COOKIE == frame.type && safariCookieRingDecodeCookie(&frame, &cookie)) {
+//             ...
+//         }
+//         safariCookieRingRelease(ring, &frame);
+//     }
+//     safariCookieRingClose(ring);
+//     shm_unlink("/cookies");
+//
+// Decoded strings point into the ring, and are only valid until the frame is released. Skip frame types
+// you don't know, newer versions of the tool may add more.
+
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "safari-cookie-json-plugin.h"
+
+enum {
+    SAFARI_COOKIE_RING_MAGIC = 0x53434a52, // SCJR
+    SAFARI_COOKIE_RING_VERSION = 2,
+    SAFARI_COOKIE_RING_ALIGNMENT = 8,
+    SAFARI_COOKIE_RING_FRAME_HEADER_SIZE = 2 * sizeof(uint32_t),
+    // Cookie frames have version, flags, expiry and creation before the strings
+    SAFARI_COOKIE_RING_COOKIE_FIXED_SIZE = 2 * sizeof(uint32_t) + 2 * sizeof(double),
+    SAFARI_COOKIE_RING_CONSUMER_TIMEOUT_SECONDS = 30,
+};
+
+enum {
+    SAFARI_COOKIE_RING_FRAME_PADDING = 0,
+    // The payload is the null terminated filename
+    SAFARI_COOKIE_RING_FRAME_BEGIN_FILE,
+    // The payload is version, flags, expiry, creation, then domain, name, path, value, comment,
+    // and commentUrl each as a uint32_t size including the null terminator followed by the bytes.
+    // Absent strings have size zero. Everything is native endian, since producer and consumer share a host.
+    SAFARI_COOKIE_RING_FRAME_COOKIE,
+    // As for begin, only sent once the file has been validated
+    SAFARI_COOKIE_RING_FRAME_END_FILE,
+    // Only with --plist, the raw binary plist from the end of the file, just before the end frame
+    SAFARI_COOKIE_RING_FRAME_PLIST,
+};
+
+struct SafariCookieRing {
+    uint32_t magic;
+    uint32_t version;
+    // Bytes of data, always a power of two
+    uint64_t capacity;
+    // Producer and consumer each own a cache line, to avoid false sharing
+    alignas(64) _Atomic uint64_t head;
+    _Atomic uint32_t headSignal;
+    _Atomic uint32_t consumerWaiting;
+    _Atomic uint32_t closed;
+    alignas(64) _Atomic uint64_t tail;
+    _Atomic uint32_t tailSignal;
+    _Atomic uint32_t producerWaiting;
+    // Only ever counts up while the consumer is alive, the value means nothing
+    _Atomic uint32_t consumerHeartbeat;
+    _Atomic uint32_t consumerClosed;
+    alignas(64) unsigned char data[];
+};
+
+struct SafariCookieRingFrame {
+    uint32_t type;
+    // Payload size, not including the header or alignment
+    uint32_t size;
+    const unsigned char * payload;
+    // Total bytes to release
+    uint64_t span;
+};
+
+static inline uint64_t safariCookieRingAlign(uint64_t size) {
+    return (size + SAFARI_COOKIE_RING_ALIGNMENT - 1) & ~(uint64_t)(SAFARI_COOKIE_RING_ALIGNMENT - 1);
+}
+
+// Block until *signal is no longer seen, or a short while has passed. Spurious wakeups are fine,
+// every caller loops. There's no futex on macOS, so there we just back off.
+static inline void safariCookieRingWait(_Atomic uint32_t * signal, uint32_t seen) {
+#ifdef __linux__
+    const struct timespec timeout = { 0, 10 * 1000 * 1000 };
+    syscall(SYS_futex, signal, FUTEX_WAIT, seen, &timeout, 0, 0);
+#else
+    (void)signal;
+    (void)seen;
+    const struct timespec backoff = { 0, 50 * 1000 };
+    nanosleep(&backoff, 0);
+#endif
+}
+
+static inline void safariCookieRingWake(_Atomic uint32_t * signal) {
+    atomic_fetch_add(signal, 1);
+#ifdef __linux__
+    syscall(SYS_futex, signal, FUTEX_WAKE, 1, 0, 0, 0);
+#endif
+}
+
+// Returns null, with errno set, if the ring can't be mapped
+static inline struct SafariCookieRing * safariCookieRingOpen(const char * name) {
+    const int fd = shm_open(name, O_RDWR, 0);
+    if (-1 == fd) {
+        return 0;
+    }
+    struct stat statResult;
+    void * data = MAP_FAILED;
+    if (!fstat(fd, &statResult) && statResult.st_size >= sizeof(struct SafariCookieRing)) {
+        data = mmap(0, statResult.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == data) {
+        return 0;
+    }
+    struct SafariCookieRing * ring = data;
+    if (SAFARI_COOKIE_RING_MAGIC != ring->magic || SAFARI_COOKIE_RING_VERSION != ring->version
+        || statResult.st_size != sizeof(struct SafariCookieRing) + ring->capacity) {
+        munmap(data, statResult.st_size);
+        return 0;
+    }
+    return ring;
+}
+
+static inline void safariCookieRingHeartbeat(struct SafariCookieRing * ring) {
+    atomic_fetch_add_explicit(&ring->consumerHeartbeat, 1, memory_order_relaxed);
+}
+
+// The producer stops waiting for a consumer which has closed, even if it hadn't read everything
+static inline void safariCookieRingClose(struct SafariCookieRing * ring) {
+    atomic_store(&ring->consumerClosed, 1);
+    if (atomic_load(&ring->producerWaiting)) {
+        safariCookieRingWake(&ring->tailSignal);
+    }
+    munmap(ring, sizeof(struct SafariCookieRing) + ring->capacity);
+}
+
+static inline void safariCookieRingRelease(struct SafariCookieRing * ring, const struct SafariCookieRingFrame * frame) {
+    const uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store(&ring->tail, tail + frame->span);
+    safariCookieRingHeartbeat(ring);
+    if (atomic_load(&ring->producerWaiting)) {
+        safariCookieRingWake(&ring->tailSignal);
+    }
+}
+
+// Wait for the next frame, skipping padding. Returns zero once the producer has closed the ring and
+// every frame has been consumed.
+static inline int safariCookieRingNext(struct SafariCookieRing * ring, struct SafariCookieRingFrame * frame) {
+    for (;;) {
+        const uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        const uint32_t seen = atomic_load(&ring->headSignal);
+        const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head != tail) {
+            const unsigned char * base = ring->data + (tail & (ring->capacity - 1));
+            uint32_t header[2];
+            memcpy(header, base, sizeof(header));
+            if (SAFARI_COOKIE_RING_FRAME_PADDING == header[0]) {
+                // Padding always runs to the end of the ring
+                const struct SafariCookieRingFrame padding = {
+                    SAFARI_COOKIE_RING_FRAME_PADDING, 0, 0, ring->capacity - (tail & (ring->capacity - 1)),
+                };
+                safariCookieRingRelease(ring, &padding);
+                continue;
+            }
+            frame->type = header[0];
+            frame->size = header[1];
+            frame->payload = base + SAFARI_COOKIE_RING_FRAME_HEADER_SIZE;
+            frame->span = safariCookieRingAlign(SAFARI_COOKIE_RING_FRAME_HEADER_SIZE + header[1]);
+            safariCookieRingHeartbeat(ring);
+            return 1;
+        } else if (atomic_load(&ring->closed)) {
+            return 0;
+        } else {
+            atomic_store(&ring->consumerWaiting, 1);
+            if (atomic_load(&ring->head) == tail && !atomic_load(&ring->closed)) {
+                safariCookieRingWait(&ring->headSignal, seen);
+            }
+            atomic_store(&ring->consumerWaiting, 0);
+        }
+    }
+}
+
+// Returns zero if the frame is malformed
+static inline int safariCookieRingDecodeCookie(const struct SafariCookieRingFrame * frame, struct SafariCookie * cookie) {
+    if (frame->size < SAFARI_COOKIE_RING_COOKIE_FIXED_SIZE) {
+        return 0;
+    }
+    const unsigned char * cursor = frame->payload;
+    const unsigned char * end = frame->payload + frame->size;
+    memcpy(&cookie->version, cursor, sizeof(uint32_t));
+    memcpy(&cookie->flags, cursor + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&cookie->expiry, cursor + 2 * sizeof(uint32_t), sizeof(double));
+    memcpy(&cookie->creation, cursor + 2 * sizeof(uint32_t) + sizeof(double), sizeof(double));
+    cursor += SAFARI_COOKIE_RING_COOKIE_FIXED_SIZE;
+    const char ** strings[] = {
+        &cookie->domain, &cookie->name, &cookie->path, &cookie->value, &cookie->comment, &cookie->commentUrl,
+    };
+    for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        uint32_t size;
+        if (end - cursor < sizeof(size)) {
+            return 0;
+        }
+        memcpy(&size, cursor, sizeof(size));
+        cursor += sizeof(size);
+        if (end - cursor < size || (size && cursor[size - 1])) {
+            return 0;
+        }
+        *strings[i] = size ? (const char *)cursor : 0;
+        cursor += size;
+    }
+    return 1;
+}
+
+#endif
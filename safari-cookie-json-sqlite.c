@@ -0,0 +1,355 @@
+// A loadable SQLite extension, so cookie files can be queried in place rather than exported and imported.
+//
+//     .load ./safari-cookie-json-sqlite
+//     SELECT name, value FROM binarycookies('Cookies.binarycookies') WHERE domain LIKE '%.example.com';
+//
+// binarycookies is a table valued function over the same record walk as the tool, which is built into the
+// extension by including it whole. Constraints on domain, name and expiry are pushed into the walk as a
+// filter, so cookies which can't match are never handed to SQLite at all. SQLite still checks every
+// constraint itself, so the filter only has to be loose enough, never exact.
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+
+#define SAFARI_COOKIE_JSON_NO_MAIN
+#include "safari-cookie-json.c"
+
+enum {
+    VTAB_COLUMN_VERSION,
+    VTAB_COLUMN_FLAGS,
+    VTAB_COLUMN_DOMAIN,
+    VTAB_COLUMN_NAME,
+    VTAB_COLUMN_PATH,
+    VTAB_COLUMN_VALUE,
+    VTAB_COLUMN_COMMENT,
+    VTAB_COLUMN_COMMENT_URL,
+    VTAB_COLUMN_EXPIRY,
+    VTAB_COLUMN_CREATION,
+    VTAB_COLUMN_FILENAME,
+};
+
+// How each xFilter argument is used, one character each in idxStr
+enum {
+    VTAB_ARGUMENT_FILENAME = 'F',
+    VTAB_ARGUMENT_DOMAIN_EQ = 'D',
+    VTAB_ARGUMENT_DOMAIN_LIKE = 'L',
+    VTAB_ARGUMENT_NAME_EQ = 'N',
+    VTAB_ARGUMENT_MIN_EXPIRY = '>',
+    VTAB_ARGUMENT_MAX_EXPIRY = '<',
+};
+
+struct CookieVtabCursor {
+    sqlite3_vtab_cursor base;
+    struct MappedFile file;
+    int mapped;
+    // The matching cookies, whose strings point into the mapped file
+    struct SafariCookie * cookies;
+    sqlite3_int64 cookieCount;
+    sqlite3_int64 cookieCapacity;
+    sqlite3_int64 cookieIdx;
+    // Copied, since the filter and the argument values only last for the xFilter call
+    char * domain;
+    char * name;
+    // Backs file.filename and the filename column
+    char * filename;
+    int failed;
+};
+
+int cookieVtabConnect(sqlite3 * db, void * aux, int argc, const char * const * argv, sqlite3_vtab ** vtab,
+    char ** error) {
+    const int result = sqlite3_declare_vtab(db, "CREATE TABLE x(version INTEGER, flags INTEGER, domain TEXT, "
+        "name TEXT, path TEXT, value TEXT, comment TEXT, commentUrl TEXT, expiry REAL, creation REAL, "
+        "filename HIDDEN)");
+    if (SQLITE_OK != result) {
+        return result;
+    }
+    *vtab = sqlite3_malloc(sizeof(**vtab));
+    if (!*vtab) {
+        return SQLITE_NOMEM;
+    }
+    memset(*vtab, 0, sizeof(**vtab));
+    return SQLITE_OK;
+}
+
+int cookieVtabDisconnect(sqlite3_vtab * vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+// The file name is required. Everything else is used if it's there, but always left for SQLite to check too.
+int cookieVtabBestIndex(sqlite3_vtab * vtab, sqlite3_index_info * info) {
+    char ops[32];
+    int argumentCount = 0;
+    int hasFilename = 0;
+    for (int i = 0; i < info->nConstraint && argumentCount < sizeof(ops) - 1; ++i) {
+        const struct sqlite3_index_constraint * constraint = &info->aConstraint[i];
+        if (!constraint->usable) {
+            continue;
+        }
+        // The filters compare bytes, and the domain filter ignores case, so other collations can't use them
+        const char * collation = sqlite3_vtab_collation(info, i);
+        const int binary = !collation || !sqlite3_stricmp(collation, "BINARY");
+        const int noCase = binary || !sqlite3_stricmp(collation, "NOCASE");
+        char op = 0;
+        if (VTAB_COLUMN_FILENAME == constraint->iColumn && SQLITE_INDEX_CONSTRAINT_EQ == constraint->op) {
+            op = VTAB_ARGUMENT_FILENAME;
+            hasFilename = 1;
+        } else if (VTAB_COLUMN_DOMAIN == constraint->iColumn && SQLITE_INDEX_CONSTRAINT_EQ == constraint->op
+            && noCase) {
+            op = VTAB_ARGUMENT_DOMAIN_EQ;
+        } else if (VTAB_COLUMN_DOMAIN == constraint->iColumn && SQLITE_INDEX_CONSTRAINT_LIKE == constraint->op) {
+            op = VTAB_ARGUMENT_DOMAIN_LIKE;
+        } else if (VTAB_COLUMN_NAME == constraint->iColumn && SQLITE_INDEX_CONSTRAINT_EQ == constraint->op
+            && binary) {
+            op = VTAB_ARGUMENT_NAME_EQ;
+        } else if (VTAB_COLUMN_EXPIRY == constraint->iColumn && (SQLITE_INDEX_CONSTRAINT_GT == constraint->op
+            || SQLITE_INDEX_CONSTRAINT_GE == constraint->op)) {
+            op = VTAB_ARGUMENT_MIN_EXPIRY;
+        } else if (VTAB_COLUMN_EXPIRY == constraint->iColumn && (SQLITE_INDEX_CONSTRAINT_LT == constraint->op
+            || SQLITE_INDEX_CONSTRAINT_LE == constraint->op)) {
+            op = VTAB_ARGUMENT_MAX_EXPIRY;
+        }
+        if (op) {
+            ops[argumentCount++] = op;
+            info->aConstraintUsage[i].argvIndex = argumentCount;
+            info->aConstraintUsage[i].omit = VTAB_ARGUMENT_FILENAME == op;
+        }
+    }
+    if (!hasFilename) {
+        // Make any plan with a file name win, and fail in xFilter if there isn't one
+        info->estimatedCost = 1e99;
+        info->idxStr = 0;
+        return SQLITE_OK;
+    }
+    ops[argumentCount] = 0;
+    info->idxStr = sqlite3_mprintf("%s", ops);
+    info->needToFreeIdxStr = 1;
+    // Every pushed constraint cuts down what we hand over
+    info->estimatedCost = 1e6 / (1 << (argumentCount - 1));
+    return info->idxStr ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+int cookieVtabOpen(sqlite3_vtab * vtab, sqlite3_vtab_cursor ** cursor) {
+    struct CookieVtabCursor * result = sqlite3_malloc(sizeof(*result));
+    if (!result) {
+        return SQLITE_NOMEM;
+    }
+    memset(result, 0, sizeof(*result));
+    *cursor = &result->base;
+    return SQLITE_OK;
+}
+
+void resetCookieVtabCursor(struct CookieVtabCursor * cursor) {
+    if (cursor->mapped) {
+        closeFile(cursor->file.fd, unmapFd(&cursor->file, EXIT_CODE_OK));
+        cursor->mapped = 0;
+    }
+    sqlite3_free(cursor->cookies);
+    sqlite3_free(cursor->domain);
+    sqlite3_free(cursor->name);
+    sqlite3_free(cursor->filename);
+    cursor->cookies = 0;
+    cursor->domain = 0;
+    cursor->name = 0;
+    cursor->filename = 0;
+    cursor->file.filename = 0;
+    cursor->cookieCount = 0;
+    cursor->cookieCapacity = 0;
+    cursor->cookieIdx = 0;
+    cursor->failed = 0;
+}
+
+int cookieVtabClose(sqlite3_vtab_cursor * cursor) {
+    resetCookieVtabCursor((struct CookieVtabCursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+// An in process plugin, collecting the cookies which got through the filter. The strings point into the
+// mapped file, which the cursor keeps mapped, so there's nothing to copy.
+void collectVtabCookies(void * context, const struct SafariCookie * cookies, uint32_t cookieCount) {
+    struct CookieVtabCursor * cursor = context;
+    if (cursor->failed) {
+        return;
+    }
+    if (cursor->cookieCapacity - cursor->cookieCount < cookieCount) {
+        sqlite3_int64 capacity = cursor->cookieCapacity ? cursor->cookieCapacity : 1024;
+        while (capacity - cursor->cookieCount < cookieCount) {
+            capacity *= 2;
+        }
+        struct SafariCookie * grown = sqlite3_realloc64(cursor->cookies, capacity * sizeof(*grown));
+        if (!grown) {
+            cursor->failed = 1;
+            return;
+        }
+        cursor->cookies = grown;
+        cursor->cookieCapacity = capacity;
+    }
+    memcpy(cursor->cookies + cursor->cookieCount, cookies, cookieCount * sizeof(*cookies));
+    cursor->cookieCount += cookieCount;
+}
+
+// Only a pattern of % and then a literal starting with a dot is a subdomain match, which the domain filter
+// covers. Anything else isn't pushed down. LIKE is case insensitive, and so is the filter.
+char * likeDomainSuffix(const char * pattern) {
+    if (!pattern || '%' != pattern[0] || '.' != pattern[1] || strpbrk(pattern + 1, "%_")) {
+        return 0;
+    }
+    return sqlite3_mprintf("%s", pattern + 1);
+}
+
+int cookieVtabFilter(sqlite3_vtab_cursor * base, int idxNum, const char * idxStr, int argc, sqlite3_value ** argv) {
+    struct CookieVtabCursor * cursor = (struct CookieVtabCursor *)base;
+    resetCookieVtabCursor(cursor);
+    if (!idxStr) {
+        sqlite3_free(base->pVtab->zErrMsg);
+        base->pVtab->zErrMsg = sqlite3_mprintf("binarycookies needs a file name, as binarycookies('FILENAME')");
+        return SQLITE_ERROR;
+    }
+
+    struct Run run = { .sinkCount = 1 };
+    for (int i = 0; i < argc; ++i) {
+        const char * text = (const char *)sqlite3_value_text(argv[i]);
+        const double number = sqlite3_value_double(argv[i]);
+        // Text and blobs sort after every number, so only numbers can bound the expiry
+        const int numeric = SQLITE_INTEGER == sqlite3_value_type(argv[i]) || SQLITE_FLOAT == sqlite3_value_type(argv[i]);
+        switch (idxStr[i]) {
+            case VTAB_ARGUMENT_FILENAME:
+                if (text && !cursor->filename && !(cursor->filename = sqlite3_mprintf("%s", text))) {
+                    return SQLITE_NOMEM;
+                }
+                break;
+            case VTAB_ARGUMENT_DOMAIN_EQ:
+                if (text && !cursor->domain) {
+                    cursor->domain = sqlite3_mprintf("%s", text);
+                }
+                break;
+            case VTAB_ARGUMENT_DOMAIN_LIKE:
+                if (!cursor->domain) {
+                    cursor->domain = likeDomainSuffix(text);
+                }
+                break;
+            case VTAB_ARGUMENT_NAME_EQ:
+                if (text && !cursor->name) {
+                    cursor->name = sqlite3_mprintf("%s", text);
+                }
+                break;
+            case VTAB_ARGUMENT_MIN_EXPIRY:
+                if (numeric && (!run.filter.hasMinExpiry || number > run.filter.minExpiry)) {
+                    run.filter.hasMinExpiry = 1;
+                    run.filter.minExpiry = number;
+                }
+                break;
+            case VTAB_ARGUMENT_MAX_EXPIRY:
+                if (numeric && (!run.filter.hasMaxExpiry || number < run.filter.maxExpiry)) {
+                    run.filter.hasMaxExpiry = 1;
+                    run.filter.maxExpiry = number;
+                }
+                break;
+        }
+    }
+    run.filter.domain = cursor->domain;
+    run.filter.name = cursor->name;
+    const char * filename = cursor->filename;
+    if (!filename) {
+        // A null file name matches nothing
+        return SQLITE_OK;
+    }
+
+    struct CookieSink * sink = &run.sinks[0];
+    memset(sink, 0, sizeof(*sink));
+    sink->beginFile = pluginSinkBeginFile;
+    sink->beginPage = pluginSinkBeginPage;
+    sink->cookie = pluginSinkCookie;
+    sink->endPage = pluginSinkEndPage;
+    sink->plist = pluginSinkPlist;
+    sink->endFile = pluginSinkEndFile;
+    sink->close = pluginSinkClose;
+    sink->plugin.abiVersion = SAFARI_COOKIE_PLUGIN_ABI_VERSION;
+    sink->plugin.context = cursor;
+    sink->plugin.cookies = collectVtabCookies;
+
+    // Only binary cookie files, since rows from a SQLite store don't outlive the walk
+    int exitCode = EXIT_CODE_BAD_OPEN;
+    cursor->file.filename = filename;
+    cursor->file.fd = open(filename, O_RDONLY);
+    if (-1 == cursor->file.fd) {
+        perror("Cannot open file");
+    } else if ((exitCode = mapFd(&cursor->file))) {
+        closeFile(cursor->file.fd, exitCode);
+    } else {
+        cursor->mapped = 1;
+        exitCode = decodeBinaryCookiesFromMmap(&run, filename, cursor->file.length, cursor->file.data);
+    }
+    runFinishFile(&run, filename, exitCode);
+    closeSink(sink);
+    if (cursor->failed) {
+        return SQLITE_NOMEM;
+    } else if (exitCode) {
+        sqlite3_free(base->pVtab->zErrMsg);
+        base->pVtab->zErrMsg = sqlite3_mprintf("Cannot read cookies from %s, exit code %d", filename, exitCode);
+        return SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+int cookieVtabNext(sqlite3_vtab_cursor * cursor) {
+    ++((struct CookieVtabCursor *)cursor)->cookieIdx;
+    return SQLITE_OK;
+}
+
+int cookieVtabEof(sqlite3_vtab_cursor * cursor) {
+    const struct CookieVtabCursor * vtabCursor = (const struct CookieVtabCursor *)cursor;
+    return vtabCursor->cookieIdx >= vtabCursor->cookieCount;
+}
+
+void resultCookieText(sqlite3_context * context, const char * value) {
+    if (value) {
+        sqlite3_result_text(context, value, -1, SQLITE_STATIC);
+    } else {
+        sqlite3_result_null(context);
+    }
+}
+
+int cookieVtabColumn(sqlite3_vtab_cursor * cursor, sqlite3_context * context, int column) {
+    const struct CookieVtabCursor * vtabCursor = (const struct CookieVtabCursor *)cursor;
+    const struct SafariCookie * cookie = &vtabCursor->cookies[vtabCursor->cookieIdx];
+    switch (column) {
+        case VTAB_COLUMN_VERSION: sqlite3_result_int64(context, cookie->version); break;
+        case VTAB_COLUMN_FLAGS: sqlite3_result_int64(context, cookie->flags); break;
+        case VTAB_COLUMN_DOMAIN: resultCookieText(context, cookie->domain); break;
+        case VTAB_COLUMN_NAME: resultCookieText(context, cookie->name); break;
+        case VTAB_COLUMN_PATH: resultCookieText(context, cookie->path); break;
+        case VTAB_COLUMN_VALUE: resultCookieText(context, cookie->value); break;
+        case VTAB_COLUMN_COMMENT: resultCookieText(context, cookie->comment); break;
+        case VTAB_COLUMN_COMMENT_URL: resultCookieText(context, cookie->commentUrl); break;
+        case VTAB_COLUMN_EXPIRY: sqlite3_result_double(context, cookie->expiry); break;
+        case VTAB_COLUMN_CREATION: sqlite3_result_double(context, cookie->creation); break;
+        case VTAB_COLUMN_FILENAME: resultCookieText(context, vtabCursor->file.filename); break;
+    }
+    return SQLITE_OK;
+}
+
+int cookieVtabRowid(sqlite3_vtab_cursor * cursor, sqlite3_int64 * rowid) {
+    *rowid = ((const struct CookieVtabCursor *)cursor)->cookieIdx;
+    return SQLITE_OK;
+}
+
+const sqlite3_module COOKIE_VTAB_MODULE = {
+    .xConnect = cookieVtabConnect,
+    .xBestIndex = cookieVtabBestIndex,
+    .xDisconnect = cookieVtabDisconnect,
+    .xOpen = cookieVtabOpen,
+    .xClose = cookieVtabClose,
+    .xFilter = cookieVtabFilter,
+    .xNext = cookieVtabNext,
+    .xEof = cookieVtabEof,
+    .xColumn = cookieVtabColumn,
+    .xRowid = cookieVtabRowid,
+};
+
+int sqlite3_extension_init(sqlite3 * db, char ** error, const sqlite3_api_routines * api) {
+    SQLITE_EXTENSION_INIT2(api);
+    selectKernels(0);
+    return sqlite3_create_module(db, "binarycookies", &COOKIE_VTAB_MODULE, 0);
+}
@@ -0,0 +1,630 @@
+// A check that the faster ways of decoding a file all agree with the plain one, and that the filters give
+// known answers, built by make check as safari-cookie-json-verify, apart from the tool so that none of this
+// ships in it
+//
+//     ./safari-cookie-json-verify [--seed SEED] COUNT [FILENAME...]
+//
+// The tool is built in whole by including it, as for the SQLite extension, and the kernels and --utf8 mode,
+// which are only set once at startup in the tool, are switched here between runs. The file generators are
+// here too, and safari-cookie-json-bench.c includes this file in turn for them.
+
+#define SAFARI_COOKIE_JSON_NO_MAIN
+#include "safari-cookie-json.c"
+
+// Generated files, for exercising the walk. They're random, but repeatable from the seed, and valid, checksum
+// and all.
+enum {
+    VERIFY_MAX_PAGE_COUNT = 8,
+    VERIFY_MAX_COOKIE_COUNT = 30,
+    VERIFY_MAX_STRING_LENGTH = 300,
+};
+
+// The plist Safari writes, {"NSHTTPCookieAcceptPolicy": 2}
+const unsigned char VERIFY_PLIST[] = {
+    0x62, 0x70, 0x6c, 0x69, 0x73, 0x74, 0x30, 0x30, 0xd1, 0x01, 0x02, 0x5f, 0x10, 0x18, 0x4e, 0x53, 0x48, 0x54,
+    0x54, 0x50, 0x43, 0x6f, 0x6f, 0x6b, 0x69, 0x65, 0x41, 0x63, 0x63, 0x65, 0x70, 0x74, 0x50, 0x6f, 0x6c, 0x69,
+    0x63, 0x79, 0x10, 0x02, 0x08, 0x0b, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x28,
+};
+
+// splitmix64, since runs have to be repeatable from the seed, which arc4random isn't
+uint64_t nextRandom(uint64_t * state) {
+    uint64_t value = (*state += 0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+uint32_t nextRandomBelow(uint64_t * state, uint32_t limit) {
+    return nextRandom(state) % limit;
+}
+
+void write32Hi(FILE * out, uint32_t value) {
+    const unsigned char bytes[] = { value >> 24, value >> 16, value >> 8, value };
+    fwrite(bytes, 1, sizeof(bytes), out);
+}
+
+void write32Lo(FILE * out, uint32_t value) {
+    const unsigned char bytes[] = { value, value >> 8, value >> 16, value >> 24 };
+    fwrite(bytes, 1, sizeof(bytes), out);
+}
+
+void writeDouble(FILE * out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    write32Lo(out, bits);
+    write32Lo(out, bits >> 32);
+}
+
+// Strings that are mostly clean, to exercise the wide scans, with some of everything that needs attention
+size_t generateCookieString(uint64_t * random, char * buffer) {
+    static const char * const SPECIALS[] = {
+        "\"", "\\", "\n", "\r", "\t", ",", "\x01", "\x1F", "\x7F", "/", "é", "✓", "😀", "\xC0\xAF", "\xED\xA0\x80",
+        "\xF4\x90\x80\x80", "\xFF", "\xE2\x9C", "\xF0\x9F\x98",
+    };
+    const size_t length = nextRandomBelow(random, 4) ? nextRandomBelow(random, 40)
+        : nextRandomBelow(random, VERIFY_MAX_STRING_LENGTH);
+    size_t used = 0;
+    while (used < length) {
+        const char * special = SPECIALS[nextRandomBelow(random, sizeof(SPECIALS) / sizeof(SPECIALS[0]))];
+        if (!nextRandomBelow(random, 8) && used + strlen(special) <= length) {
+            memcpy(buffer + used, special, strlen(special));
+            used += strlen(special);
+        } else {
+            buffer[used++] = ' ' + 1 + nextRandomBelow(random, '~' - ' ');
+        }
+    }
+    buffer[used] = 0;
+    return used + 1;
+}
+
+void generateCookie(uint64_t * random, FILE * out) {
+    enum { STRING_COUNT = 6 };
+    char strings[STRING_COUNT][VERIFY_MAX_STRING_LENGTH + 8];
+    uint32_t sizes[STRING_COUNT];
+    // Domain, name, path, and value are nearly always there, the comments hardly ever
+    for (int stringIdx = 0; stringIdx < STRING_COUNT; ++stringIdx) {
+        const int present = stringIdx < 4 ? nextRandomBelow(random, 16) : !nextRandomBelow(random, 4);
+        sizes[stringIdx] = present ? generateCookieString(random, strings[stringIdx]) : 0;
+    }
+    static const double EXPIRIES[] = { 0, -1, 0.5, 1e300, 123456789.125, 800000000 };
+    const uint32_t headerSize = 10 * sizeof(uint32_t) + 2 * sizeof(double);
+    uint32_t cookieSize = headerSize;
+    for (int stringIdx = 0; stringIdx < STRING_COUNT; ++stringIdx) {
+        cookieSize += sizes[stringIdx];
+    }
+    // The record has to end with a null, so a cookie with no strings gets an empty value
+    if (headerSize == cookieSize) {
+        strings[3][0] = 0;
+        sizes[3] = 1;
+        ++cookieSize;
+    }
+    write32Lo(out, cookieSize);
+    write32Lo(out, nextRandomBelow(random, 2));
+    write32Lo(out, nextRandomBelow(random, 4) ? nextRandomBelow(random, 8) : nextRandom(random));
+    write32Lo(out, 0);
+    uint32_t offset = headerSize;
+    for (int stringIdx = 0; stringIdx < STRING_COUNT; ++stringIdx) {
+        write32Lo(out, sizes[stringIdx] ? offset : 0);
+        offset += sizes[stringIdx];
+    }
+    writeDouble(out, EXPIRIES[nextRandomBelow(random, sizeof(EXPIRIES) / sizeof(EXPIRIES[0]))]
+        + nextRandomBelow(random, 1 << 30));
+    writeDouble(out, nextRandomBelow(random, 1 << 30) / 3.0);
+    for (int stringIdx = 0; stringIdx < STRING_COUNT; ++stringIdx) {
+        fwrite(strings[stringIdx], 1, sizes[stringIdx], out);
+    }
+}
+
+// Pages are built separately, since the header needs their sizes first
+int generatePage(uint64_t * random, char ** page, size_t * pageSize) {
+    FILE * out = open_memstream(page, pageSize);
+    if (!out) {
+        return 0;
+    }
+    const uint32_t cookieCount = nextRandomBelow(random, VERIFY_MAX_COOKIE_COUNT + 1);
+    char * cookies;
+    size_t cookiesSize;
+    FILE * cookiesOut = open_memstream(&cookies, &cookiesSize);
+    if (!cookiesOut) {
+        fclose(out);
+        free(*page);
+        return 0;
+    }
+    fwrite(COOKIE_PAGE_TAG, 1, sizeof(COOKIE_PAGE_TAG), out);
+    write32Lo(out, cookieCount);
+    const uint32_t headerSize = sizeof(COOKIE_PAGE_TAG) + (cookieCount + 1) * sizeof(uint32_t)
+        + sizeof(COOKIE_PAGE_HEADER_END);
+    for (uint32_t cookieIdx = 0; cookieIdx < cookieCount; ++cookieIdx) {
+        fflush(cookiesOut);
+        write32Lo(out, headerSize + cookiesSize);
+        generateCookie(random, cookiesOut);
+    }
+    fclose(cookiesOut);
+    fwrite(COOKIE_PAGE_HEADER_END, 1, sizeof(COOKIE_PAGE_HEADER_END), out);
+    fwrite(cookies, 1, cookiesSize, out);
+    free(cookies);
+    return !fclose(out);
+}
+
+// Puts pages together into a file, with the checksum, footer and plist, returned in a malloced buffer
+int assembleCookieFile(char * const * pages, const size_t * pageSizes, uint32_t pageCount, char ** data,
+    size_t * length) {
+    FILE * out = open_memstream(data, length);
+    if (!out) {
+        return 0;
+    }
+    fwrite(BINARY_COOKIE_MAGIC, 1, sizeof(BINARY_COOKIE_MAGIC), out);
+    write32Hi(out, pageCount);
+    uint32_t checkSum = 0;
+    for (uint32_t i = 0; i < pageCount; ++i) {
+        write32Hi(out, pageSizes[i]);
+        checkSum += pageCheckSumScalar(pages[i], pages[i] + pageSizes[i]);
+    }
+    for (uint32_t i = 0; i < pageCount; ++i) {
+        fwrite(pages[i], 1, pageSizes[i], out);
+    }
+    write32Hi(out, checkSum);
+    fwrite(BINARY_COOKIE_FOOTER, 1, sizeof(BINARY_COOKIE_FOOTER), out);
+    write32Hi(out, sizeof(VERIFY_PLIST));
+    fwrite(VERIFY_PLIST, 1, sizeof(VERIFY_PLIST), out);
+    return !fclose(out);
+}
+
+// A valid file, returned in a malloced buffer
+int generateCookieFile(uint64_t * random, char ** data, size_t * length) {
+    const uint32_t pageCount = nextRandomBelow(random, VERIFY_MAX_PAGE_COUNT + 1);
+    char * pages[VERIFY_MAX_PAGE_COUNT];
+    size_t pageSizes[VERIFY_MAX_PAGE_COUNT];
+    uint32_t pageIdx = 0;
+    for (; pageIdx < pageCount && generatePage(random, &pages[pageIdx], &pageSizes[pageIdx]); ++pageIdx) {
+    }
+    const int generated = pageIdx == pageCount && assembleCookieFile(pages, pageSizes, pageCount, data, length);
+    while (pageIdx) {
+        free(pages[--pageIdx]);
+    }
+    return generated;
+}
+
+// Writes data to a temporary file, since the windowed walk and the pipeline need a real file to map
+char * writeTemporaryFile(const char * data, size_t length, const char * purpose) {
+    const char * directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char * filename = malloc(strlen(directory) + strlen("/safari-cookie-json-.XXXXXX") + strlen(purpose) + 1);
+    if (!filename) {
+        fprintf(stderr, "Cannot write %s file: %s\n", purpose, strerror(errno));
+        return 0;
+    }
+    sprintf(filename, "%s/safari-cookie-json-%s.XXXXXX", directory, purpose);
+    const int fd = mkstemp(filename);
+    FILE * out = -1 == fd ? 0 : fdopen(fd, "w");
+    if (!out || length != fwrite(data, 1, length, out) || fclose(out)) {
+        fprintf(stderr, "Cannot write %s file: %s\n", purpose, strerror(errno));
+        if (-1 != fd) {
+            unlink(filename);
+        }
+        free(filename);
+        return 0;
+    }
+    return filename;
+}
+
+// This checks that the faster ways of decoding a file - each kernel, windowed walks, and the pipeline - all
+// give exactly the output and exit code of the plain scalar walk. It runs files given on the command line,
+// and generated ones, each as is and with a few mutations, through every combination and every --utf8 mode.
+// Mutations mostly make files fail part way through, which is exactly where the walks are most likely to
+// disagree, and some have the checksum fixed up afterwards so the odd bytes get all the way to the output.
+enum {
+    VERIFY_MUTATION_COUNT = 8,
+};
+
+// Recompute the file checksum after a mutation, if the page table still leads to one. This is quietly
+// decodeFileHeader, which would complain about the files it gives up on.
+void repairCheckSum(char * data, size_t length) {
+    if (length < sizeof(BINARY_COOKIE_MAGIC) + sizeof(uint32_t)) {
+        return;
+    }
+    const char * pageSizeBase = data + sizeof(BINARY_COOKIE_MAGIC);
+    const uint32_t pageCount = read32Hi(&pageSizeBase);
+    if ((length - (pageSizeBase - data)) / sizeof(uint32_t) < pageCount) {
+        return;
+    }
+    const char * pageBase = pageSizeBase + pageCount * sizeof(uint32_t);
+    uint32_t checkSum = 0;
+    for (uint32_t pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        const uint32_t pageSize = read32Hi(&pageSizeBase);
+        if (data + length - pageBase < pageSize) {
+            return;
+        }
+        checkSum += pageCheckSumScalar(pageBase, pageBase + pageSize);
+        pageBase += pageSize;
+    }
+    if (data + length - pageBase >= sizeof(uint32_t)) {
+        char * checkSumBase = data + (pageBase - data);
+        for (int byteIdx = 0; byteIdx < sizeof(uint32_t); ++byteIdx) {
+            checkSumBase[byteIdx] = checkSum >> (24 - 8 * byteIdx);
+        }
+    }
+}
+
+// Mutates the length bytes at data, which is allocated with room for that many
+size_t mutateCookieFile(uint64_t * random, char * data, size_t length) {
+    static const uint32_t WORDS[] = { 0, 1, 4, 55, 56, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF };
+    if (!length) {
+        return length;
+    }
+    const size_t offset = nextRandomBelow(random, length);
+    switch (nextRandomBelow(random, 5)) {
+        case 0:
+            data[offset] ^= 1 << nextRandomBelow(random, 8);
+            break;
+        case 3: {
+            // A sequence cut short, which should come out as one U+FFFD however much of it there is
+            static const char * const TRUNCATED[] = { "\xC3", "\xE2\x9C", "\xF0\x9F", "\xF0\x9F\x98" };
+            const char * truncated = TRUNCATED[nextRandomBelow(random, sizeof(TRUNCATED) / sizeof(TRUNCATED[0]))];
+            const size_t truncatedLength = strlen(truncated);
+            memcpy(data + offset, truncated, truncatedLength <= length - offset ? truncatedLength : length - offset);
+            break;
+        }
+        case 1: {
+            // Land on a field, which are all four byte aligned
+            const size_t wordOffset = offset & ~(size_t)3;
+            uint32_t word = WORDS[nextRandomBelow(random, sizeof(WORDS) / sizeof(WORDS[0]))];
+            if (!nextRandomBelow(random, 4)) {
+                word = length - wordOffset + nextRandomBelow(random, 9) - 4;
+            }
+            memcpy(data + wordOffset, &word, sizeof(word) <= length - wordOffset ? sizeof(word) : length - wordOffset);
+            break;
+        }
+        case 2:
+            length = offset;
+            break;
+        default: {
+            static const char BYTES[] = { 0, '"', '\\', '\n', ',', '\x80', '\xC3', '\xFF' };
+            data[offset] = BYTES[nextRandomBelow(random, sizeof(BYTES))];
+            break;
+        }
+    }
+    if (nextRandomBelow(random, 2)) {
+        repairCheckSum(data, length);
+    }
+    return length;
+}
+
+// One way of decoding a file, where the first is the reference
+struct VerifyVariant {
+    const struct Kernels * kernels;
+    off_t windowSize;
+    int pipelined;
+};
+
+struct VerifyOutput {
+    char * text;
+    size_t size;
+    int exitCode;
+};
+
+// Every text format at once, interleaved into the one stream, which is as deterministic as each alone.
+// stats isn't included, since it has timings in.
+const char * const VERIFY_FORMATS[] = { "json", "ndjson", "csv", "storagestate" };
+
+int runVerifyVariant(const struct VerifyVariant * variant, const char * filename, struct VerifyOutput * output) {
+    struct Run run = { .windowSize = variant->windowSize, .plist = 1 };
+    FILE * out = open_memstream(&output->text, &output->size);
+    if (!out) {
+        perror("Cannot buffer output");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    for (; run.sinkCount < sizeof(VERIFY_FORMATS) / sizeof(VERIFY_FORMATS[0]); ++run.sinkCount) {
+        openSink(&run.sinks[run.sinkCount], VERIFY_FORMATS[run.sinkCount]);
+        run.sinks[run.sinkCount].out = out;
+        run.sinks[run.sinkCount].locators = 1;
+    }
+    const struct Kernels * selected = kernels;
+    kernels = variant->kernels;
+    if (variant->pipelined) {
+        output->exitCode = printCookiesFromFilenamesPipelined(&run, &filename, 1);
+    } else {
+        output->exitCode = runFinishFile(&run, filename, printCookiesFromFilename(&run, filename));
+    }
+    kernels = selected;
+    for (int sinkIdx = 0; sinkIdx < run.sinkCount; ++sinkIdx) {
+        closeSink(&run.sinks[sinkIdx]);
+    }
+    if (fclose(out)) {
+        perror("Cannot buffer output");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    return EXIT_CODE_OK;
+}
+
+const char * const UTF8_MODE_NAMES[] = { "pass", "replace", "ascii" };
+
+// The variants are only compared with each other, so they'd all agree on a decoder bug. These are known
+// answers for --utf8 ascii, the first being the example in the Unicode standard's section on U+FFFD
+// substitution, with one U+FFFD per maximal subpart.
+const char * const UTF8_SUBSTITUTIONS[][2] = {
+    { "a\xF1\x80\x80\xE1\x80\xC2" "b\x80" "c\x80\xBF" "d", "\"a\\uFFFD\\uFFFD\\uFFFDb\\uFFFDc\\uFFFD\\uFFFDd\"" },
+    { "\xE2\x9C", "\"\\uFFFD\"" },
+    { "\xF0\x9F\x98x", "\"\\uFFFDx\"" },
+    { "\xE0\x80\x80", "\"\\uFFFD\\uFFFD\\uFFFD\"" },
+    { "\xED\xA0\x80", "\"\\uFFFD\\uFFFD\\uFFFD\"" },
+    { "\xF4\x90\x80\x80", "\"\\uFFFD\\uFFFD\\uFFFD\\uFFFD\"" },
+    { "\xF0\x9F\x98\x80", "\"\\uD83D\\uDE00\"" },
+    { "\xEF\xBF\xBD\xC3", "\"\\uFFFD\\uFFFD\"" },
+};
+
+// Returns the number of wrong answers
+unsigned long long verifyUtf8Substitution(void) {
+    const enum Utf8Mode selectedMode = utf8Mode;
+    utf8Mode = UTF8_MODE_ASCII;
+    unsigned long long mismatchCount = 0;
+    for (int i = 0; i < sizeof(UTF8_SUBSTITUTIONS) / sizeof(UTF8_SUBSTITUTIONS[0]); ++i) {
+        char * text;
+        size_t size;
+        FILE * out = open_memstream(&text, &size);
+        if (!out) {
+            perror("Cannot buffer output");
+            ++mismatchCount;
+            continue;
+        }
+        emitJsonString(out, UTF8_SUBSTITUTIONS[i][0]);
+        if (fclose(out) || strcmp(text, UTF8_SUBSTITUTIONS[i][1])) {
+            fprintf(stderr, "Mismatch for --utf8 substitution case %d: %s for %s\n", i, text, UTF8_SUBSTITUTIONS[i][1]);
+            ++mismatchCount;
+        }
+        free(text);
+    }
+    utf8Mode = selectedMode;
+    return mismatchCount;
+}
+
+// Known answers for the filters, on a Chromium store. Every cookie has a distinct name, and a case passes if
+// it gets count cookies, each named in names.
+struct VerifyFilterCase {
+    const char * domain;
+    int unexpired;
+    uint64_t sampleSize;
+    uint64_t samplePerDomain;
+    const char * names;
+    uint64_t count;
+};
+
+// Sampling has to pick from the matching cookies, not pick from them all and then filter
+const struct VerifyFilterCase VERIFY_FILTER_CASES[] = {
+    { "example.test", 1, 0, 0, " live session sub ", 3 },
+    { "example.test", 0, 3, 0, " live session expired sub ", 3 },
+    { ".EXAMPLE.test", 1, 10, 0, " live session sub ", 3 },
+    { "example.test", 0, 0, 1, " live session expired sub ", 2 },
+    { "sub.example.test", 0, 1, 1, " sub ", 1 },
+};
+
+// Chromium times are microseconds since 1601, so these are in 2234 and 1917
+const char VERIFY_FILTER_STORE[] =
+    "CREATE TABLE cookies(creation_utc INTEGER, host_key TEXT, name TEXT, value TEXT, path TEXT, "
+    "expires_utc INTEGER, is_secure INTEGER, is_httponly INTEGER);"
+    "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) "
+    "INSERT INTO cookies SELECT i, 'other.test', 'other' || i, '', '/', 20000000000000000, 0, 0 FROM n;"
+    "INSERT INTO cookies VALUES (201, 'example.test', 'live', '', '/', 20000000000000000, 0, 0), "
+    "(202, 'example.test', 'session', '', '/', 0, 0, 0), "
+    "(203, 'example.test', 'expired', '', '/', 10000000000000000, 0, 0), "
+    "(204, '.sub.example.test', 'sub', '', '/', 20000000000000000, 0, 0);";
+
+// Returns whether the cookies written for the case are the ones it expects
+int verifyFilterCase(const struct VerifyFilterCase * filterCase, const char * filename) {
+    struct Run run = { .sinkCount = 1, .sampleSize = filterCase->sampleSize,
+        .samplePerDomain = filterCase->samplePerDomain };
+    run.filter.domain = filterCase->domain;
+    if (filterCase->unexpired) {
+        run.filter.hasMinExpiry = 1;
+        run.filter.minExpiry = time(0) - MAC_EPOCH_UNIX_SECONDS;
+        run.filter.keepsSessions = 1;
+    }
+    char * text;
+    size_t size;
+    FILE * out = open_memstream(&text, &size);
+    if (!out) {
+        perror("Cannot buffer output");
+        return 0;
+    }
+    openSink(&run.sinks[0], "ndjson");
+    run.sinks[0].out = out;
+    const int exitCode = runFinishFile(&run, filename, printCookiesFromFilename(&run, filename));
+    closeSink(&run.sinks[0]);
+    int matched = !fclose(out) && !exitCode;
+    uint64_t count = 0;
+    for (const char * cursor = text; matched && (cursor = strstr(cursor, "\"name\":\"")); ++count) {
+        cursor += strlen("\"name\":\"");
+        char name[32];
+        const size_t nameLength = strcspn(cursor, "\"");
+        snprintf(name, sizeof(name), " %.*s ", (int)nameLength, cursor);
+        matched = nameLength < sizeof(name) - 2 && strstr(filterCase->names, name);
+    }
+    free(text);
+    return matched && count == filterCase->count;
+}
+
+// Returns the number of wrong answers
+unsigned long long verifyFilters(void) {
+    sqlite3 * db = 0;
+    char * filename = writeTemporaryFile("", 0, "filter");
+    if (!filename || SQLITE_OK != sqlite3_open(filename, &db)
+        || SQLITE_OK != sqlite3_exec(db, VERIFY_FILTER_STORE, 0, 0, 0)) {
+        fprintf(stderr, "Cannot write filter store: %s\n", db ? sqlite3_errmsg(db) : "no file");
+        sqlite3_close(db);
+        if (filename) {
+            unlink(filename);
+        }
+        free(filename);
+        return 1;
+    }
+    sqlite3_close(db);
+    unsigned long long mismatchCount = 0;
+    for (int i = 0; i < sizeof(VERIFY_FILTER_CASES) / sizeof(VERIFY_FILTER_CASES[0]); ++i) {
+        if (!verifyFilterCase(&VERIFY_FILTER_CASES[i], filename)) {
+            fprintf(stderr, "Mismatch for filter case %d\n", i);
+            ++mismatchCount;
+        }
+    }
+    unlink(filename);
+    free(filename);
+    return mismatchCount;
+}
+
+// Returns the number of variants which disagree with the reference. The decoders complain on stderr about
+// every mutated file, so that's sent to stderrFd only for our own reports.
+int verifyCookieFile(const struct VerifyVariant * variants, int variantCount, const char * filename,
+    int quietFd, int stderrFd, const char * source) {
+    int mismatchCount = 0;
+    for (enum Utf8Mode mode = UTF8_MODE_PASS; mode <= UTF8_MODE_ASCII; ++mode) {
+        utf8Mode = mode;
+        struct VerifyOutput reference = { 0 };
+        fflush(stderr);
+        dup2(quietFd, STDERR_FILENO);
+        int exitCode = runVerifyVariant(&variants[0], filename, &reference);
+        for (int variantIdx = 1; !exitCode && variantIdx < variantCount; ++variantIdx) {
+            struct VerifyOutput output = { 0 };
+            exitCode = runVerifyVariant(&variants[variantIdx], filename, &output);
+            if (exitCode) {
+                break;
+            }
+            size_t offset = 0;
+            while (offset < output.size && offset < reference.size && output.text[offset] == reference.text[offset]) {
+                ++offset;
+            }
+            if (output.exitCode != reference.exitCode || output.size != reference.size || offset != output.size) {
+                fflush(stderr);
+                dup2(stderrFd, STDERR_FILENO);
+                fprintf(stderr, "Mismatch for %s in %s, with %s kernels, window %lld%s and --utf8 %s: exit code %d "
+                    "for %d, output of %zu bytes for %zu, differing from byte %zu\n", source, filename,
+                    variants[variantIdx].kernels->name, (long long)variants[variantIdx].windowSize,
+                    variants[variantIdx].pipelined ? ", pipelined" : "", UTF8_MODE_NAMES[mode], output.exitCode,
+                    reference.exitCode, output.size, reference.size, offset);
+                fflush(stderr);
+                dup2(quietFd, STDERR_FILENO);
+                ++mismatchCount;
+            }
+            free(output.text);
+        }
+        free(reference.text);
+        fflush(stderr);
+        dup2(stderrFd, STDERR_FILENO);
+        if (exitCode) {
+            return -1;
+        }
+    }
+    return mismatchCount;
+}
+
+// Verify data and its mutations. Files which show a mismatch are kept for reproducing it, and named.
+int verifyCookieData(const struct VerifyVariant * variants, int variantCount, uint64_t * random,
+    const char * data, size_t length, const char * source, int quietFd, unsigned long long * fileCount,
+    unsigned long long * mismatchCount) {
+    char * mutated = malloc(length ? length : 1);
+    if (!mutated) {
+        perror("Cannot mutate file");
+        return EXIT_CODE_BAD_VERIFY;
+    }
+    const int stderrFd = dup(STDERR_FILENO);
+    int exitCode = EXIT_CODE_OK;
+    for (int mutationIdx = 0; !exitCode && mutationIdx <= VERIFY_MUTATION_COUNT; ++mutationIdx) {
+        memcpy(mutated, data, length);
+        const size_t mutatedLength = mutationIdx ? mutateCookieFile(random, mutated, length) : length;
+        char * filename = writeTemporaryFile(mutated, mutatedLength, "verify");
+        if (!filename) {
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+            break;
+        }
+        const int mismatches = verifyCookieFile(variants, variantCount, filename, quietFd, stderrFd, source);
+        if (mismatches < 0) {
+            fprintf(stderr, "Cannot verify %s\n", source);
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+        } else if (mismatches) {
+            fprintf(stderr, "Kept %s, mutation %d of %s\n", filename, mutationIdx, source);
+            *mismatchCount += mismatches;
+        } else {
+            unlink(filename);
+        }
+        free(filename);
+        ++*fileCount;
+    }
+    close(stderrFd);
+    free(mutated);
+    return exitCode;
+}
+
+int verifyDecoders(const char * const * filenames, int fileCount, unsigned long long generateCount,
+    uint64_t seed) {
+    // Every kernel the CPU can run, each whole and windowed a page at a time, and the pipeline
+    struct VerifyVariant variants[3 * KERNELS_COUNT];
+    int variantCount = 0;
+    for (int kernelsIdx = 0; kernelsIdx < KERNELS_COUNT; ++kernelsIdx) {
+        if (KERNELS[kernelsIdx].supported()) {
+            variants[variantCount++] = (struct VerifyVariant){ &KERNELS[kernelsIdx], 0, 0 };
+            variants[variantCount++] = (struct VerifyVariant){ &KERNELS[kernelsIdx], 1, 0 };
+            variants[variantCount++] = (struct VerifyVariant){ &KERNELS[kernelsIdx], 0, 1 };
+        }
+    }
+    const int quietFd = open("/dev/null", O_WRONLY);
+    if (-1 == quietFd) {
+        perror("Cannot open /dev/null");
+        return EXIT_CODE_BAD_OPEN;
+    }
+    const enum Utf8Mode selectedMode = utf8Mode;
+    uint64_t random = seed;
+    unsigned long long verifiedCount = 0;
+    unsigned long long mismatchCount = verifyUtf8Substitution() + verifyFilters();
+    int exitCode = EXIT_CODE_OK;
+    for (int fileIdx = 0; !exitCode && fileIdx < fileCount; ++fileIdx) {
+        struct MappedFile file = { .filename = filenames[fileIdx], .fd = open(filenames[fileIdx], O_RDONLY) };
+        if (-1 == file.fd) {
+            perror("Cannot open file");
+            exitCode = EXIT_CODE_BAD_OPEN;
+        } else if (!(exitCode = mapFd(&file))) {
+            exitCode = verifyCookieData(variants, variantCount, &random, file.data, file.length, file.filename,
+                quietFd, &verifiedCount, &mismatchCount);
+            exitCode = unmapFd(&file, exitCode);
+        }
+        if (-1 != file.fd) {
+            exitCode = closeFile(file.fd, exitCode);
+        }
+    }
+    for (unsigned long long generatedIdx = 0; !exitCode && generatedIdx < generateCount; ++generatedIdx) {
+        char * data;
+        size_t length;
+        char source[64];
+        snprintf(source, sizeof(source), "generated file %llu", generatedIdx);
+        if (!generateCookieFile(&random, &data, &length)) {
+            perror("Cannot generate file");
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+        } else {
+            exitCode = verifyCookieData(variants, variantCount, &random, data, length, source, quietFd,
+                &verifiedCount, &mismatchCount);
+            free(data);
+        }
+    }
+    utf8Mode = selectedMode;
+    close(quietFd);
+    printf("Verified %llu files against %d variants with seed %llu, %llu mismatches\n", verifiedCount,
+        variantCount - 1, (unsigned long long)seed, mismatchCount);
+    return exitCode ? exitCode : mismatchCount ? EXIT_CODE_BAD_VERIFY : EXIT_CODE_OK;
+}
+
+#ifndef SAFARI_COOKIE_JSON_VERIFY_NO_MAIN
+int main(int argc, const char **argv) {
+    uint64_t seed = arc4random();
+    int argIdx = 1;
+    if (argIdx + 1 < argc && !strcmp(argv[argIdx], "--seed")) {
+        seed = strtoull(argv[argIdx + 1], 0, 0);
+        argIdx += 2;
+    }
+    if (argIdx == argc || '-' == argv[argIdx][0]) {
+        fprintf(stderr, "Usage: %s [--seed SEED] COUNT [FILENAME...]\n", *argv);
+        fprintf(stderr, "  Checks every kernel, --window and --pipeline give the same output as the scalar walk,\n");
+        fprintf(stderr, "  for each FILENAME and COUNT generated files, and mutations of them.\n");
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+    selectKernels(0);
+    return verifyDecoders(argv + argIdx + 1, argc - argIdx - 1, strtoull(argv[argIdx], 0, 0), seed);
+}
+#endif
@@ -1,13 +1,33 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/errno.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "safari-cookie-json-plugin.h"
+#include "safari-cookie-json-ring.h"
+
+// Only macOS can keep a mapping out of the page cache, elsewhere it's an ordinary mapping
+#ifndef MAP_NOCACHE
+#define MAP_NOCACHE 0
+#endif
+
 enum {
     EXIT_CODE_OK = 0,
     EXIT_CODE_BAD_INVOCATION,
@@ -19,6 +39,14 @@ enum {
     EXIT_CODE_BAD_EOF,
     EXIT_CODE_BAD_MAGIC,
     EXIT_CODE_BAD_PARSE,
+    EXIT_CODE_BAD_OUTPUT,
+    EXIT_CODE_BAD_PLUGIN,
+    EXIT_CODE_BAD_THREAD,
+    EXIT_CODE_BAD_LOCATOR,
+    EXIT_CODE_BAD_PLIST,
+    EXIT_CODE_BAD_SQLITE,
+    EXIT_CODE_BAD_VERIFY,
+    EXIT_CODE_BAD_MANIFEST,
 };
 
 const char BINARY_COOKIE_MAGIC[] = { 'c', 'o', 'o', 'k' } ;
@@ -62,332 +90,5592 @@ double readDouble(const char ** data) {
     return *((double*)&raw);
 }
 
-void emitJsonBeginArray() {
-    putchar('[');
+void emitJsonBeginArray(FILE * out) {
+    putc('[', out);
+}
+
+void emitJsonBeginObject(FILE * out) {
+    putc('{', out);
+}
+
+void emitJsonEndArray(FILE * out) {
+    putc(']', out);
+}
+
+void emitJsonEndObject(FILE * out) {
+    putc('}', out);
+}
+
+void emitJsonNameSeparator(FILE * out) {
+    putc(':', out);
+}
+
+void emitJsonValueSeparator(FILE * out) {
+    putc(',', out);
+}
+
+void emitJsonValueFalse(FILE * out) {
+    fputs("false", out);
+}
+
+void emitJsonValueNull(FILE * out) {
+    fputs("null", out);
+}
+
+void emitJsonValueTrue(FILE * out) {
+    fputs("true", out);
+}
+
+void emitJsonNumberInt(FILE * out, int value) {
+    fprintf(out, "%d", value);
+}
+
+void emitJsonNumberDouble(FILE * out, double value) {
+    fprintf(out, "%.17lg", value);
+}
+
+void emitJsonCharEscapedPretty(FILE * out, char value) {
+    putc('\\', out);
+    putc(value, out);
+}
+
+void emitJsonCharEscapedUgly(FILE * out, uint16_t value) {
+    fprintf(out, "\\u%04X", value);
+}
+
+// How to treat bytes >= 0x80 in strings
+enum Utf8Mode {
+    // Pass them straight through, whether or not they're valid UTF8
+    UTF8_MODE_PASS,
+    // Pass valid UTF8 through, but replace invalid sequences with U+FFFD
+    UTF8_MODE_REPLACE,
+    // Escape everything that isn't ASCII, so the output is safe for anything, and invalid sequences are U+FFFD
+    UTF8_MODE_ASCII,
+};
+
+enum Utf8Mode utf8Mode = UTF8_MODE_PASS;
+
+const char UTF8_REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+// Kernels are the few loops which see every byte - scanning strings for bytes needing escapes, and summing
+// pages for the checksum. Each comes in a plain bytewise version, which is the reference, and faster ones for
+// what the CPU has. The fastest supported set is picked once at startup, and --kernel can force another, for
+// comparing them on the same machine.
+//
+// The string scans stop at the null terminator, which is special to every one of them, so they don't need
+// the length first. Their wide reads are aligned, so a read past the terminator never crosses into another
+// memory page, just as with a libc strlen, and the address sanitizer is told not to mind.
+
+int jsonByteIsSpecial(uint8_t byte, int highIsSpecial) {
+    return byte < 0x20 || '"' == byte || '\\' == byte || (highIsSpecial && 0x80 <= byte);
+}
+
+int csvByteIsSpecial(uint8_t byte, char delimiter) {
+    return !byte || delimiter == byte || '"' == byte || '\r' == byte || '\n' == byte;
+}
+
+// The length of the run of bytes at the start of value which can be written as is
+size_t jsonCleanRunLengthScalar(const char * value, int highIsSpecial) {
+    const char * cursor = value;
+    while (!jsonByteIsSpecial(*cursor, highIsSpecial)) {
+        ++cursor;
+    }
+    return cursor - value;
+}
+
+size_t csvCleanRunLengthScalar(const char * value, char delimiter) {
+    const char * cursor = value;
+    while (!csvByteIsSpecial(*cursor, delimiter)) {
+        ++cursor;
+    }
+    return cursor - value;
+}
+
+// Yes the loop steps four bytes, but only one byte is included each time. This works in my examples, and
+// matches my understanding of the swift version.
+uint32_t pageCheckSumScalar(const char * pageBase, const char * pageEnd) {
+    uint32_t checkSum = 0;
+    for(const char * pageCursor = pageBase; pageCursor < pageEnd; pageCursor += sizeof(uint32_t)) {
+        const uint8_t byte = *pageCursor;
+        checkSum += byte;
+    }
+    return checkSum;
+}
+
+// SWAR - SIMD within a register - lets us test eight bytes at a time for anything needing attention.
+// The tests are the usual bit hacks, and only tell us whether some byte matched, not which. The scans go
+// bytewise up to a word boundary, and then a word at a time.
+typedef uint64_t __attribute__((may_alias)) SwarWord;
+
+const uint64_t SWAR_ONES = 0x0101010101010101ULL;
+const uint64_t SWAR_HIGHS = 0x8080808080808080ULL;
+
+uint64_t swarHasLess(uint64_t word, uint8_t limit) {
+    return (word - SWAR_ONES * limit) & ~word & SWAR_HIGHS;
+}
+
+uint64_t swarHasByte(uint64_t word, uint8_t byte) {
+    return swarHasLess(word ^ (SWAR_ONES * byte), 1);
+}
+
+__attribute__((no_sanitize_address))
+size_t jsonCleanRunLengthSwar(const char * value, int highIsSpecial) {
+    const char * cursor = value;
+    for (; (uintptr_t)cursor % sizeof(SwarWord); ++cursor) {
+        if (jsonByteIsSpecial(*cursor, highIsSpecial)) {
+            return cursor - value;
+        }
+    }
+    const uint64_t highs = highIsSpecial ? SWAR_HIGHS : 0;
+    for (;; cursor += sizeof(SwarWord)) {
+        const uint64_t word = *(const SwarWord *)cursor;
+        if (swarHasLess(word, 0x20) | swarHasByte(word, '"') | swarHasByte(word, '\\') | (word & highs)) {
+            break;
+        }
+    }
+    return cursor - value + jsonCleanRunLengthScalar(cursor, highIsSpecial);
+}
+
+__attribute__((no_sanitize_address))
+size_t csvCleanRunLengthSwar(const char * value, char delimiter) {
+    const char * cursor = value;
+    for (; (uintptr_t)cursor % sizeof(SwarWord); ++cursor) {
+        if (csvByteIsSpecial(*cursor, delimiter)) {
+            return cursor - value;
+        }
+    }
+    for (;; cursor += sizeof(SwarWord)) {
+        const uint64_t word = *(const SwarWord *)cursor;
+        if (swarHasByte(word, 0) | swarHasByte(word, delimiter) | swarHasByte(word, '"')
+            | swarHasByte(word, '\r') | swarHasByte(word, '\n')) {
+            break;
+        }
+    }
+    return cursor - value + csvCleanRunLengthScalar(cursor, delimiter);
+}
+
+// A word holds two summed bytes, the first of each half, in 32 bit lanes. Those are summed separately in a
+// 64 bit total, and folded often enough that the low lane can't carry into the high one.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+const int SWAR_CHECKSUM_SHIFT = 24;
+#else
+const int SWAR_CHECKSUM_SHIFT = 0;
+#endif
+const uint64_t SWAR_CHECKSUM_LANES = 0x000000FF000000FFULL;
+const size_t SWAR_CHECKSUM_FOLD_WORDS = 1 << 20;
+
+uint32_t pageCheckSumSwar(const char * pageBase, const char * pageEnd) {
+    uint32_t checkSum = 0;
+    const char * cursor = pageBase;
+    while (pageEnd - cursor >= sizeof(uint64_t)) {
+        uint64_t lanes = 0;
+        for (size_t wordIdx = 0; wordIdx < SWAR_CHECKSUM_FOLD_WORDS && pageEnd - cursor >= sizeof(uint64_t); ++wordIdx) {
+            uint64_t word;
+            memcpy(&word, cursor, sizeof(word));
+            lanes += (word >> SWAR_CHECKSUM_SHIFT) & SWAR_CHECKSUM_LANES;
+            cursor += sizeof(word);
+        }
+        checkSum += (uint32_t)lanes + (uint32_t)(lanes >> 32);
+    }
+    return checkSum + pageCheckSumScalar(cursor, pageEnd);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// The vector scans can say which byte matched, so unlike SWAR they never go bytewise. The first load is of the
+// aligned block holding the start of the string, with the matches before the start masked off. The checksum
+// adds in 32 bit lanes, which wrap just as the total does, so they can be summed at the end.
+
+__attribute__((target("sse2"), no_sanitize_address))
+size_t jsonCleanRunLengthSse2(const char * value, int highIsSpecial) {
+    const char * cursor = (const char *)((uintptr_t)value & ~(uintptr_t)(sizeof(__m128i) - 1));
+    const __m128i controls = _mm_set1_epi8(0x1F);
+    const __m128i quotes = _mm_set1_epi8('"');
+    const __m128i backslashes = _mm_set1_epi8('\\');
+    const int highs = highIsSpecial ? 0xFFFF : 0;
+    unsigned skipped = ~0U << (value - cursor);
+    for (;; cursor += sizeof(__m128i), skipped = ~0U) {
+        const __m128i bytes = _mm_load_si128((const __m128i *)cursor);
+        const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(bytes, controls), controls),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, quotes), _mm_cmpeq_epi8(bytes, backslashes)));
+        const unsigned mask = (_mm_movemask_epi8(special) | (_mm_movemask_epi8(bytes) & highs)) & skipped;
+        if (mask) {
+            return cursor - value + __builtin_ctz(mask);
+        }
+    }
 }
 
-void emitJsonBeginObject() {
-    putchar('{');
+__attribute__((target("sse2"), no_sanitize_address))
+size_t csvCleanRunLengthSse2(const char * value, char delimiter) {
+    const char * cursor = (const char *)((uintptr_t)value & ~(uintptr_t)(sizeof(__m128i) - 1));
+    const __m128i nulls = _mm_setzero_si128();
+    const __m128i delimiters = _mm_set1_epi8(delimiter);
+    const __m128i quotes = _mm_set1_epi8('"');
+    const __m128i returns = _mm_set1_epi8('\r');
+    const __m128i newlines = _mm_set1_epi8('\n');
+    unsigned skipped = ~0U << (value - cursor);
+    for (;; cursor += sizeof(__m128i), skipped = ~0U) {
+        const __m128i bytes = _mm_load_si128((const __m128i *)cursor);
+        const __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, nulls), _mm_cmpeq_epi8(bytes, delimiters)),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, quotes),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, returns), _mm_cmpeq_epi8(bytes, newlines))));
+        const unsigned mask = _mm_movemask_epi8(special) & skipped;
+        if (mask) {
+            return cursor - value + __builtin_ctz(mask);
+        }
+    }
 }
 
-void emitJsonEndArray() {
-    putchar(']');
+__attribute__((target("sse2")))
+uint32_t pageCheckSumSse2(const char * pageBase, const char * pageEnd) {
+    const __m128i lowBytes = _mm_set1_epi32(0xFF);
+    __m128i lanes = _mm_setzero_si128();
+    const char * cursor = pageBase;
+    for (; pageEnd - cursor >= sizeof(__m128i); cursor += sizeof(__m128i)) {
+        lanes = _mm_add_epi32(lanes, _mm_and_si128(_mm_loadu_si128((const __m128i *)cursor), lowBytes));
+    }
+    uint32_t sums[sizeof(__m128i) / sizeof(uint32_t)];
+    _mm_storeu_si128((__m128i *)sums, lanes);
+    return sums[0] + sums[1] + sums[2] + sums[3] + pageCheckSumScalar(cursor, pageEnd);
 }
 
-void emitJsonEndObject() {
-    putchar('}');
+__attribute__((target("avx2"), no_sanitize_address))
+size_t jsonCleanRunLengthAvx2(const char * value, int highIsSpecial) {
+    const char * cursor = (const char *)((uintptr_t)value & ~(uintptr_t)(sizeof(__m256i) - 1));
+    const __m256i controls = _mm256_set1_epi8(0x1F);
+    const __m256i quotes = _mm256_set1_epi8('"');
+    const __m256i backslashes = _mm256_set1_epi8('\\');
+    const uint32_t highs = highIsSpecial ? 0xFFFFFFFF : 0;
+    uint32_t skipped = ~0U << (value - cursor);
+    for (;; cursor += sizeof(__m256i), skipped = ~0U) {
+        const __m256i bytes = _mm256_load_si256((const __m256i *)cursor);
+        const __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(bytes, controls), controls),
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quotes), _mm256_cmpeq_epi8(bytes, backslashes)));
+        const uint32_t mask = ((uint32_t)_mm256_movemask_epi8(special) | ((uint32_t)_mm256_movemask_epi8(bytes) & highs))
+            & skipped;
+        if (mask) {
+            return cursor - value + __builtin_ctz(mask);
+        }
+    }
 }
 
-void emitJsonNameSeparator() {
-    putchar(':');
+__attribute__((target("avx2"), no_sanitize_address))
+size_t csvCleanRunLengthAvx2(const char * value, char delimiter) {
+    const char * cursor = (const char *)((uintptr_t)value & ~(uintptr_t)(sizeof(__m256i) - 1));
+    const __m256i nulls = _mm256_setzero_si256();
+    const __m256i delimiters = _mm256_set1_epi8(delimiter);
+    const __m256i quotes = _mm256_set1_epi8('"');
+    const __m256i returns = _mm256_set1_epi8('\r');
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    uint32_t skipped = ~0U << (value - cursor);
+    for (;; cursor += sizeof(__m256i), skipped = ~0U) {
+        const __m256i bytes = _mm256_load_si256((const __m256i *)cursor);
+        const __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, nulls), _mm256_cmpeq_epi8(bytes, delimiters)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quotes),
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, returns), _mm256_cmpeq_epi8(bytes, newlines))));
+        const uint32_t mask = _mm256_movemask_epi8(special) & skipped;
+        if (mask) {
+            return cursor - value + __builtin_ctz(mask);
+        }
+    }
 }
 
-void emitJsonValueSeparator() {
-    putchar(',');
+__attribute__((target("avx2")))
+uint32_t pageCheckSumAvx2(const char * pageBase, const char * pageEnd) {
+    const __m256i lowBytes = _mm256_set1_epi32(0xFF);
+    __m256i lanes = _mm256_setzero_si256();
+    const char * cursor = pageBase;
+    for (; pageEnd - cursor >= sizeof(__m256i); cursor += sizeof(__m256i)) {
+        lanes = _mm256_add_epi32(lanes, _mm256_and_si256(_mm256_loadu_si256((const __m256i *)cursor), lowBytes));
+    }
+    uint32_t sums[sizeof(__m256i) / sizeof(uint32_t)];
+    _mm256_storeu_si256((__m256i *)sums, lanes);
+    uint32_t checkSum = 0;
+    for (int i = 0; i < sizeof(sums) / sizeof(sums[0]); ++i) {
+        checkSum += sums[i];
+    }
+    return checkSum + pageCheckSumScalar(cursor, pageEnd);
 }
 
-void emitJsonValueFalse() {
-    printf("false");
+int cpuHasSse2(void) {
+    return __builtin_cpu_supports("sse2");
 }
 
-void emitJsonValueNull() {
-    printf("null");
+int cpuHasAvx2(void) {
+    return __builtin_cpu_supports("avx2");
 }
+#endif
 
-void emitJsonValueTrue() {
-    printf("true");
+int cpuHasAnything(void) {
+    return 1;
 }
 
-void emitJsonNumberInt(int value) {
-    printf("%d", value);
+struct Kernels {
+    const char * name;
+    int (*supported)(void);
+    size_t (*jsonCleanRunLength)(const char * value, int highIsSpecial);
+    size_t (*csvCleanRunLength)(const char * value, char delimiter);
+    uint32_t (*pageCheckSum)(const char * pageBase, const char * pageEnd);
+};
+
+// Slowest first, so the last supported is the one to use
+const struct Kernels KERNELS[] = {
+    { "scalar", cpuHasAnything, jsonCleanRunLengthScalar, csvCleanRunLengthScalar, pageCheckSumScalar },
+    { "swar", cpuHasAnything, jsonCleanRunLengthSwar, csvCleanRunLengthSwar, pageCheckSumSwar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", cpuHasSse2, jsonCleanRunLengthSse2, csvCleanRunLengthSse2, pageCheckSumSse2 },
+    { "avx2", cpuHasAvx2, jsonCleanRunLengthAvx2, csvCleanRunLengthAvx2, pageCheckSumAvx2 },
+#endif
+};
+
+const int KERNELS_COUNT = sizeof(KERNELS) / sizeof(KERNELS[0]);
+
+// SWAR runs anywhere, so it's what's used until selectKernels is called
+const struct Kernels * kernels = &KERNELS[1];
+
+// Pick the named kernels, or the fastest this CPU supports if name is null. Returns zero, and leaves the
+// kernels alone, if there are no such kernels or this CPU can't run them.
+int selectKernels(const char * name) {
+    for (int kernelsIdx = KERNELS_COUNT - 1; kernelsIdx >= 0; --kernelsIdx) {
+        if ((!name || !strcmp(name, KERNELS[kernelsIdx].name)) && KERNELS[kernelsIdx].supported()) {
+            kernels = &KERNELS[kernelsIdx];
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void emitJsonNumberDouble(double value) {
-    printf("%.17lg", value);
+void printKernels(FILE * out) {
+    for (int kernelsIdx = 0; kernelsIdx < KERNELS_COUNT; ++kernelsIdx) {
+        fprintf(out, "%s %s%s\n", KERNELS[kernelsIdx].name,
+            KERNELS[kernelsIdx].supported() ? "supported" : "unsupported",
+            kernels == &KERNELS[kernelsIdx] ? " selected" : "");
+    }
 }
 
-void emitJsonCharEscapedPretty(char value) {
-    putchar('\\');
-    putchar(value);
+// Decode the UTF8 sequence at value, per RFC 3629 - so no overlong forms, surrogates, or code points past
+// U+10FFFF. Returns the length consumed. An invalid sequence decodes as U+FFFD, and consumes its maximal
+// subpart, as Unicode recommends - that is, as much of it as could still have started a valid sequence, or
+// else just the first byte. So a truncated sequence is one U+FFFD, not one per byte. A null terminator is
+// never a continuation byte, so this stops at the end of the string.
+int decodeUtf8(const char * value, uint32_t * codePoint) {
+    const uint8_t * bytes = (const uint8_t *)value;
+    int length;
+    // The second byte's range is narrower after some leads, which is what rules out the overlong forms,
+    // surrogates and code points past U+10FFFF without decoding first
+    uint8_t secondLow = 0x80;
+    uint8_t secondHigh = 0xBF;
+    if (bytes[0] < 0x80) {
+        *codePoint = bytes[0];
+        return 1;
+    } else if (0xC2 <= bytes[0] && bytes[0] <= 0xDF) {
+        length = 2;
+        *codePoint = bytes[0] & 0x1F;
+    } else if (0xE0 <= bytes[0] && bytes[0] <= 0xEF) {
+        length = 3;
+        secondLow = 0xE0 == bytes[0] ? 0xA0 : 0x80;
+        secondHigh = 0xED == bytes[0] ? 0x9F : 0xBF;
+        *codePoint = bytes[0] & 0x0F;
+    } else if (0xF0 <= bytes[0] && bytes[0] <= 0xF4) {
+        length = 4;
+        secondLow = 0xF0 == bytes[0] ? 0x90 : 0x80;
+        secondHigh = 0xF4 == bytes[0] ? 0x8F : 0xBF;
+        *codePoint = bytes[0] & 0x07;
+    } else {
+        *codePoint = 0xFFFD;
+        return 1;
+    }
+    for (int i = 1; i < length; ++i) {
+        if (bytes[i] < (1 == i ? secondLow : 0x80) || (1 == i ? secondHigh : 0xBF) < bytes[i]) {
+            *codePoint = 0xFFFD;
+            return i;
+        }
+        *codePoint = (*codePoint << 6) | (bytes[i] & 0x3F);
+    }
+    return length;
 }
 
-void emitJsonCharEscapedUgly(uint8_t value) {
-    printf("\\u%04X", value);
+// Emit the non ASCII sequence at value, returning the length consumed
+int emitJsonUtf8Sequence(FILE * out, const char * value) {
+    uint32_t codePoint;
+    const int length = decodeUtf8(value, &codePoint);
+    if (UTF8_MODE_ASCII == utf8Mode) {
+        if (codePoint < 0x10000) {
+            emitJsonCharEscapedUgly(out, codePoint);
+        } else {
+            // JSON only has UTF16 escapes, so this needs a surrogate pair
+            codePoint -= 0x10000;
+            emitJsonCharEscapedUgly(out, 0xD800 + (codePoint >> 10));
+            emitJsonCharEscapedUgly(out, 0xDC00 + (codePoint & 0x3FF));
+        }
+    } else if (0xFFFD == codePoint) {
+        // Either a replacement, or a real U+FFFD, which is the same bytes
+        fputs(UTF8_REPLACEMENT_CHARACTER, out);
+    } else {
+        fwrite(value, 1, length, out);
+    }
+    return length;
 }
 
-void emitJsonString(const char * value) {
-    putchar('"');
+void emitJsonString(FILE * out, const char * value) {
+    putc('"', out);
 
-    // I'm ignoring encodings here - i guess i hope the cookies are in UTF8, and maybe that goes through
-    // clean because a control character can't occur in the non-first bytes for UTF8 ?
+    // By default i'm ignoring encodings here - i guess i hope the cookies are in UTF8, and that goes through
+    // clean because a control character can't occur in the non-first bytes for UTF8. Strict consumers can ask
+    // for --utf8 replace or ascii, which validate it.
     // RFC 8259 section 7 says
     // All Unicode characters may be placed within the quotation marks, except for the characters that MUST
     // be escaped: quotation mark, reverse solidus, and the control characters (U+0000 through U+001F).
 
-    for(const char * cursor = value; *cursor; ++cursor) {
+    const int highIsSpecial = UTF8_MODE_PASS != utf8Mode;
+    const char * cursor = value;
+    for (;;) {
+        // Most bytes need no escaping, so write them in runs
+        const size_t runLength = kernels->jsonCleanRunLength(cursor, highIsSpecial);
+        fwrite(cursor, 1, runLength, out);
+        cursor += runLength;
         uint8_t byte = *cursor;
+        if (!byte) {
+            break;
+        } else if (0x80 <= byte) {
+            cursor += emitJsonUtf8Sequence(out, cursor);
+            continue;
+        }
         switch(byte) {
             // Be pretty where we can be - NB this is the order in the spec
-            case '"': emitJsonCharEscapedPretty('\"'); break;
-            case '\\': emitJsonCharEscapedPretty('\\'); break;
+            case '"': emitJsonCharEscapedPretty(out, '\"'); break;
+            case '\\': emitJsonCharEscapedPretty(out, '\\'); break;
             // But let's not escape solidus / because we don't need to
-            case 0x08: emitJsonCharEscapedPretty('b'); break; // backspace
-            case 0x0C: emitJsonCharEscapedPretty('f'); break; // form feed
-            case 0x0A: emitJsonCharEscapedPretty('n'); break; // line feed
-            case 0x0D: emitJsonCharEscapedPretty('r'); break; // carriage return
-            case 0x09: emitJsonCharEscapedPretty('t'); break; // tab
-            default: {
-                if (byte < 0x20) {
-                    emitJsonCharEscapedUgly(byte);
-                } else {
-                    putchar(byte);
-                }
-                break;
-            }
+            case 0x08: emitJsonCharEscapedPretty(out, 'b'); break; // backspace
+            case 0x0C: emitJsonCharEscapedPretty(out, 'f'); break; // form feed
+            case 0x0A: emitJsonCharEscapedPretty(out, 'n'); break; // line feed
+            case 0x0D: emitJsonCharEscapedPretty(out, 'r'); break; // carriage return
+            case 0x09: emitJsonCharEscapedPretty(out, 't'); break; // tab
+            default: emitJsonCharEscapedUgly(out, byte); break;
         }
+        ++cursor;
     }
 
-    putchar('"');
+    putc('"', out);
 }
 
-void emitJsonNamedValueInt(const char * name, int value) {
-    emitJsonString(name);
-    emitJsonNameSeparator();
-    emitJsonNumberInt(value);
+void emitJsonNamedValueInt(FILE * out, const char * name, int value) {
+    emitJsonString(out, name);
+    emitJsonNameSeparator(out);
+    emitJsonNumberInt(out, value);
 }
 
-void emitJsonSeparatedNamedValueInt(const char * name, int value) {
-    emitJsonValueSeparator();
-    emitJsonNamedValueInt(name, value);
+void emitJsonSeparatedNamedValueInt(FILE * out, const char * name, int value) {
+    emitJsonValueSeparator(out);
+    emitJsonNamedValueInt(out, name, value);
 }
 
-void emitJsonSeparatedNamedValueDouble(const char * name, double value) {
-    emitJsonValueSeparator();
-    emitJsonString(name);
-    emitJsonNameSeparator();
-    emitJsonNumberDouble(value);
+void emitJsonSeparatedNamedValueDouble(FILE * out, const char * name, double value) {
+    emitJsonValueSeparator(out);
+    emitJsonString(out, name);
+    emitJsonNameSeparator(out);
+    emitJsonNumberDouble(out, value);
 }
 
-void emitJsonOptionalSeparatedNamedValueString(int present, const char * name, const char * value) {
-    if (present) {
-        emitJsonValueSeparator();
-        emitJsonString(name);
-        emitJsonNameSeparator();
-        emitJsonString(value);
+void emitJsonOptionalSeparatedNamedValueString(FILE * out, const char * name, const char * value) {
+    if (value) {
+        emitJsonValueSeparator(out);
+        emitJsonString(out, name);
+        emitJsonNameSeparator(out);
+        emitJsonString(out, value);
     }
 }
 
-int printCookiesFromMmap(off_t length, const char * data) {
-    if (length < sizeof(BINARY_COOKIE_MAGIC) + sizeof(uint32_t)) {
-        fprintf(stderr, "File too short, when checking magic and page count\n");
-        return EXIT_CODE_BAD_EOF;
-    } else if (memcmp(data, BINARY_COOKIE_MAGIC, sizeof(BINARY_COOKIE_MAGIC))) {
-        fprintf(stderr, "Bad magic - is this a cookie file?\n");
-        return EXIT_CODE_BAD_MAGIC;
+// The file ends with a binary plist - in my experiments it contains the NSHTTPCookieAcceptPolicy value.
+// Most people don't care, so it's only decoded when asked for with --plist. The reader works in place on
+// the mapping, and checks every offset, count and reference against the bounds of the plist. References
+// can point anywhere, so the walk also rejects cycles, and has a budget of visits - CoreFoundation only
+// shares strings, numbers and the like, never containers, so a real plist is a tree which visits each
+// reference in it at most once, while a crafted one sharing its arrays could take exponential time.
+// Other writers share a container they're given twice, so the budget leaves room for some of that.
+const char BINARY_PLIST_MAGIC[] = { 'b', 'p', 'l', 'i', 's', 't', '0', '0' } ;
+
+enum {
+    BINARY_PLIST_TRAILER_SIZE = 32,
+    // Deeper than anything real, which keeps the recursion shallow
+    MAX_PLIST_DEPTH = 32,
+    MAX_PLIST_VISITS_PER_REFERENCE = 16,
+};
+
+struct Plist {
+    const uint8_t * data;
+    uint64_t length;
+    uint8_t offsetIntSize;
+    uint8_t objectRefSize;
+    uint64_t objectCount;
+    uint64_t topObject;
+    uint64_t offsetTableOffset;
+    // A bit per object, set for the containers between the top object and where the walk is
+    uint8_t * onPath;
+    uint64_t visitsLeft;
+};
+
+uint64_t readPlistInt(const uint8_t * data, int size) {
+    uint64_t result = 0;
+    for (int i = 0; i < size; ++i) {
+        result = (result << CHAR_BIT) | data[i];
+    }
+    return result;
+}
+
+// Returns zero if this isn't a plausible binary plist
+int openPlist(const char * data, uint32_t length, struct Plist * plist) {
+    plist->data = (const uint8_t *)data;
+    plist->length = length;
+    if (length < sizeof(BINARY_PLIST_MAGIC) + BINARY_PLIST_TRAILER_SIZE
+        || memcmp(data, BINARY_PLIST_MAGIC, sizeof(BINARY_PLIST_MAGIC))) {
+        return 0;
+    }
+    const uint8_t * trailer = plist->data + length - BINARY_PLIST_TRAILER_SIZE;
+    plist->offsetIntSize = trailer[6];
+    plist->objectRefSize = trailer[7];
+    plist->objectCount = readPlistInt(trailer + 8, sizeof(uint64_t));
+    plist->topObject = readPlistInt(trailer + 16, sizeof(uint64_t));
+    plist->offsetTableOffset = readPlistInt(trailer + 24, sizeof(uint64_t));
+    const uint64_t tableLimit = length - BINARY_PLIST_TRAILER_SIZE;
+    return 1 <= plist->offsetIntSize && plist->offsetIntSize <= sizeof(uint64_t)
+        && 1 <= plist->objectRefSize && plist->objectRefSize <= sizeof(uint64_t)
+        && sizeof(BINARY_PLIST_MAGIC) <= plist->offsetTableOffset && plist->offsetTableOffset <= tableLimit
+        && plist->objectCount <= (tableLimit - plist->offsetTableOffset) / plist->offsetIntSize
+        && plist->topObject < plist->objectCount;
+}
+
+// Objects live between the magic and the offset table
+int plistObjectOffset(const struct Plist * plist, uint64_t ref, uint64_t * offset) {
+    if (plist->objectCount <= ref) {
+        return 0;
+    }
+    *offset = readPlistInt(plist->data + plist->offsetTableOffset + ref * plist->offsetIntSize, plist->offsetIntSize);
+    return sizeof(BINARY_PLIST_MAGIC) <= *offset && *offset < plist->offsetTableOffset;
+}
+
+// Check there are count items of size bytes at offset, before the offset table
+int plistHasRoom(const struct Plist * plist, uint64_t offset, uint64_t count, uint64_t size) {
+    return offset <= plist->offsetTableOffset && count <= (plist->offsetTableOffset - offset) / size;
+}
+
+// The low nibble of a marker is the count, unless it is 0xF when an int object follows with the count
+int readPlistCount(const struct Plist * plist, uint8_t marker, uint64_t * offset, uint64_t * count) {
+    if (0x0F != (marker & 0x0F)) {
+        *count = marker & 0x0F;
+        return 1;
+    } else if (!plistHasRoom(plist, *offset, 1, 1) || 0x10 != (plist->data[*offset] & 0xF0)) {
+        return 0;
     } else {
-        uint32_t checkSum = 0;
-        const char * pageSizeBase = data + sizeof(BINARY_COOKIE_MAGIC);
-        const uint32_t pageCount = read32Hi(&pageSizeBase);
-        const char * pageBase = pageSizeBase + pageCount * sizeof(uint32_t);
-        if (data + length < pageBase) {
-            fprintf(stderr, "File too short, when checking page sizes in header\n");
-            return EXIT_CODE_BAD_EOF;
+        const int size = 1 << (plist->data[*offset] & 0x0F);
+        if (sizeof(uint64_t) < size || !plistHasRoom(plist, *offset + 1, 1, size)) {
+            return 0;
+        }
+        *count = readPlistInt(plist->data + *offset + 1, size);
+        *offset += 1 + size;
+        return 1;
+    }
+}
+
+const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void emitJsonBase64(FILE * out, const uint8_t * data, uint64_t length) {
+    putc('"', out);
+    for (uint64_t i = 0; i < length; i += 3) {
+        const uint32_t triple = (data[i] << 16) | ((i + 1 < length ? data[i + 1] : 0) << 8)
+            | (i + 2 < length ? data[i + 2] : 0);
+        putc(BASE64_ALPHABET[(triple >> 18) & 0x3F], out);
+        putc(BASE64_ALPHABET[(triple >> 12) & 0x3F], out);
+        putc(i + 1 < length ? BASE64_ALPHABET[(triple >> 6) & 0x3F] : '=', out);
+        putc(i + 2 < length ? BASE64_ALPHABET[triple & 0x3F] : '=', out);
+    }
+    putc('"', out);
+}
+
+// Plist strings aren't null terminated, and may be UTF16, so they're converted to a null terminated UTF8
+// copy for emitJsonString. Unpaired surrogates become U+FFFD.
+int emitJsonPlistString(FILE * out, const struct Plist * plist, uint8_t marker, uint64_t offset) {
+    uint64_t count;
+    if (!readPlistCount(plist, marker, &offset, &count)) {
+        return 0;
+    }
+    const int utf16 = 0x60 == (marker & 0xF0);
+    if (!plistHasRoom(plist, offset, count, utf16 ? 2 : 1)) {
+        return 0;
+    } else if (!out) {
+        return 1;
+    }
+    // Each UTF16 unit is at most three bytes of UTF8, and a surrogate pair is four for two
+    char * value = malloc(utf16 ? 3 * count + 1 : count + 1);
+    if (!value) {
+        return 0;
+    }
+    char * cursor = value;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t codePoint = utf16 ? readPlistInt(plist->data + offset + 2 * i, 2) : plist->data[offset + i];
+        if (utf16 && 0xD800 <= codePoint && codePoint <= 0xDFFF) {
+            const uint32_t low = i + 1 < count ? readPlistInt(plist->data + offset + 2 * i + 2, 2) : 0;
+            if (codePoint < 0xDC00 && 0xDC00 <= low && low <= 0xDFFF) {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                ++i;
+            } else {
+                codePoint = 0xFFFD;
+            }
+        }
+        if (codePoint < 0x80 || !utf16) {
+            *cursor++ = codePoint;
+        } else if (codePoint < 0x800) {
+            *cursor++ = 0xC0 | (codePoint >> 6);
+            *cursor++ = 0x80 | (codePoint & 0x3F);
+        } else if (codePoint < 0x10000) {
+            *cursor++ = 0xE0 | (codePoint >> 12);
+            *cursor++ = 0x80 | ((codePoint >> 6) & 0x3F);
+            *cursor++ = 0x80 | (codePoint & 0x3F);
         } else {
-            // Separators are fenceposts not terminators
-            int first = 1;
-            emitJsonBeginObject();
-            emitJsonString("cookies");
-            emitJsonNameSeparator();
-            emitJsonBeginArray();
-            for(int pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
-                uint32_t pageSize = read32Hi(&pageSizeBase);
-                const char * pageEnd = pageBase + pageSize;
-                if (data + length < pageEnd) {
-                    fprintf(stderr, "File too short, incomplete page %d\n", pageIdx);
-                    return EXIT_CODE_BAD_EOF;
-                } else if (pageSize < sizeof(COOKIE_PAGE_TAG) + sizeof(uint32_t)) {
-                    fprintf(stderr, "Page %d too short for page tag and cookie count\n", pageIdx);
-                    return EXIT_CODE_BAD_PARSE;
-                } else if (memcmp(pageBase, COOKIE_PAGE_TAG, sizeof(COOKIE_PAGE_TAG))) {
-                    fprintf(stderr, "Bad page tag - is this a cookie file?\n");
-                    return EXIT_CODE_BAD_MAGIC;
+            *cursor++ = 0xF0 | (codePoint >> 18);
+            *cursor++ = 0x80 | ((codePoint >> 12) & 0x3F);
+            *cursor++ = 0x80 | ((codePoint >> 6) & 0x3F);
+            *cursor++ = 0x80 | (codePoint & 0x3F);
+        }
+    }
+    *cursor = 0;
+    emitJsonString(out, value);
+    free(value);
+    return 1;
+}
+
+// Emit the object as JSON, or with a null out just check it. Returns zero if the plist is malformed.
+// Dates are seconds since the Mac epoch, like the cookie times, and data is base64.
+int emitJsonPlistObject(FILE * out, struct Plist * plist, uint64_t ref, int depth) {
+    uint64_t offset;
+    if (MAX_PLIST_DEPTH < depth || !plist->visitsLeft || !plistObjectOffset(plist, ref, &offset)) {
+        return 0;
+    }
+    --plist->visitsLeft;
+    const uint8_t marker = plist->data[offset++];
+    switch (marker & 0xF0) {
+        case 0x00: {
+            if (0x00 == marker || 0x08 == marker || 0x09 == marker) {
+                if (!out) {
+                    // Just checking
+                } else if (0x00 == marker) {
+                    emitJsonValueNull(out);
+                } else if (0x08 == marker) {
+                    emitJsonValueFalse(out);
                 } else {
-                    // Process page
-                    const char * cookieOffsetBase = pageBase + sizeof(COOKIE_PAGE_TAG);
-                    const uint32_t cookieCount = read32Lo(&cookieOffsetBase);
-                    const char * cookiePageHeaderEnd = cookieOffsetBase + cookieCount * sizeof(uint32_t);
-                    if (pageEnd < cookiePageHeaderEnd + sizeof(COOKIE_PAGE_HEADER_END)) {
-                        fprintf(stderr, "Page %d too short for cookie offsets\n", pageIdx);
-                        return EXIT_CODE_BAD_PARSE;
-                    } else if (memcmp(cookiePageHeaderEnd, COOKIE_PAGE_HEADER_END, sizeof(COOKIE_PAGE_HEADER_END))) {
-                        fprintf(stderr, "Bad page header end - is this a cookie file?\n");
-                        return EXIT_CODE_BAD_MAGIC;
-                    } else {
-                        for(int cookieIdx = 0; cookieIdx < cookieCount; ++cookieIdx) {
-                            const char * cookieBase = pageBase + read32Lo(&cookieOffsetBase);
-                            const char * cookieCursor = cookieBase;
-                            // Check enough space for the mandatory fields read below
-                            if (data + length < cookieCursor + 10 * sizeof(uint32_t) + 2 * sizeof(uint64_t)) {
-                                fprintf(stderr, "Cookie %d in Page %d too short for cookie header\n", cookieIdx, pageIdx);
-                                return EXIT_CODE_BAD_PARSE;
-                            } else {
-                                // The size of the cookie record, which we use just for validation
-                                const uint32_t cookieSize = read32Lo(&cookieCursor);
-                                const uint32_t version = read32Lo(&cookieCursor);
-                                const uint32_t flags = read32Lo(&cookieCursor);
-                                const uint32_t hasPort = read32Lo(&cookieCursor); // extra field below ?
-                                const uint32_t domain = read32Lo(&cookieCursor);
-                                const uint32_t name = read32Lo(&cookieCursor);
-                                const uint32_t path = read32Lo(&cookieCursor);
-                                const uint32_t value = read32Lo(&cookieCursor);
-                                const uint32_t comment = read32Lo(&cookieCursor);
-                                const uint32_t commentUrl = read32Lo(&cookieCursor);
-                                const double expiry = readDouble(&cookieCursor);
-                                const double creation = readDouble(&cookieCursor);
-                                // if hasPort, maybe there us a uint15_t port here ?
-                                const char * cookieEnd = cookieBase + cookieSize;
-                                if (pageEnd < cookieEnd) {
-                                    fprintf(stderr,
-                                        "Cookie %d in Page %d has end past end of page\n",
-                                        cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (0 != *(cookieEnd - 1)) {
-                                    fprintf(stderr,
-                                        "Cookie %d in Page %d does not end with null terminated string\n",
-                                        cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + domain) {
-                                    fprintf(stderr, "Cookie %d in Page %d domain out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + name) {
-                                    fprintf(stderr, "Cookie %d in Page %d name out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + path) {
-                                    fprintf(stderr, "Cookie %d in Page %d path out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + value) {
-                                    fprintf(stderr, "Cookie %d in Page %d value out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + comment) {
-                                    fprintf(stderr, "Cookie %d in Page %d comment out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else if (cookieEnd < cookieBase + commentUrl) {
-                                    fprintf(stderr, "Cookie %d in Page %d commentUrl out of range\n", cookieIdx, pageIdx);
-                                    return EXIT_CODE_BAD_PARSE;
-                                } else {
-                                    if (first) {
-                                        first = 0;
-                                    } else {
-                                        emitJsonValueSeparator();
-                                    }
-                                    emitJsonBeginObject();
-                                    emitJsonNamedValueInt("version", version);
-                                    // Treating flags as an integer for now
-                                    emitJsonSeparatedNamedValueInt("flags", flags);
-                                    emitJsonOptionalSeparatedNamedValueString(domain, "domain", cookieBase + domain);
-                                    emitJsonOptionalSeparatedNamedValueString(name, "name", cookieBase + name);
-                                    emitJsonOptionalSeparatedNamedValueString(path, "path", cookieBase + path);
-                                    emitJsonOptionalSeparatedNamedValueString(value, "value", cookieBase + value);
-                                    emitJsonOptionalSeparatedNamedValueString(comment, "comment", cookieBase + comment);
-                                    emitJsonOptionalSeparatedNamedValueString(commentUrl, "commentUrl", cookieBase + commentUrl);
-                                    emitJsonSeparatedNamedValueDouble("expiry", expiry);
-                                    emitJsonSeparatedNamedValueDouble("creation", creation);
-                                    emitJsonEndObject();
-                                }
-                            }
-                        }
-                    }
-                    // Incorporate the page checksum into the running total. Yes the loop steps four bytes, but
-                    // only one byte is included each time. This works in my examples, and matches my understanding
-                    // of the swift version.
-                    for(const char * pageCursor = pageBase; pageCursor < pageEnd; pageCursor += sizeof(uint32_t)) {
-                        const uint8_t byte = *pageCursor;
-                        checkSum += byte;
-                    }
-                    pageBase = pageEnd;
+                    emitJsonValueTrue(out);
                 }
+                return 1;
+            } else {
+                return 0;
+            }
+        }
+        case 0x10: {
+            // 16 byte ints are only used for big unsigned values, and we keep the low 64 bits
+            const int size = 1 << (marker & 0x0F);
+            if (16 < size || !plistHasRoom(plist, offset, 1, size)) {
+                return 0;
             }
-            if (data + length < pageBase + sizeof(uint32_t) + sizeof(BINARY_COOKIE_FOOTER) + sizeof(uint32_t)) {
-                fprintf(stderr, "File too short, for checksum, footer, and plist size\n");
-                return EXIT_CODE_BAD_EOF;
+            const uint64_t value = readPlistInt(plist->data + offset + (16 == size ? 8 : 0), 16 == size ? 8 : size);
+            if (!out) {
+                // Just checking
+            } else if (8 == size) {
+                // Only 8 byte ints are signed
+                fprintf(out, "%lld", (long long)value);
             } else {
-                uint32_t savedCheckSum = read32Hi(&pageBase);
-                if (savedCheckSum != checkSum) {
-                    fprintf(stderr, "Bad file checksum\n");
-                    return EXIT_CODE_BAD_PARSE;
-                } else
-                if (memcmp(pageBase, BINARY_COOKIE_FOOTER, sizeof(BINARY_COOKIE_FOOTER))) {
-                    fprintf(stderr, "Bad file footer - is this a cookie file?\n");
-                    return EXIT_CODE_BAD_MAGIC;
+                fprintf(out, "%llu", (unsigned long long)value);
+            }
+            return 1;
+        }
+        case 0x20:
+        case 0x30: {
+            const int size = 0x30 == (marker & 0xF0) ? 8 : 1 << (marker & 0x0F);
+            if ((4 != size && 8 != size) || !plistHasRoom(plist, offset, 1, size)) {
+                return 0;
+            }
+            const uint64_t raw = readPlistInt(plist->data + offset, size);
+            if (out) {
+                if (4 == size) {
+                    const uint32_t raw32 = raw;
+                    float value;
+                    memcpy(&value, &raw32, sizeof(value));
+                    emitJsonNumberDouble(out, value);
                 } else {
-                    pageBase += sizeof(BINARY_COOKIE_FOOTER);
-                    const uint32_t plistSize = read32Hi(&pageBase);
-                    if (data + length != pageBase + plistSize) {
-                        fprintf(stderr, "File length and plist data length mismatch\n");
-                        return EXIT_CODE_BAD_PARSE;
-                    } else {
-                        // It's not worth parsing the binary plist - it my experiment it contains
-                        // the NSHTTPCookieAcceptPolicy value
-
-                        // It's very ugly having these here
-                        emitJsonEndArray();
-                        emitJsonEndObject();
-
-                        return EXIT_CODE_OK;
+                    double value;
+                    memcpy(&value, &raw, sizeof(value));
+                    emitJsonNumberDouble(out, value);
+                }
+            }
+            return 1;
+        }
+        case 0x40: {
+            uint64_t count;
+            if (!readPlistCount(plist, marker, &offset, &count) || !plistHasRoom(plist, offset, count, 1)) {
+                return 0;
+            }
+            if (out) {
+                emitJsonBase64(out, plist->data + offset, count);
+            }
+            return 1;
+        }
+        case 0x50:
+        case 0x60: {
+            return emitJsonPlistString(out, plist, marker, offset);
+        }
+        case 0x80: {
+            const int size = (marker & 0x0F) + 1;
+            if (sizeof(uint64_t) < size || !plistHasRoom(plist, offset, 1, size)) {
+                return 0;
+            }
+            if (out) {
+                fprintf(out, "%llu", (unsigned long long)readPlistInt(plist->data + offset, size));
+            }
+            return 1;
+        }
+        case 0xA0:
+        case 0xC0:
+        case 0xD0: {
+            const int isDict = 0xD0 == (marker & 0xF0);
+            uint64_t count;
+            if (!readPlistCount(plist, marker, &offset, &count)
+                || !plistHasRoom(plist, offset, count, (isDict ? 2 : 1) * plist->objectRefSize)) {
+                return 0;
+            }
+            const uint8_t onPathBit = 1 << (ref % CHAR_BIT);
+            if (plist->onPath[ref / CHAR_BIT] & onPathBit) {
+                return 0;
+            }
+            plist->onPath[ref / CHAR_BIT] |= onPathBit;
+            if (out && isDict) {
+                emitJsonBeginObject(out);
+            } else if (out) {
+                emitJsonBeginArray(out);
+            }
+            for (uint64_t i = 0; i < count; ++i) {
+                if (out && i) {
+                    emitJsonValueSeparator(out);
+                }
+                const uint64_t valueRef = readPlistInt(plist->data + offset + (isDict ? count + i : i) * plist->objectRefSize,
+                    plist->objectRefSize);
+                if (isDict) {
+                    // JSON only has string keys
+                    const uint64_t keyRef = readPlistInt(plist->data + offset + i * plist->objectRefSize, plist->objectRefSize);
+                    uint64_t keyOffset;
+                    if (!plistObjectOffset(plist, keyRef, &keyOffset)
+                        || (0x50 != (plist->data[keyOffset] & 0xF0) && 0x60 != (plist->data[keyOffset] & 0xF0))
+                        || !emitJsonPlistObject(out, plist, keyRef, depth + 1)) {
+                        return 0;
                     }
+                    if (out) {
+                        emitJsonNameSeparator(out);
+                    }
+                }
+                if (!emitJsonPlistObject(out, plist, valueRef, depth + 1)) {
+                    return 0;
                 }
             }
+            if (out && isDict) {
+                emitJsonEndObject(out);
+            } else if (out) {
+                emitJsonEndArray(out);
+            }
+            plist->onPath[ref / CHAR_BIT] &= ~onPathBit;
+            return 1;
         }
+        default:
+            return 0;
     }
 }
 
-int printCookiesFromFd(int fd) {
-    struct stat statResult;
-    if (fstat(fd, &statResult)) {
-        perror("Cannot stat file");
-        return EXIT_CODE_BAD_STAT;
+// Checks the plist and formats it as JSON in the one walk, into a malloced buffer which every sink copies.
+// Returns zero if the plist is malformed, with *json null.
+int formatJsonPlist(const char * data, uint32_t length, char ** json, size_t * jsonSize) {
+    struct Plist plist;
+    *json = 0;
+    if (!openPlist(data, length, &plist)) {
+        return 0;
+    }
+    // The top object, and then each reference in the file, a few times over
+    plist.visitsLeft = MAX_PLIST_VISITS_PER_REFERENCE
+        * (1 + (plist.offsetTableOffset - sizeof(BINARY_PLIST_MAGIC)) / plist.objectRefSize);
+    plist.onPath = calloc(plist.objectCount / CHAR_BIT + 1, 1);
+    FILE * out = plist.onPath ? open_memstream(json, jsonSize) : 0;
+    int formatted = out && emitJsonPlistObject(out, &plist, plist.topObject, 0);
+    if (out && fclose(out)) {
+        formatted = 0;
+    }
+    free(plist.onPath);
+    if (!formatted) {
+        free(*json);
+        *json = 0;
     }
+    return formatted;
+}
 
-    const off_t length = statResult.st_size;
+// Where a cookie is, so it can be fetched again without walking the whole file. The file is identified
+// by its length and the checksum it records.
+struct CookieLocator {
+    uint32_t fileCheckSum;
+    off_t fileLength;
+    uint32_t pageIdx;
+    uint32_t cookieIdx;
+    // From the start of the file
+    uint64_t offset;
+};
 
-    void * data = mmap(0, length, PROT_READ, MAP_PRIVATE | MAP_NOCACHE, fd, 0);
-    if (MAP_FAILED == data) {
-        perror("Cannot mmap file");
-        return EXIT_CODE_BAD_MMAP;
+enum {
+    // CHECKSUM-LENGTH:PAGE:COOKIE:OFFSET
+    MAX_LOCATOR_SIZE = 8 + 1 + 20 + 1 + 10 + 1 + 10 + 1 + 20 + 1,
+};
+
+void formatLocator(char * buffer, const struct CookieLocator * locator) {
+    snprintf(buffer, MAX_LOCATOR_SIZE, "%08x-%lld:%u:%u:%llu", locator->fileCheckSum,
+        (long long)locator->fileLength, locator->pageIdx, locator->cookieIdx, (unsigned long long)locator->offset);
+}
+
+int parseLocator(const char * text, struct CookieLocator * locator) {
+    long long fileLength;
+    unsigned long long offset;
+    int consumed = 0;
+    if (5 != sscanf(text, "%8x-%lld:%u:%u:%llu%n", &locator->fileCheckSum, &fileLength,
+        &locator->pageIdx, &locator->cookieIdx, &offset, &consumed) || text[consumed]) {
+        return 0;
     } else {
-        int exitCode = printCookiesFromMmap(length, data);
-        if (munmap(data, length)) {
-            perror("Cannot munmap file");
-            return exitCode ? exitCode : EXIT_CODE_BAD_MUNMAP;
-        } else {
-            return exitCode;
-        }
+        locator->fileLength = fileLength;
+        locator->offset = offset;
+        return 1;
     }
 }
 
-int main(int argc, const char **argv) {
-    if (2 != argc) {
-        fprintf(stderr, "Usage: %s FILENAME\n", *argv);
-        fprintf(stderr, "  For example,\n");
-        fprintf(stderr,
-            "  %s \"${HOME}\"/Library/Containers/com.apple.Safari/Data/Library/Cookies/Cookies.binarycookies\n",
-            *argv);
-        return EXIT_CODE_BAD_INVOCATION;
+void emitJsonSeparatedNamedValueLocator(FILE * out, const char * name, const struct CookieLocator * locator) {
+    char buffer[MAX_LOCATOR_SIZE];
+    formatLocator(buffer, locator);
+    emitJsonOptionalSeparatedNamedValueString(out, name, buffer);
+}
+
+// These are the flag bits i've seen, matching the swift version. Anything else is passed through.
+enum {
+    COOKIE_FLAG_SECURE = 1,
+    COOKIE_FLAG_HTTP_ONLY = 4,
+};
+
+// Safari times count from 2001, everyone else counts from 1970
+const double MAC_EPOCH_UNIX_SECONDS = 978307200;
+
+void emitJsonCookie(FILE * out, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    emitJsonBeginObject(out);
+    emitJsonNamedValueInt(out, "version", cookie->version);
+    // Treating flags as an integer for now
+    emitJsonSeparatedNamedValueInt(out, "flags", cookie->flags);
+    emitJsonOptionalSeparatedNamedValueString(out, "domain", cookie->domain);
+    emitJsonOptionalSeparatedNamedValueString(out, "name", cookie->name);
+    emitJsonOptionalSeparatedNamedValueString(out, "path", cookie->path);
+    emitJsonOptionalSeparatedNamedValueString(out, "value", cookie->value);
+    emitJsonOptionalSeparatedNamedValueString(out, "comment", cookie->comment);
+    emitJsonOptionalSeparatedNamedValueString(out, "commentUrl", cookie->commentUrl);
+    emitJsonSeparatedNamedValueDouble(out, "expiry", cookie->expiry);
+    emitJsonSeparatedNamedValueDouble(out, "creation", cookie->creation);
+    if (locator) {
+        emitJsonSeparatedNamedValueLocator(out, "locator", locator);
     }
+    emitJsonEndObject(out);
+}
 
-    const char * filename = argv[1];
-    const int fd = open(filename, O_RDONLY);
-    if (-1 == fd) {
-        perror("Cannot open file");
-        return EXIT_CODE_BAD_OPEN;
-    } else {
-        const int exitCode = printCookiesFromFd(fd);
-        if (close(fd)) {
-            // Not much we can actually do, but interesting to know maybe
-            perror("Cannot close file");
-            return exitCode ? exitCode : EXIT_CODE_BAD_CLOSE;
-        } else {
-            return exitCode;
-        }
+// What happens to the output for a file which turns out to be bad part way through. Cookies are written
+// as they're decoded, before the checksum and footer at the end of the file are checked.
+enum OutputMode {
+    // Whatever was written stays, unterminated, as it always has
+    OUTPUT_MODE_PARTIAL,
+    // Each file's output is held in memory and only written once the file is validated, and output files
+    // are written under a temporary name and renamed into place when closed
+    OUTPUT_MODE_ATOMIC,
+    // Written as decoded, and every file ends with a status record, so consumers can tell
+    OUTPUT_MODE_STREAM,
+};
+
+// Cookies for one domain group, rendered as they arrive since the records only last for the walk. The
+// stream writes through to buffer and size, so a group mustn't move once it's opened.
+struct StorageStateGroup {
+    char * name;
+    FILE * out;
+    char * buffer;
+    size_t size;
+    // Bytes from files which were validated, anything after is from the current file
+    off_t committedSize;
+};
+
+// The snapshot being diffed against, keyed by domain, name and path. A file may repeat a key, so it's a
+// multiset, and each entry is matched at most once per file. Entries keep insertion order, so removals come
+// out in the base's order, and the index maps hashes to entries, plus one so zero is empty.
+struct DiffEntry {
+    struct SafariCookie cookie;
+    int seen;
+};
+
+struct DiffBase {
+    struct DiffEntry * entries;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t * index;
+    // Always a power of two, or zero
+    uint64_t indexCapacity;
+};
+
+// Background sweeps share hosts with other services, so reading and CPU can both be capped. --max-read-rate
+// is a token bucket on bytes faulted in, shared by every reader thread. Files are faulted in a chunk at a
+// time, and each chunk takes its bytes from the bucket first, going into debt and sleeping it off, so the
+// lock is only held for the arithmetic. --cpu-duty caps the process's CPU time as a fraction of wall time,
+// checked after each file and window, by sleeping until the fraction is back under the cap. It's measured
+// over periods of a second, so a run that was waiting on reads earlier can't then make up for it in a burst.
+enum {
+    THROTTLE_CHUNK_SIZE = 1 << 18,
+};
+
+const uint64_t THROTTLE_PERIOD_NANOSECONDS = 1000000000ULL;
+// How much unused rate can be saved up while idle, as a burst
+const double THROTTLE_BURST_SECONDS = 0.1;
+
+struct Throttle {
+    // Zero for no limit
+    double readRate;
+    pthread_mutex_t lock;
+    double tokens;
+    uint64_t refilled;
+    uint64_t readWaitNanoseconds;
+    // Zero for no limit, otherwise the fraction of wall time we may use
+    double cpuDuty;
+    uint64_t periodStarted;
+    uint64_t periodCpuStarted;
+    uint64_t cpuWaitNanoseconds;
+};
+
+uint64_t monotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t processCpuNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sleepNanoseconds(uint64_t nanoseconds) {
+    struct timespec remaining = { nanoseconds / 1000000000ULL, nanoseconds % 1000000000ULL };
+    while (nanosleep(&remaining, &remaining) && EINTR == errno) {
+    }
+}
+
+void startThrottle(struct Throttle * throttle) {
+    pthread_mutex_init(&throttle->lock, 0);
+    throttle->refilled = monotonicNanoseconds();
+    throttle->tokens = THROTTLE_CHUNK_SIZE;
+    throttle->periodStarted = throttle->refilled;
+    throttle->periodCpuStarted = processCpuNanoseconds();
+}
+
+void throttleRead(struct Throttle * throttle, uint64_t bytes) {
+    if (!throttle || !throttle->readRate) {
+        return;
+    }
+    pthread_mutex_lock(&throttle->lock);
+    const uint64_t now = monotonicNanoseconds();
+    const double burst = THROTTLE_CHUNK_SIZE < throttle->readRate * THROTTLE_BURST_SECONDS
+        ? throttle->readRate * THROTTLE_BURST_SECONDS : THROTTLE_CHUNK_SIZE;
+    throttle->tokens += (now - throttle->refilled) / 1e9 * throttle->readRate;
+    throttle->tokens = burst < throttle->tokens ? burst : throttle->tokens;
+    throttle->refilled = now;
+    throttle->tokens -= bytes;
+    const uint64_t wait = throttle->tokens < 0 ? -throttle->tokens / throttle->readRate * 1e9 : 0;
+    throttle->readWaitNanoseconds += wait;
+    pthread_mutex_unlock(&throttle->lock);
+    if (wait) {
+        sleepNanoseconds(wait);
+    }
+}
+
+// Only called from the main thread
+void throttleCpu(struct Throttle * throttle) {
+    if (!throttle || !throttle->cpuDuty) {
+        return;
+    }
+    const uint64_t now = monotonicNanoseconds();
+    const uint64_t cpu = processCpuNanoseconds();
+    const uint64_t allowed = (cpu - throttle->periodCpuStarted) / throttle->cpuDuty;
+    const uint64_t elapsed = now - throttle->periodStarted;
+    if (elapsed < allowed) {
+        sleepNanoseconds(allowed - elapsed);
+        throttle->cpuWaitNanoseconds += allowed - elapsed;
+    }
+    if (THROTTLE_PERIOD_NANOSECONDS <= elapsed) {
+        throttle->periodStarted = monotonicNanoseconds();
+        throttle->periodCpuStarted = cpu;
+    }
+}
+
+// Latency histograms, log linear like HdrHistogram. Each power of two of nanoseconds is split into sixteen
+// buckets, so a value is known to within about 6%, from a nanosecond to centuries in under 8KiB. A histogram
+// is only written by one thread, but counts are atomic so another thread can read a sensible snapshot, and
+// histograms from several threads merge by adding them up.
+enum {
+    LATENCY_SUB_BUCKET_BITS = 4,
+    LATENCY_SUB_BUCKET_COUNT = 1 << LATENCY_SUB_BUCKET_BITS,
+    LATENCY_BUCKET_COUNT = (64 - LATENCY_SUB_BUCKET_BITS) * LATENCY_SUB_BUCKET_COUNT + LATENCY_SUB_BUCKET_COUNT,
+};
+
+struct LatencyHistogram {
+    _Atomic uint64_t counts[LATENCY_BUCKET_COUNT];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+// Where each file's time goes. The walk validates and writes as it goes, so those can't be split, and
+// finishing is the sinks ending the file, which with --atomic includes writing it out.
+enum LatencyPhase {
+    LATENCY_PHASE_OPEN,
+    LATENCY_PHASE_WALK,
+    LATENCY_PHASE_FINISH,
+    LATENCY_PHASE_FILE,
+    // Each locator with --fetch
+    LATENCY_PHASE_FETCH,
+    LATENCY_PHASE_COUNT,
+};
+
+const char * const LATENCY_PHASE_NAMES[] = { "Open", "Walk", "Finish", "File", "Fetch" };
+
+struct Latency {
+    struct LatencyHistogram phases[LATENCY_PHASE_COUNT];
+};
+
+uint32_t latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < 2 * LATENCY_SUB_BUCKET_COUNT) {
+        return nanoseconds;
+    }
+    const int shift = 63 - __builtin_clzll(nanoseconds) - LATENCY_SUB_BUCKET_BITS;
+    return shift * LATENCY_SUB_BUCKET_COUNT + (nanoseconds >> shift);
+}
+
+// The largest value which lands in the bucket
+uint64_t latencyBucketLimit(uint32_t bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKET_COUNT) {
+        return bucket;
+    }
+    const int shift = bucket / LATENCY_SUB_BUCKET_COUNT - 1;
+    const uint64_t mantissa = bucket % LATENCY_SUB_BUCKET_COUNT + LATENCY_SUB_BUCKET_COUNT;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// A store rather than an add, since only this thread writes
+void addRelaxed(_Atomic uint64_t * counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+void recordLatency(struct LatencyHistogram * histogram, uint64_t nanoseconds) {
+    addRelaxed(&histogram->counts[latencyBucket(nanoseconds)], 1);
+    addRelaxed(&histogram->count, 1);
+    addRelaxed(&histogram->sum, nanoseconds);
+    if (atomic_load_explicit(&histogram->max, memory_order_relaxed) < nanoseconds) {
+        atomic_store_explicit(&histogram->max, nanoseconds, memory_order_relaxed);
+    }
+}
+
+void mergeLatency(struct LatencyHistogram * into, const struct LatencyHistogram * from) {
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKET_COUNT; ++bucket) {
+        addRelaxed(&into->counts[bucket], atomic_load_explicit(&from->counts[bucket], memory_order_relaxed));
+    }
+    addRelaxed(&into->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+    addRelaxed(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+    const uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (atomic_load_explicit(&into->max, memory_order_relaxed) < max) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+}
+
+// The value at or below which the fraction of recorded values fall, as the bucket's upper limit
+uint64_t latencyQuantile(const struct LatencyHistogram * histogram, double fraction) {
+    const uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    const uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    uint64_t rank = fraction * count;
+    rank += rank < fraction * count || !rank;
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKET_COUNT; ++bucket) {
+        seen += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        if (rank <= seen) {
+            return latencyBucketLimit(bucket) < max ? latencyBucketLimit(bucket) : max;
+        }
+    }
+    return max;
+}
+
+// As stats lines, for each phase with anything recorded
+void emitLatency(FILE * out, const struct Latency * latency) {
+    static const struct {
+        const char * name;
+        double fraction;
+    } QUANTILES[] = { { "P50", 0.5 }, { "P90", 0.9 }, { "P99", 0.99 }, { "P999", 0.999 } };
+    for (int phase = 0; phase < LATENCY_PHASE_COUNT; ++phase) {
+        const struct LatencyHistogram * histogram = &latency->phases[phase];
+        const uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        if (!count) {
+            continue;
+        }
+        fprintf(out, "latency%sCount %llu\n", LATENCY_PHASE_NAMES[phase], (unsigned long long)count);
+        for (int i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); ++i) {
+            fprintf(out, "latency%s%sSeconds %.9f\n", LATENCY_PHASE_NAMES[phase], QUANTILES[i].name,
+                latencyQuantile(histogram, QUANTILES[i].fraction) / 1e9);
+        }
+        fprintf(out, "latency%sMaxSeconds %.9f\n", LATENCY_PHASE_NAMES[phase],
+            atomic_load_explicit(&histogram->max, memory_order_relaxed) / 1e9);
+    }
+}
+
+// Set by SIGUSR1, and checked between files
+volatile sig_atomic_t latencyDumpRequested = 0;
+
+void requestLatencyDump(int signal) {
+    latencyDumpRequested = 1;
+}
+
+enum {
+    MAX_PIPELINE_DECISIONS = 32,
+};
+
+struct PipelineDecision {
+    double seconds;
+    uint32_t readerCount;
+    uint32_t depth;
+    const char * reason;
+};
+
+// What the --pipeline controller saw and decided, for the stats sink
+struct PipelineReport {
+    int used;
+    double cpuCount;
+    uint32_t maxReaderCount;
+    // Where it ended up
+    uint32_t readerCount;
+    uint32_t depth;
+    uint64_t starvedNanoseconds;
+    // Every decision is counted, but only the first few are kept
+    uint32_t decisionCount;
+    struct PipelineDecision decisions[MAX_PIPELINE_DECISIONS];
+};
+
+// A sink is one configured output. The record walk drives every sink from the same pass over the
+// file, so an extra output only costs its formatting. Each sink has its own stream, and so its own buffer.
+struct CookieSink {
+    const char * filename;
+    FILE * out;
+    // Separators are fenceposts not terminators
+    int first;
+    // Add a locator to each record, where the format has room for it
+    int locators;
+    // Whether the plist has been written after the cookies, so the array is already ended
+    int cookiesEnded;
+    void (*beginFile)(struct CookieSink * sink, const char * filename, off_t length);
+    void (*beginPage)(struct CookieSink * sink, uint32_t pageIdx);
+    void (*cookie)(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator);
+    void (*endPage)(struct CookieSink * sink, uint32_t pageIdx);
+    // Only called with --plist, just before endFile, once the plist has been checked, with it as JSON too
+    void (*plist)(struct CookieSink * sink, const char * data, uint32_t length, const char * json, size_t jsonSize);
+    // Called with the file's exit code, so a failed file can be ended or abandoned as the mode says
+    void (*endFile)(struct CookieSink * sink, const char * filename, int exitCode);
+    void (*close)(struct CookieSink * sink);
+    enum OutputMode outputMode;
+    // With --atomic, the real output and where it's going, while this file's output is held back
+    FILE * committedOut;
+    char * temporaryFilename;
+    char * atomicBuffer;
+    size_t atomicSize;
+    unsigned long long atomicFileCount;
+    // Files begun so far in this run
+    unsigned long long fileCount;
+    // Only used by the stats sink
+    unsigned long long fileBytes;
+    unsigned long long pageCount;
+    struct timespec started;
+    unsigned long long cookieCount;
+    unsigned long long secureCount;
+    unsigned long long httpOnlyCount;
+    unsigned long long valueBytes;
+    unsigned long long plistCount;
+    // Only used by plugin sinks
+    void * library;
+    struct SafariCookiePlugin plugin;
+    struct SafariCookie * batch;
+    uint32_t batchCount;
+    uint32_t batchCapacity;
+    // Only used by storagestate sinks writing a file per domain group
+    const char * directory;
+    struct StorageStateGroup ** groups;
+    uint32_t groupCount;
+    // Always a power of two, or zero
+    uint32_t groupCapacity;
+    // For failures outside the stream, which would otherwise go unreported
+    int exitCode;
+    // Only used by diff sinks, and the sink collecting the base to diff against
+    struct DiffBase * diffBase;
+    // Only used by stats sinks
+    const struct PipelineReport * pipeline;
+    const struct Throttle * throttle;
+    const struct Latency * latency;
+    // Only used by ring sinks
+    struct SafariCookieRing * ring;
+    // Written but not yet published to the consumer
+    uint64_t ringHead;
+};
+
+enum {
+    MAX_SINK_COUNT = 16,
+    SINK_BUFFER_SIZE = 1 << 16,
+    MIN_RING_SIZE = 1 << 12,
+    DEFAULT_RING_SIZE = 1 << 20,
+};
+
+// With --atomic the output is written as PATH.XXXXXX beside PATH, so the rename stays on one file system
+FILE * openOutputFile(const char * path, enum OutputMode outputMode, char ** temporaryPath) {
+    FILE * out = 0;
+    *temporaryPath = 0;
+    if (OUTPUT_MODE_ATOMIC != outputMode) {
+        out = fopen(path, "w");
+    } else if ((*temporaryPath = malloc(strlen(path) + strlen(".XXXXXX") + 1))) {
+        sprintf(*temporaryPath, "%s.XXXXXX", path);
+        const int fd = mkstemp(*temporaryPath);
+        out = -1 == fd ? 0 : fdopen(fd, "w");
+        if (!out) {
+            if (-1 != fd) {
+                close(fd);
+                unlink(*temporaryPath);
+            }
+            free(*temporaryPath);
+            *temporaryPath = 0;
+        }
+    }
+    if (out) {
+        setvbuf(out, 0, _IOFBF, SINK_BUFFER_SIZE);
+    }
+    return out;
+}
+
+// Returns zero, with errno set, on failure, in which case any temporary is removed
+int closeOutputFile(FILE * out, const char * path, char * temporaryPath) {
+    int result = !fclose(out);
+    if (temporaryPath) {
+        if (result && rename(temporaryPath, path)) {
+            result = 0;
+        }
+        if (!result) {
+            const int renameErrno = errno;
+            unlink(temporaryPath);
+            errno = renameErrno;
+        }
+        free(temporaryPath);
+    }
+    return result;
+}
+
+void jsonSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    // One document per line when there is more than one file
+    if (sink->fileCount++) {
+        putc('\n', sink->out);
+    }
+    sink->first = 1;
+    emitJsonBeginObject(sink->out);
+    emitJsonString(sink->out, "cookies");
+    emitJsonNameSeparator(sink->out);
+    emitJsonBeginArray(sink->out);
+}
+
+void jsonSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    if (sink->first) {
+        sink->first = 0;
+    } else {
+        emitJsonValueSeparator(sink->out);
+    }
+    emitJsonCookie(sink->out, cookie, sink->locators ? locator : 0);
+}
+
+// Written straight away, since the file is unmapped by the time it's ended
+void jsonSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+    emitJsonEndArray(sink->out);
+    emitJsonValueSeparator(sink->out);
+    emitJsonString(sink->out, "plist");
+    emitJsonNameSeparator(sink->out);
+    fwrite(json, 1, jsonSize, sink->out);
+    sink->cookiesEnded = 1;
+}
+
+// With --stream, a status record for the end of every file, even a bad one
+void emitJsonStatus(FILE * out, const char * filename, int exitCode) {
+    emitJsonBeginObject(out);
+    emitJsonString(out, "file");
+    emitJsonNameSeparator(out);
+    emitJsonString(out, filename);
+    emitJsonSeparatedNamedValueInt(out, "exitCode", exitCode);
+    emitJsonEndObject(out);
+}
+
+void jsonSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    const int cookiesEnded = sink->cookiesEnded;
+    sink->cookiesEnded = 0;
+    if (exitCode && OUTPUT_MODE_STREAM != sink->outputMode) {
+        return;
+    }
+    if (!cookiesEnded) {
+        emitJsonEndArray(sink->out);
+    }
+    if (OUTPUT_MODE_STREAM == sink->outputMode) {
+        emitJsonValueSeparator(sink->out);
+        emitJsonString(sink->out, "status");
+        emitJsonNameSeparator(sink->out);
+        emitJsonStatus(sink->out, filename, exitCode);
+    }
+    emitJsonEndObject(sink->out);
+}
+
+void ndjsonSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+}
+
+// One object per line, so consumers can start on a record without waiting for the whole file
+void ndjsonSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    emitJsonCookie(sink->out, cookie, sink->locators ? locator : 0);
+    putc('\n', sink->out);
+}
+
+// A last line, so the cookie lines all stay the same shape
+void ndjsonSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+    emitJsonBeginObject(sink->out);
+    emitJsonString(sink->out, "plist");
+    emitJsonNameSeparator(sink->out);
+    fwrite(json, 1, jsonSize, sink->out);
+    emitJsonEndObject(sink->out);
+    putc('\n', sink->out);
+}
+
+void ndjsonSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    if (OUTPUT_MODE_STREAM == sink->outputMode) {
+        emitJsonBeginObject(sink->out);
+        emitJsonString(sink->out, "status");
+        emitJsonNameSeparator(sink->out);
+        emitJsonStatus(sink->out, filename, exitCode);
+        emitJsonEndObject(sink->out);
+        putc('\n', sink->out);
+    }
+}
+
+void statsSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    ++sink->fileCount;
+    sink->fileBytes += length;
+}
+
+void statsSinkBeginPage(struct CookieSink * sink, uint32_t pageIdx) {
+    ++sink->pageCount;
+}
+
+void statsSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    ++sink->cookieCount;
+    if (cookie->flags & COOKIE_FLAG_SECURE) {
+        ++sink->secureCount;
+    }
+    if (cookie->flags & COOKIE_FLAG_HTTP_ONLY) {
+        ++sink->httpOnlyCount;
+    }
+    if (cookie->value) {
+        sink->valueBytes += strlen(cookie->value);
+    }
+}
+
+void statsSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+    ++sink->plistCount;
+}
+
+void statsSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+}
+
+// Simple "name value" lines, so it's easy to use from a shell
+void statsSinkClose(struct CookieSink * sink) {
+    fprintf(sink->out, "files %llu\n", sink->fileCount);
+    fprintf(sink->out, "pages %llu\n", sink->pageCount);
+    fprintf(sink->out, "cookies %llu\n", sink->cookieCount);
+    fprintf(sink->out, "secure %llu\n", sink->secureCount);
+    fprintf(sink->out, "httpOnly %llu\n", sink->httpOnlyCount);
+    fprintf(sink->out, "valueBytes %llu\n", sink->valueBytes);
+    fprintf(sink->out, "plists %llu\n", sink->plistCount);
+    // For comparing --window and --pipeline settings
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double seconds = (now.tv_sec - sink->started.tv_sec) + (now.tv_nsec - sink->started.tv_nsec) / 1e9;
+    fprintf(sink->out, "fileBytes %llu\n", sink->fileBytes);
+    fprintf(sink->out, "seconds %.6f\n", seconds);
+    fprintf(sink->out, "bytesPerSecond %.0f\n", seconds > 0 ? sink->fileBytes / seconds : 0);
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+#ifdef __APPLE__
+        const unsigned long long maxRssBytes = usage.ru_maxrss;
+#else
+        const unsigned long long maxRssBytes = usage.ru_maxrss * 1024ULL;
+#endif
+        fprintf(sink->out, "maxRssBytes %llu\n", maxRssBytes);
+    }
+    const struct PipelineReport * pipeline = sink->pipeline;
+    if (pipeline && pipeline->used) {
+        fprintf(sink->out, "pipelineCpus %.2f\n", pipeline->cpuCount);
+        fprintf(sink->out, "pipelineMaxReaders %u\n", pipeline->maxReaderCount);
+        fprintf(sink->out, "pipelineReaders %u\n", pipeline->readerCount);
+        fprintf(sink->out, "pipelineDepth %u\n", pipeline->depth);
+        fprintf(sink->out, "pipelineStarvedSeconds %.6f\n", pipeline->starvedNanoseconds / 1e9);
+        fprintf(sink->out, "pipelineDecisions %u\n", pipeline->decisionCount);
+        for (uint32_t decisionIdx = 0; decisionIdx < pipeline->decisionCount && decisionIdx < MAX_PIPELINE_DECISIONS;
+            ++decisionIdx) {
+            const struct PipelineDecision * decision = &pipeline->decisions[decisionIdx];
+            fprintf(sink->out, "pipelineDecision %.3f %s %u %u\n", decision->seconds, decision->reason,
+                decision->readerCount, decision->depth);
+        }
+    }
+    if (sink->latency) {
+        emitLatency(sink->out, sink->latency);
+    }
+    if (sink->throttle) {
+        fprintf(sink->out, "throttledReadSeconds %.6f\n", sink->throttle->readWaitNanoseconds / 1e9);
+        fprintf(sink->out, "throttledCpuSeconds %.6f\n", sink->throttle->cpuWaitNanoseconds / 1e9);
+    }
+}
+
+// Playwright storageState, for seeding browser automation sessions. Playwright wants every field, in
+// unix time.
+void emitJsonStorageStateCookie(FILE * out, const struct SafariCookie * cookie) {
+    emitJsonBeginObject(out);
+    emitJsonString(out, "name");
+    emitJsonNameSeparator(out);
+    emitJsonString(out, cookie->name ? cookie->name : "");
+    emitJsonOptionalSeparatedNamedValueString(out, "value", cookie->value ? cookie->value : "");
+    emitJsonOptionalSeparatedNamedValueString(out, "domain", cookie->domain ? cookie->domain : "");
+    emitJsonOptionalSeparatedNamedValueString(out, "path", cookie->path ? cookie->path : "/");
+    // A session cookie has no expiry, which is stored as zero, and Playwright wants as -1
+    const int session = 0 == cookie->expiry;
+    emitJsonSeparatedNamedValueDouble(out, "expires", session ? -1 : cookie->expiry + MAC_EPOCH_UNIX_SECONDS);
+    emitJsonValueSeparator(out);
+    emitJsonString(out, "httpOnly");
+    emitJsonNameSeparator(out);
+    if (cookie->flags & COOKIE_FLAG_HTTP_ONLY) {
+        emitJsonValueTrue(out);
+    } else {
+        emitJsonValueFalse(out);
+    }
+    emitJsonValueSeparator(out);
+    emitJsonString(out, "secure");
+    emitJsonNameSeparator(out);
+    if (cookie->flags & COOKIE_FLAG_SECURE) {
+        emitJsonValueTrue(out);
+    } else {
+        emitJsonValueFalse(out);
+    }
+    // None of the stores give us SameSite, so don't make up a restriction the site never asked for. Browsers
+    // refuse None without Secure, though, and treat a cookie without SameSite as Lax, so that's what those get.
+    emitJsonOptionalSeparatedNamedValueString(out, "sameSite", cookie->flags & COOKIE_FLAG_SECURE ? "None" : "Lax");
+    emitJsonEndObject(out);
+}
+
+void emitJsonStorageStateBegin(FILE * out) {
+    emitJsonBeginObject(out);
+    emitJsonString(out, "cookies");
+    emitJsonNameSeparator(out);
+    emitJsonBeginArray(out);
+}
+
+// With a filename, a status member too, as for json with --stream
+void emitJsonStorageStateEnd(FILE * out, const char * statusFilename, int exitCode) {
+    emitJsonEndArray(out);
+    emitJsonValueSeparator(out);
+    emitJsonString(out, "origins");
+    emitJsonNameSeparator(out);
+    emitJsonBeginArray(out);
+    emitJsonEndArray(out);
+    if (statusFilename) {
+        emitJsonValueSeparator(out);
+        emitJsonString(out, "status");
+        emitJsonNameSeparator(out);
+        emitJsonStatus(out, statusFilename, exitCode);
+    }
+    emitJsonEndObject(out);
+}
+
+// The group is the last two labels of the domain, so .www.example.com and example.com share a session.
+// That's wrong for suffixes like co.uk, but good enough without shipping the public suffix list. The
+// result is a file name, so anything which isn't plainly a host name character is replaced.
+char * storageStateGroupName(const char * domain) {
+    const char * start = domain ? domain : "";
+    const char * end = start + strlen(start);
+    int dots = 0;
+    for (const char * cursor = end; cursor > start; --cursor) {
+        if ('.' == cursor[-1] && cursor < end && 2 == ++dots) {
+            start = cursor;
+            break;
+        }
+    }
+    while ('.' == *start) {
+        ++start;
+    }
+    char * name = strdup(*start ? start : "_");
+    for (char * cursor = name; cursor && *cursor; ++cursor) {
+        if (!(('a' <= *cursor && *cursor <= 'z') || ('A' <= *cursor && *cursor <= 'Z')
+            || ('0' <= *cursor && *cursor <= '9') || '.' == *cursor || '-' == *cursor || '_' == *cursor)) {
+            *cursor = '_';
+        }
+    }
+    return name;
+}
+
+uint32_t hashString(const char * value) {
+    uint32_t hash = 2166136261u;
+    for (; *value; ++value) {
+        hash = (hash ^ (uint8_t)*value) * 16777619u;
+    }
+    return hash;
+}
+
+// Open addressing, doubling at half full
+int growStorageStateGroups(struct CookieSink * sink) {
+    const uint32_t capacity = sink->groupCapacity ? 2 * sink->groupCapacity : 64;
+    struct StorageStateGroup ** groups = calloc(capacity, sizeof(*groups));
+    if (!groups) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < sink->groupCapacity; ++i) {
+        if (sink->groups[i]) {
+            uint32_t slot = hashString(sink->groups[i]->name) & (capacity - 1);
+            while (groups[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            groups[slot] = sink->groups[i];
+        }
+    }
+    free(sink->groups);
+    sink->groups = groups;
+    sink->groupCapacity = capacity;
+    return 1;
+}
+
+// Returns null if we're out of memory
+struct StorageStateGroup * findStorageStateGroup(struct CookieSink * sink, const char * domain) {
+    if (2 * (sink->groupCount + 1) > sink->groupCapacity && !growStorageStateGroups(sink)) {
+        return 0;
+    }
+    char * name = storageStateGroupName(domain);
+    if (!name) {
+        return 0;
+    }
+    uint32_t slot = hashString(name) & (sink->groupCapacity - 1);
+    while (sink->groups[slot] && strcmp(sink->groups[slot]->name, name)) {
+        slot = (slot + 1) & (sink->groupCapacity - 1);
+    }
+    if (sink->groups[slot]) {
+        free(name);
+        return sink->groups[slot];
+    }
+    struct StorageStateGroup * group = calloc(1, sizeof(*group));
+    if (group) {
+        group->out = open_memstream(&group->buffer, &group->size);
+    }
+    if (!group || !group->out) {
+        free(group);
+        free(name);
+        return 0;
+    }
+    group->name = name;
+    sink->groups[slot] = group;
+    ++sink->groupCount;
+    return group;
+}
+
+void storageStateSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    if (sink->directory) {
+        return;
+    }
+    // As for json, one document per line when there is more than one file
+    if (sink->fileCount++) {
+        putc('\n', sink->out);
+    }
+    sink->first = 1;
+    emitJsonStorageStateBegin(sink->out);
+}
+
+// Into a directory, every input file's cookies go into the same groups, so there's a single session per
+// group however the cookies were split between files.
+void storageStateSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie,
+    const struct CookieLocator * locator) {
+    FILE * out = sink->out;
+    if (sink->directory) {
+        struct StorageStateGroup * group = findStorageStateGroup(sink, cookie->domain);
+        if (!group) {
+            if (!sink->exitCode) {
+                perror("Cannot group cookies");
+                sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+            }
+            return;
+        }
+        out = group->out;
+        if (ftello(out)) {
+            emitJsonValueSeparator(out);
+        }
+    } else if (sink->first) {
+        sink->first = 0;
+    } else {
+        emitJsonValueSeparator(out);
+    }
+    emitJsonStorageStateCookie(out, cookie);
+}
+
+void storageStateSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+}
+
+// Nothing in a directory is written until close, so a bad file's cookies can always be taken back out
+void storageStateSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    if (!sink->directory) {
+        if (!exitCode || OUTPUT_MODE_STREAM == sink->outputMode) {
+            emitJsonStorageStateEnd(sink->out, OUTPUT_MODE_STREAM == sink->outputMode ? filename : 0, exitCode);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < sink->groupCapacity; ++i) {
+        struct StorageStateGroup * group = sink->groups[i];
+        if (!group) {
+            continue;
+        } else if (exitCode) {
+            fseeko(group->out, group->committedSize, SEEK_SET);
+        } else {
+            group->committedSize = ftello(group->out);
+        }
+    }
+}
+
+// Write out DIRECTORY/GROUP.json for each group
+void storageStateSinkClose(struct CookieSink * sink) {
+    char * path = 0;
+    for (uint32_t i = 0; i < sink->groupCapacity; ++i) {
+        struct StorageStateGroup * group = sink->groups[i];
+        if (!group) {
+            continue;
+        }
+        FILE * out = 0;
+        char * temporaryPath = 0;
+        const int closed = !fclose(group->out);
+        if (closed && !group->committedSize) {
+            // Only bad files had cookies for this group
+        } else if (closed) {
+            free(path);
+            path = malloc(strlen(sink->directory) + strlen(group->name) + strlen("/.json") + 1);
+            if (path) {
+                sprintf(path, "%s/%s.json", sink->directory, group->name);
+                out = openOutputFile(path, sink->outputMode, &temporaryPath);
+            }
+        }
+        if (out) {
+            emitJsonStorageStateBegin(out);
+            fwrite(group->buffer, 1, group->committedSize, out);
+            emitJsonStorageStateEnd(out, 0, 0);
+        }
+        if (closed && !group->committedSize) {
+        } else if (!out || !closeOutputFile(out, path, temporaryPath)) {
+            if (!sink->exitCode) {
+                fprintf(stderr, "Cannot write %s: %s\n", path ? path : group->name, strerror(errno));
+                sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+            }
+        }
+        free(group->buffer);
+        free(group->name);
+        free(group);
+    }
+    free(path);
+    free(sink->groups);
+}
+
+// CSV per RFC 4180, and TSV the same way with tabs. A field is quoted only if it contains the delimiter, a
+// quote, or a line break, which is rare enough for cookies that it's worth scanning for them the same way
+// as the JSON escaper does, and writing clean fields straight through.
+// Absent strings are empty fields
+void emitCsvField(FILE * out, const char * value, char delimiter) {
+    if (!value) {
+        return;
+    }
+    const size_t runLength = kernels->csvCleanRunLength(value, delimiter);
+    if (!value[runLength]) {
+        fwrite(value, 1, runLength, out);
+        return;
+    }
+    // Quotes are escaped by doubling them
+    putc('"', out);
+    for (const char * quote; (quote = strchr(value, '"')); value = quote + 1) {
+        fwrite(value, 1, quote + 1 - value, out);
+        putc('"', out);
+    }
+    fputs(value, out);
+    putc('"', out);
+}
+
+// The columns are fixed, so rows from every file line up under the one header
+const char * const CSV_COLUMNS[] = {
+    "version", "flags", "domain", "name", "path", "value", "comment", "commentUrl", "expiry", "creation",
+};
+
+void emitCsvHeader(FILE * out, char delimiter, int locators) {
+    for (int i = 0; i < sizeof(CSV_COLUMNS) / sizeof(CSV_COLUMNS[0]); ++i) {
+        if (i) {
+            putc(delimiter, out);
+        }
+        fputs(CSV_COLUMNS[i], out);
+    }
+    if (locators) {
+        putc(delimiter, out);
+        fputs("locator", out);
+    }
+    // RFC 4180 lines end with CRLF, but nobody reading this wants that
+    putc('\n', out);
+}
+
+void emitCsvCookie(FILE * out, const struct SafariCookie * cookie, const struct CookieLocator * locator,
+    char delimiter) {
+    fprintf(out, "%u%c%u%c", cookie->version, delimiter, cookie->flags, delimiter);
+    const char * const strings[] = {
+        cookie->domain, cookie->name, cookie->path, cookie->value, cookie->comment, cookie->commentUrl,
+    };
+    for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        emitCsvField(out, strings[i], delimiter);
+        putc(delimiter, out);
+    }
+    fprintf(out, "%.17lg%c%.17lg", cookie->expiry, delimiter, cookie->creation);
+    if (locator) {
+        char buffer[MAX_LOCATOR_SIZE];
+        formatLocator(buffer, locator);
+        putc(delimiter, out);
+        fputs(buffer, out);
+    }
+    putc('\n', out);
+}
+
+void csvSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    if (!sink->fileCount++) {
+        emitCsvHeader(sink->out, ',', sink->locators);
+    }
+}
+
+void csvSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    emitCsvCookie(sink->out, cookie, sink->locators ? locator : 0, ',');
+}
+
+void tsvSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    if (!sink->fileCount++) {
+        emitCsvHeader(sink->out, '\t', sink->locators);
+    }
+}
+
+void tsvSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    emitCsvCookie(sink->out, cookie, sink->locators ? locator : 0, '\t');
+}
+
+// Absent and empty strings are the same, for diffing
+int cookieStringsEqual(const char * left, const char * right) {
+    return !strcmp(left ? left : "", right ? right : "");
+}
+
+int cookieKeysEqual(const struct SafariCookie * left, const struct SafariCookie * right) {
+    return cookieStringsEqual(left->domain, right->domain) && cookieStringsEqual(left->name, right->name)
+        && cookieStringsEqual(left->path, right->path);
+}
+
+// Times are compared bit for bit, so a NaN read back unchanged is still unchanged
+int cookiesEqual(const struct SafariCookie * left, const struct SafariCookie * right) {
+    return cookieKeysEqual(left, right) && left->version == right->version && left->flags == right->flags
+        && cookieStringsEqual(left->value, right->value) && cookieStringsEqual(left->comment, right->comment)
+        && cookieStringsEqual(left->commentUrl, right->commentUrl)
+        && !memcmp(&left->expiry, &right->expiry, sizeof(left->expiry))
+        && !memcmp(&left->creation, &right->creation, sizeof(left->creation));
+}
+
+uint32_t hashCookieKey(const struct SafariCookie * cookie) {
+    const char * const parts[] = { cookie->domain, cookie->name, cookie->path };
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+        for (const char * cursor = parts[i] ? parts[i] : ""; *cursor; ++cursor) {
+            hash = (hash ^ (uint8_t)*cursor) * 16777619u;
+        }
+        // Keep the parts apart, so a/bc and ab/c differ
+        hash = (hash ^ 0xFF) * 16777619u;
+    }
+    return hash;
+}
+
+// The base outlives the mapping it was read from, so the strings are copied. Returns zero if we're
+// out of memory.
+int insertDiffEntry(struct DiffBase * base, const struct SafariCookie * cookie) {
+    if (base->count == base->capacity) {
+        const uint64_t capacity = base->capacity ? 2 * base->capacity : 1024;
+        struct DiffEntry * entries = realloc(base->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return 0;
+        }
+        base->entries = entries;
+        base->capacity = capacity;
+    }
+    if (2 * (base->count + 1) > base->indexCapacity) {
+        const uint64_t capacity = base->indexCapacity ? 2 * base->indexCapacity : 2048;
+        uint64_t * index = calloc(capacity, sizeof(*index));
+        if (!index) {
+            return 0;
+        }
+        for (uint64_t entryIdx = 0; entryIdx < base->count; ++entryIdx) {
+            uint64_t slot = hashCookieKey(&base->entries[entryIdx].cookie) & (capacity - 1);
+            while (index[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            index[slot] = entryIdx + 1;
+        }
+        free(base->index);
+        base->index = index;
+        base->indexCapacity = capacity;
+    }
+    struct DiffEntry * entry = &base->entries[base->count];
+    entry->cookie = *cookie;
+    entry->seen = 0;
+    const char ** strings[] = {
+        &entry->cookie.domain, &entry->cookie.name, &entry->cookie.path, &entry->cookie.value,
+        &entry->cookie.comment, &entry->cookie.commentUrl,
+    };
+    for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        if (*strings[i] && !(*strings[i] = strdup(*strings[i]))) {
+            while (i--) {
+                free((char *)*strings[i]);
+            }
+            return 0;
+        }
+    }
+    uint64_t slot = hashCookieKey(cookie) & (base->indexCapacity - 1);
+    while (base->index[slot]) {
+        slot = (slot + 1) & (base->indexCapacity - 1);
+    }
+    base->index[slot] = ++base->count;
+    return 1;
+}
+
+// The first entry with the cookie's key not yet matched in this file, if any
+struct DiffEntry * findDiffEntry(struct DiffBase * base, const struct SafariCookie * cookie) {
+    if (!base->indexCapacity) {
+        return 0;
+    }
+    for (uint64_t slot = hashCookieKey(cookie) & (base->indexCapacity - 1); base->index[slot];
+        slot = (slot + 1) & (base->indexCapacity - 1)) {
+        struct DiffEntry * entry = &base->entries[base->index[slot] - 1];
+        if (!entry->seen && cookieKeysEqual(&entry->cookie, cookie)) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+void freeDiffBase(struct DiffBase * base) {
+    for (uint64_t entryIdx = 0; entryIdx < base->count; ++entryIdx) {
+        const struct SafariCookie * cookie = &base->entries[entryIdx].cookie;
+        free((char *)cookie->domain);
+        free((char *)cookie->name);
+        free((char *)cookie->path);
+        free((char *)cookie->value);
+        free((char *)cookie->comment);
+        free((char *)cookie->commentUrl);
+    }
+    free(base->entries);
+    free(base->index);
+}
+
+void collectSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie,
+    const struct CookieLocator * locator) {
+    if (!insertDiffEntry(sink->diffBase, cookie) && !sink->exitCode) {
+        perror("Cannot collect cookies to diff against");
+        sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+    }
+}
+
+// One ndjson line per difference, with the old record for a change. Unchanged cookies aren't written.
+// --watch names the file, since one subscriber may see changes to several.
+void emitJsonDiff(FILE * out, const char * filename, const char * op, const struct SafariCookie * old,
+    const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    emitJsonBeginObject(out);
+    if (filename) {
+        emitJsonString(out, "file");
+        emitJsonNameSeparator(out);
+        emitJsonString(out, filename);
+        emitJsonValueSeparator(out);
+    }
+    emitJsonString(out, "op");
+    emitJsonNameSeparator(out);
+    emitJsonString(out, op);
+    if (old) {
+        emitJsonValueSeparator(out);
+        emitJsonString(out, "old");
+        emitJsonNameSeparator(out);
+        emitJsonCookie(out, old, 0);
+    }
+    emitJsonValueSeparator(out);
+    emitJsonString(out, "cookie");
+    emitJsonNameSeparator(out);
+    emitJsonCookie(out, cookie, locator);
+    emitJsonEndObject(out);
+    putc('\n', out);
+}
+
+void diffSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    struct DiffEntry * entry = findDiffEntry(sink->diffBase, cookie);
+    if (!entry) {
+        emitJsonDiff(sink->out, 0, "added", 0, cookie, sink->locators ? locator : 0);
+    } else {
+        entry->seen = 1;
+        if (!cookiesEqual(&entry->cookie, cookie)) {
+            emitJsonDiff(sink->out, 0, "changed", &entry->cookie, cookie, sink->locators ? locator : 0);
+        }
+    }
+}
+
+// Anything in the base not seen in a good file was removed. Every file is diffed against the same base.
+void diffSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    for (uint64_t entryIdx = 0; entryIdx < sink->diffBase->count; ++entryIdx) {
+        struct DiffEntry * entry = &sink->diffBase->entries[entryIdx];
+        if (!exitCode && !entry->seen) {
+            emitJsonDiff(sink->out, 0, "removed", 0, &entry->cookie, 0);
+        }
+        entry->seen = 0;
+    }
+    ndjsonSinkEndFile(sink, filename, exitCode);
+}
+
+void noSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+}
+
+void noSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+}
+
+void noSinkPage(struct CookieSink * sink, uint32_t pageIdx) {
+}
+
+void noSinkClose(struct CookieSink * sink) {
+}
+
+void pluginSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    if (sink->plugin.beginFile) {
+        sink->plugin.beginFile(sink->plugin.context, filename);
+    }
+}
+
+void pluginSinkBeginPage(struct CookieSink * sink, uint32_t pageIdx) {
+    sink->batchCount = 0;
+    if (sink->plugin.beginPage) {
+        sink->plugin.beginPage(sink->plugin.context, pageIdx);
+    }
+}
+
+// The views point into the mapping, so collecting a page of them is cheap, and one call per page
+// is much cheaper than one per cookie.
+void pluginSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    if (sink->batchCount == sink->batchCapacity) {
+        const uint32_t capacity = sink->batchCapacity ? 2 * sink->batchCapacity : 64;
+        struct SafariCookie * batch = realloc(sink->batch, capacity * sizeof(*batch));
+        if (!batch) {
+            // Deliver what we have rather than drop it
+            if (sink->batchCount) {
+                sink->plugin.cookies(sink->plugin.context, sink->batch, sink->batchCount);
+                sink->batchCount = 0;
+            }
+            sink->plugin.cookies(sink->plugin.context, cookie, 1);
+            return;
+        } else {
+            sink->batch = batch;
+            sink->batchCapacity = capacity;
+        }
+    }
+    sink->batch[sink->batchCount++] = *cookie;
+}
+
+void pluginSinkEndPage(struct CookieSink * sink, uint32_t pageIdx) {
+    if (sink->batchCount) {
+        sink->plugin.cookies(sink->plugin.context, sink->batch, sink->batchCount);
+        sink->batchCount = 0;
+    }
+    if (sink->plugin.endPage) {
+        sink->plugin.endPage(sink->plugin.context, pageIdx);
+    }
+}
+
+void pluginSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+    if (sink->plugin.plist) {
+        sink->plugin.plist(sink->plugin.context, data, length);
+    }
+}
+
+// Plugins and rings only hear about the end of a good file, as before, so a bad one just never ends
+void pluginSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    if (!exitCode && sink->plugin.endFile) {
+        sink->plugin.endFile(sink->plugin.context, filename);
+    }
+}
+
+void pluginSinkClose(struct CookieSink * sink) {
+    if (sink->plugin.close) {
+        sink->plugin.close(sink->plugin.context);
+    }
+    free(sink->batch);
+    // Plugins linked in, like the SQLite extension's, have no library
+    if (sink->library) {
+        dlclose(sink->library);
+    }
+}
+
+void ringSinkPublish(struct CookieSink * sink) {
+    atomic_store(&sink->ring->head, sink->ringHead);
+    if (atomic_load(&sink->ring->consumerWaiting)) {
+        safariCookieRingWake(&sink->ring->headSignal);
+    }
+}
+
+// This is the backpressure - we don't drop records when the consumer is behind. But a consumer which has
+// closed the ring, or whose heartbeat has stopped, isn't coming back, so then the sink fails and returns zero.
+int ringSinkWaitForSpace(struct CookieSink * sink, uint64_t needed) {
+    struct SafariCookieRing * ring = sink->ring;
+    uint32_t heartbeat = 0;
+    uint64_t heard = 0;
+    while (ring->capacity < sink->ringHead + needed - atomic_load(&ring->tail)) {
+        const uint32_t beat = atomic_load(&ring->consumerHeartbeat);
+        const uint64_t now = monotonicNanoseconds();
+        if (!heard || beat != heartbeat) {
+            heartbeat = beat;
+            heard = now;
+        }
+        const int closed = atomic_load(&ring->consumerClosed);
+        if (closed || SAFARI_COOKIE_RING_CONSUMER_TIMEOUT_SECONDS * 1000000000ULL <= now - heard) {
+            fprintf(stderr, closed ? "Ring consumer closed the ring, giving up on it\n"
+                : "Ring consumer stopped reading, giving up on it\n");
+            sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+            return 0;
+        }
+        ringSinkPublish(sink);
+        const uint32_t seen = atomic_load(&ring->tailSignal);
+        atomic_store(&ring->producerWaiting, 1);
+        if (ring->capacity < sink->ringHead + needed - atomic_load(&ring->tail)) {
+            safariCookieRingWait(&ring->tailSignal, seen);
+        }
+        atomic_store(&ring->producerWaiting, 0);
+    }
+    return 1;
+}
+
+// Returns where to write the payload, or null if the frame could never fit or the sink has failed
+unsigned char * ringSinkReserve(struct CookieSink * sink, uint32_t type, uint32_t size) {
+    struct SafariCookieRing * ring = sink->ring;
+    const uint64_t span = safariCookieRingAlign(SAFARI_COOKIE_RING_FRAME_HEADER_SIZE + (uint64_t)size);
+    if (sink->exitCode || ring->capacity < span) {
+        return 0;
+    }
+    const uint64_t remaining = ring->capacity - (sink->ringHead & (ring->capacity - 1));
+    const uint64_t padding = remaining < span ? remaining : 0;
+    if (!ringSinkWaitForSpace(sink, padding + span)) {
+        return 0;
+    }
+    if (padding) {
+        const uint32_t header[2] = { SAFARI_COOKIE_RING_FRAME_PADDING, 0 };
+        memcpy(ring->data + (sink->ringHead & (ring->capacity - 1)), header, sizeof(header));
+        sink->ringHead += padding;
+    }
+    unsigned char * base = ring->data + (sink->ringHead & (ring->capacity - 1));
+    const uint32_t header[2] = { type, size };
+    memcpy(base, header, sizeof(header));
+    sink->ringHead += span;
+    return base + SAFARI_COOKIE_RING_FRAME_HEADER_SIZE;
+}
+
+void ringSinkFilename(struct CookieSink * sink, uint32_t type, const char * filename) {
+    const uint32_t size = strlen(filename) + 1;
+    unsigned char * payload = ringSinkReserve(sink, type, size);
+    if (payload) {
+        memcpy(payload, filename, size);
+    } else if (!sink->exitCode) {
+        fprintf(stderr, "Filename too large for ring, dropped\n");
+    }
+}
+
+void ringSinkBeginFile(struct CookieSink * sink, const char * filename, off_t length) {
+    ringSinkFilename(sink, SAFARI_COOKIE_RING_FRAME_BEGIN_FILE, filename);
+}
+
+void ringSinkCookie(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    const char * strings[] = {
+        cookie->domain, cookie->name, cookie->path, cookie->value, cookie->comment, cookie->commentUrl,
+    };
+    uint32_t sizes[sizeof(strings) / sizeof(strings[0])];
+    uint64_t size = SAFARI_COOKIE_RING_COOKIE_FIXED_SIZE + sizeof(sizes);
+    for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        sizes[i] = strings[i] ? strlen(strings[i]) + 1 : 0;
+        size += sizes[i];
+    }
+    unsigned char * cursor = size <= UINT32_MAX ? ringSinkReserve(sink, SAFARI_COOKIE_RING_FRAME_COOKIE, size) : 0;
+    if (!cursor) {
+        if (!sink->exitCode) {
+            fprintf(stderr, "Cookie too large for ring, dropped\n");
+        }
+        return;
+    }
+    memcpy(cursor, &cookie->version, sizeof(uint32_t));
+    memcpy(cursor + sizeof(uint32_t), &cookie->flags, sizeof(uint32_t));
+    memcpy(cursor + 2 * sizeof(uint32_t), &cookie->expiry, sizeof(double));
+    memcpy(cursor + 2 * sizeof(uint32_t) + sizeof(double), &cookie->creation, sizeof(double));
+    cursor += SAFARI_COOKIE_RING_COOKIE_FIXED_SIZE;
+    for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+        memcpy(cursor, &sizes[i], sizeof(uint32_t));
+        cursor += sizeof(uint32_t);
+        memcpy(cursor, strings[i], sizes[i]);
+        cursor += sizes[i];
+    }
+}
+
+// Publishing per page rather than per cookie keeps the consumer wakeups down
+void ringSinkEndPage(struct CookieSink * sink, uint32_t pageIdx) {
+    ringSinkPublish(sink);
+}
+
+// Sent raw, the consumer can decode what it wants of it
+void ringSinkPlist(struct CookieSink * sink, const char * data, uint32_t length, const char * json,
+    size_t jsonSize) {
+    unsigned char * payload = ringSinkReserve(sink, SAFARI_COOKIE_RING_FRAME_PLIST, length);
+    if (payload) {
+        memcpy(payload, data, length);
+    } else if (!sink->exitCode) {
+        fprintf(stderr, "Plist too large for ring, dropped\n");
+    }
+}
+
+void ringSinkEndFile(struct CookieSink * sink, const char * filename, int exitCode) {
+    if (!exitCode) {
+        ringSinkFilename(sink, SAFARI_COOKIE_RING_FRAME_END_FILE, filename);
+    }
+    ringSinkPublish(sink);
+}
+
+void ringSinkClose(struct CookieSink * sink) {
+    ringSinkPublish(sink);
+    atomic_store(&sink->ring->closed, 1);
+    safariCookieRingWake(&sink->ring->headSignal);
+    munmap(sink->ring, sizeof(struct SafariCookieRing) + sink->ring->capacity);
+}
+
+void pluginSinkIgnoreCookies(void * context, const struct SafariCookie * cookies, uint32_t cookieCount) {
+}
+
+struct CookieSinkFormat {
+    const char * name;
+    // Whether FILE may be a directory, to be filled with several files
+    int directories;
+    void (*beginFile)(struct CookieSink * sink, const char * filename, off_t length);
+    void (*beginPage)(struct CookieSink * sink, uint32_t pageIdx);
+    void (*cookie)(struct CookieSink * sink, const struct SafariCookie * cookie, const struct CookieLocator * locator);
+    void (*endPage)(struct CookieSink * sink, uint32_t pageIdx);
+    void (*plist)(struct CookieSink * sink, const char * data, uint32_t length, const char * json, size_t jsonSize);
+    void (*endFile)(struct CookieSink * sink, const char * filename, int exitCode);
+    void (*close)(struct CookieSink * sink);
+};
+
+const struct CookieSinkFormat COOKIE_SINK_FORMATS[] = {
+    { "json", 0, jsonSinkBeginFile, noSinkPage, jsonSinkCookie, noSinkPage, jsonSinkPlist, jsonSinkEndFile, noSinkClose },
+    { "ndjson", 0, ndjsonSinkBeginFile, noSinkPage, ndjsonSinkCookie, noSinkPage, ndjsonSinkPlist, ndjsonSinkEndFile,
+        noSinkClose },
+    { "stats", 0, statsSinkBeginFile, statsSinkBeginPage, statsSinkCookie, noSinkPage, statsSinkPlist, statsSinkEndFile,
+        statsSinkClose },
+    { "storagestate", 1, storageStateSinkBeginFile, noSinkPage, storageStateSinkCookie, noSinkPage,
+        storageStateSinkPlist, storageStateSinkEndFile, storageStateSinkClose },
+    { "csv", 0, csvSinkBeginFile, noSinkPage, csvSinkCookie, noSinkPage, noSinkPlist, noSinkEndFile, noSinkClose },
+    { "tsv", 0, tsvSinkBeginFile, noSinkPage, tsvSinkCookie, noSinkPage, noSinkPlist, noSinkEndFile, noSinkClose },
+    { "diff", 0, ndjsonSinkBeginFile, noSinkPage, diffSinkCookie, noSinkPage, noSinkPlist, diffSinkEndFile,
+        noSinkClose },
+};
+
+// Parse FORMAT[=FILE], where a missing FILE or "-" means stdout. Formats which can write a directory do so
+// when FILE is an existing directory or ends with a slash.
+int openSink(struct CookieSink * sink, const char * spec) {
+    const char * equals = strchr(spec, '=');
+    const size_t nameLength = equals ? equals - spec : strlen(spec);
+    const struct CookieSinkFormat * format = 0;
+    for (int i = 0; i < sizeof(COOKIE_SINK_FORMATS) / sizeof(COOKIE_SINK_FORMATS[0]); ++i) {
+        if (strlen(COOKIE_SINK_FORMATS[i].name) == nameLength
+            && !memcmp(COOKIE_SINK_FORMATS[i].name, spec, nameLength)) {
+            format = &COOKIE_SINK_FORMATS[i];
+        }
+    }
+    if (!format) {
+        fprintf(stderr, "Unknown output format in %s\n", spec);
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+
+    memset(sink, 0, sizeof(*sink));
+    sink->beginFile = format->beginFile;
+    sink->beginPage = format->beginPage;
+    sink->cookie = format->cookie;
+    sink->endPage = format->endPage;
+    sink->plist = format->plist;
+    sink->endFile = format->endFile;
+    sink->close = format->close;
+    struct stat statResult;
+    if (!equals || !strcmp(equals + 1, "-")) {
+        sink->filename = 0;
+        sink->out = stdout;
+    } else if (format->directories && ('/' == equals[strlen(equals) - 1]
+        || (!stat(equals + 1, &statResult) && S_ISDIR(statResult.st_mode)))) {
+        sink->directory = equals + 1;
+        if (mkdir(sink->directory, 0777) && EEXIST != errno) {
+            perror("Cannot create output directory");
+            return EXIT_CODE_BAD_OUTPUT;
+        }
+    } else {
+        // Opened by startSink, once we know the output mode
+        sink->filename = equals + 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &sink->started);
+    return EXIT_CODE_OK;
+}
+
+int startSink(struct CookieSink * sink, enum OutputMode outputMode) {
+    sink->outputMode = outputMode;
+    if (sink->filename) {
+        sink->out = openOutputFile(sink->filename, outputMode, &sink->temporaryFilename);
+        if (!sink->out) {
+            perror("Cannot open output file");
+            return EXIT_CODE_BAD_OUTPUT;
+        }
+    }
+    return EXIT_CODE_OK;
+}
+
+// Parse PATH[=ARGUMENT] and load the plugin. Plugins don't get a stream, they do their own output.
+int openPluginSink(struct CookieSink * sink, const char * spec) {
+    const char * equals = strchr(spec, '=');
+    char * path = strndup(spec, equals ? equals - spec : strlen(spec));
+    if (!path) {
+        perror("Cannot load plugin");
+        return EXIT_CODE_BAD_PLUGIN;
+    }
+
+    memset(sink, 0, sizeof(*sink));
+    sink->beginFile = pluginSinkBeginFile;
+    sink->beginPage = pluginSinkBeginPage;
+    sink->cookie = pluginSinkCookie;
+    sink->endPage = pluginSinkEndPage;
+    sink->plist = pluginSinkPlist;
+    sink->endFile = pluginSinkEndFile;
+    sink->close = pluginSinkClose;
+    sink->library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    free(path);
+    if (!sink->library) {
+        fprintf(stderr, "Cannot load plugin: %s\n", dlerror());
+        return EXIT_CODE_BAD_PLUGIN;
+    }
+    const SafariCookiePluginInit init = (SafariCookiePluginInit)dlsym(sink->library, SAFARI_COOKIE_PLUGIN_INIT_SYMBOL);
+    if (!init) {
+        fprintf(stderr, "Plugin %s has no %s\n", spec, SAFARI_COOKIE_PLUGIN_INIT_SYMBOL);
+        dlclose(sink->library);
+        return EXIT_CODE_BAD_PLUGIN;
+    }
+    sink->plugin.abiVersion = SAFARI_COOKIE_PLUGIN_ABI_VERSION;
+    if (init(&sink->plugin, equals ? equals + 1 : 0)) {
+        fprintf(stderr, "Plugin %s failed to initialise\n", spec);
+        dlclose(sink->library);
+        return EXIT_CODE_BAD_PLUGIN;
+    }
+    if (!sink->plugin.cookies) {
+        sink->plugin.cookies = pluginSinkIgnoreCookies;
+    }
+    return EXIT_CODE_OK;
+}
+
+// Not an output, this reads the base for --diff into memory
+void openCollectSink(struct CookieSink * sink, struct DiffBase * base) {
+    memset(sink, 0, sizeof(*sink));
+    sink->beginFile = ndjsonSinkBeginFile;
+    sink->beginPage = noSinkPage;
+    sink->cookie = collectSinkCookie;
+    sink->endPage = noSinkPage;
+    sink->plist = noSinkPlist;
+    sink->endFile = noSinkEndFile;
+    sink->close = noSinkClose;
+    sink->diffBase = base;
+}
+
+// Parse NAME[=BYTES] and create the shared memory ring, replacing any stale one of the same name.
+// The consumer unlinks it once it has read everything.
+int openRingSink(struct CookieSink * sink, const char * spec) {
+    const char * equals = strchr(spec, '=');
+    uint64_t capacity = MIN_RING_SIZE;
+    const unsigned long long requested = equals ? strtoull(equals + 1, 0, 0) : DEFAULT_RING_SIZE;
+    while (capacity < requested) {
+        capacity <<= 1;
+    }
+    char * name = strndup(spec, equals ? equals - spec : strlen(spec));
+    if (!name) {
+        perror("Cannot create ring");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    shm_unlink(name);
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    free(name);
+    if (-1 == fd) {
+        perror("Cannot create ring");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    const off_t length = sizeof(struct SafariCookieRing) + capacity;
+    void * data = ftruncate(fd, length) ? MAP_FAILED : mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data) {
+        perror("Cannot map ring");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+
+    memset(sink, 0, sizeof(*sink));
+    sink->beginFile = ringSinkBeginFile;
+    sink->beginPage = noSinkPage;
+    sink->cookie = ringSinkCookie;
+    sink->endPage = ringSinkEndPage;
+    sink->plist = ringSinkPlist;
+    sink->endFile = ringSinkEndFile;
+    sink->close = ringSinkClose;
+    sink->ring = data;
+    sink->ring->version = SAFARI_COOKIE_RING_VERSION;
+    sink->ring->capacity = capacity;
+    // The consumer checks the magic, so it goes last
+    atomic_thread_fence(memory_order_release);
+    sink->ring->magic = SAFARI_COOKIE_RING_MAGIC;
+    return EXIT_CODE_OK;
+}
+
+int closeSink(struct CookieSink * sink) {
+    sink->close(sink);
+    if (sink->exitCode) {
+        if (sink->out && sink->filename) {
+            // Don't leave a temporary behind, or replace a good output with a bad one
+            if (sink->temporaryFilename) {
+                unlink(sink->temporaryFilename);
+                free(sink->temporaryFilename);
+            }
+            fclose(sink->out);
+        }
+        return sink->exitCode;
+    } else if (!sink->out) {
+        return EXIT_CODE_OK;
+    } else if (sink->filename ? !closeOutputFile(sink->out, sink->filename, sink->temporaryFilename)
+        : fflush(sink->out)) {
+        perror("Cannot write output");
+        return EXIT_CODE_BAD_OUTPUT;
+    } else {
+        return EXIT_CODE_OK;
+    }
+}
+
+// Only cookies matching every part of the filter reach the sinks. Matching only needs the pointers the walk
+// has already decoded, so it's checked before any formatting.
+struct CookieFilter {
+    // The domain or a subdomain of it, with any leading dot ignored on either side
+    const char * domain;
+    const char * name;
+    // Inclusive bounds on the expiry, in seconds since 2001, each only if set
+    int hasMinExpiry;
+    double minExpiry;
+    int hasMaxExpiry;
+    double maxExpiry;
+    // Set by --unexpired. Session cookies have an expiry of 0, and haven't expired, whatever minExpiry says.
+    int keepsSessions;
+};
+
+int cookieDomainMatches(const char * domain, const char * filter) {
+    domain = domain ? domain : "";
+    domain += '.' == *domain;
+    filter += '.' == *filter;
+    const size_t domainLength = strlen(domain);
+    const size_t filterLength = strlen(filter);
+    if (domainLength < filterLength || strcasecmp(domain + domainLength - filterLength, filter)) {
+        return 0;
+    }
+    return domainLength == filterLength || '.' == domain[domainLength - filterLength - 1];
+}
+
+int cookieMatchesFilter(const struct CookieFilter * filter, const struct SafariCookie * cookie) {
+    return (!filter->domain || cookieDomainMatches(cookie->domain, filter->domain))
+        && (!filter->name || (cookie->name && !strcmp(cookie->name, filter->name)))
+        && (!filter->hasMinExpiry || cookie->expiry >= filter->minExpiry
+            || (filter->keepsSessions && 0 == cookie->expiry))
+        && (!filter->hasMaxExpiry || cookie->expiry <= filter->maxExpiry);
+}
+
+int cookieFilterIsSet(const struct CookieFilter * filter) {
+    return filter->domain || filter->name || filter->hasMinExpiry || filter->hasMaxExpiry;
+}
+
+// --metrics, in the Prometheus text format, either rewritten to a file as the run goes, or served to whoever
+// connects to a Unix socket. The counters are plain per thread ones, only added up when the text is written.
+struct Metrics {
+    // Exactly one of these
+    const char * filename;
+    const char * socketPath;
+    int listenFd;
+    pthread_t server;
+    _Atomic int stopping;
+    // When the file was last written
+    uint64_t written;
+    const struct Run * run;
+    // Held while the pipeline publishes or retires its readers, and while they're being added up
+    pthread_mutex_t lock;
+    const struct MappedFileQueue * queue;
+    const struct PipelineReader * readers;
+    uint32_t readerCount;
+};
+
+// Everything configured for this run of the tool
+struct Run {
+    struct CookieSink sinks[MAX_SINK_COUNT];
+    int sinkCount;
+    // Zero to map and walk the whole file in one go
+    off_t windowSize;
+    // Decode the trailing plist and pass it to the sinks
+    int plist;
+    enum OutputMode outputMode;
+    // Between runBeginFile and runEndFile
+    int fileBegun;
+    // Zero to take every cookie, otherwise how many to sample from each file, and from each domain in it
+    uint64_t sampleSize;
+    uint64_t samplePerDomain;
+    struct CookieFilter filter;
+    struct PipelineReport pipeline;
+    // Null unless reads or CPU are limited
+    struct Throttle * throttle;
+    struct Latency latency;
+    // When the current phase of the current file started, and the time in its phases so far
+    uint64_t phaseStarted;
+    uint64_t fileNanoseconds;
+    // Only written by the main thread, but read by metrics scrapes
+    _Atomic uint64_t fileCount;
+    _Atomic uint64_t failedFileCount;
+    _Atomic uint64_t bytesRead;
+    _Atomic uint64_t cookieCount;
+    // Only for --watch
+    _Atomic uint64_t watchedFileCount;
+    _Atomic uint64_t rewriteCount;
+    _Atomic uint64_t reusedPageCount;
+    _Atomic uint64_t decodedPageCount;
+    _Atomic uint64_t subscriberCount;
+    _Atomic uint64_t eventCount;
+    // Null unless --metrics
+    struct Metrics * metrics;
+};
+
+// Records the time since the phase started, and starts the next
+void recordPhase(struct Run * run, enum LatencyPhase phase) {
+    const uint64_t now = monotonicNanoseconds();
+    recordLatency(&run->latency.phases[phase], now - run->phaseStarted);
+    run->fileNanoseconds += now - run->phaseStarted;
+    run->phaseStarted = now;
+}
+
+// With --atomic, sinks with a stream write this file into memory instead, until we know it's good. Sinks
+// count files to know when to write headers and separators, so that's put back if the file is dropped.
+void beginAtomicFile(struct CookieSink * sink) {
+    sink->atomicFileCount = sink->fileCount;
+    FILE * buffer = open_memstream(&sink->atomicBuffer, &sink->atomicSize);
+    if (buffer) {
+        sink->committedOut = sink->out;
+        sink->out = buffer;
+    } else if (!sink->exitCode) {
+        perror("Cannot buffer output");
+        sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+    }
+}
+
+void endAtomicFile(struct CookieSink * sink, int exitCode) {
+    if (!sink->committedOut) {
+        return;
+    }
+    if (fclose(sink->out) && !sink->exitCode) {
+        perror("Cannot buffer output");
+        sink->exitCode = EXIT_CODE_BAD_OUTPUT;
+    }
+    sink->out = sink->committedOut;
+    sink->committedOut = 0;
+    if (exitCode) {
+        sink->fileCount = sink->atomicFileCount;
+    } else {
+        fwrite(sink->atomicBuffer, 1, sink->atomicSize, sink->out);
+    }
+    free(sink->atomicBuffer);
+    sink->atomicBuffer = 0;
+}
+
+void runBeginFile(struct Run * run, const char * filename, off_t length) {
+    run->fileBegun = 1;
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        if (OUTPUT_MODE_ATOMIC == run->outputMode && run->sinks[sinkIdx].out) {
+            beginAtomicFile(&run->sinks[sinkIdx]);
+        }
+        run->sinks[sinkIdx].beginFile(&run->sinks[sinkIdx], filename, length);
+    }
+}
+
+void runBeginPage(struct Run * run, uint32_t pageIdx) {
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        run->sinks[sinkIdx].beginPage(&run->sinks[sinkIdx], pageIdx);
+    }
+}
+
+void runCookie(struct Run * run, const struct SafariCookie * cookie, const struct CookieLocator * locator) {
+    if (!cookieMatchesFilter(&run->filter, cookie)) {
+        return;
+    }
+    addRelaxed(&run->cookieCount, 1);
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        run->sinks[sinkIdx].cookie(&run->sinks[sinkIdx], cookie, locator);
+    }
+}
+
+void runEndPage(struct Run * run, uint32_t pageIdx) {
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        run->sinks[sinkIdx].endPage(&run->sinks[sinkIdx], pageIdx);
+    }
+}
+
+void runPlist(struct Run * run, const char * data, uint32_t length, const char * json, size_t jsonSize) {
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        run->sinks[sinkIdx].plist(&run->sinks[sinkIdx], data, length, json, jsonSize);
+    }
+}
+
+void runEndFile(struct Run * run, const char * filename, int exitCode) {
+    run->fileBegun = 0;
+    for (int sinkIdx = 0; sinkIdx < run->sinkCount; ++sinkIdx) {
+        run->sinks[sinkIdx].endFile(&run->sinks[sinkIdx], filename, exitCode);
+        endAtomicFile(&run->sinks[sinkIdx], exitCode);
+    }
+}
+
+// Every file passes through here once its exit code is known, whether or not it got as far as beginning.
+// With --stream, a file which couldn't even be opened still gets its status record.
+int runFinishFile(struct Run * run, const char * filename, int exitCode) {
+    run->phaseStarted = monotonicNanoseconds();
+    if (!run->fileBegun && OUTPUT_MODE_STREAM == run->outputMode) {
+        runBeginFile(run, filename, 0);
+    }
+    if (run->fileBegun) {
+        runEndFile(run, filename, exitCode);
+    }
+    recordPhase(run, LATENCY_PHASE_FINISH);
+    recordLatency(&run->latency.phases[LATENCY_PHASE_FILE], run->fileNanoseconds);
+    run->fileNanoseconds = 0;
+    addRelaxed(&run->fileCount, 1);
+    addRelaxed(&run->failedFileCount, !!exitCode);
+    return exitCode;
+}
+
+// Check the magic and the page size table, returning the page count and where the sizes and pages start
+int decodeFileHeader(off_t length, const char * data, uint32_t * pageCount, const char ** pageSizeBase,
+    const char ** pageBase) {
+    if (length < sizeof(BINARY_COOKIE_MAGIC) + sizeof(uint32_t)) {
+        fprintf(stderr, "File too short, when checking magic and page count\n");
+        return EXIT_CODE_BAD_EOF;
+    } else if (memcmp(data, BINARY_COOKIE_MAGIC, sizeof(BINARY_COOKIE_MAGIC))) {
+        fprintf(stderr, "Bad magic - is this a cookie file?\n");
+        return EXIT_CODE_BAD_MAGIC;
+    } else {
+        *pageSizeBase = data + sizeof(BINARY_COOKIE_MAGIC);
+        *pageCount = read32Hi(pageSizeBase);
+        *pageBase = *pageSizeBase + *pageCount * sizeof(uint32_t);
+        if (data + length < *pageBase) {
+            fprintf(stderr, "File too short, when checking page sizes in header\n");
+            return EXIT_CODE_BAD_EOF;
+        } else {
+            return EXIT_CODE_OK;
+        }
+    }
+}
+
+// The identity of a file, for locators, is its length and the checksum it records after the pages.
+// Finding that only needs the page size table, not a walk of the pages. Returns zero if the file
+// is too short to have a checksum.
+int readFileTag(off_t length, const char * data, uint32_t pageCount, const char * pageSizeBase,
+    const char * pageBase, struct CookieLocator * tag) {
+    uint64_t checkSumOffset = pageBase - data;
+    for (uint32_t pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        checkSumOffset += read32Hi(&pageSizeBase);
+    }
+    if (length < checkSumOffset + sizeof(uint32_t)) {
+        return 0;
+    } else {
+        const char * checkSumBase = data + checkSumOffset;
+        tag->fileCheckSum = read32Hi(&checkSumBase);
+        tag->fileLength = length;
+        return 1;
+    }
+}
+
+// Check the page tag, cookie count, and offsets, returning the count and where the offsets start
+int decodePageHeader(const char * pageBase, const char * pageEnd, int pageIdx, uint32_t * cookieCount,
+    const char ** cookieOffsetBase) {
+    if (pageEnd - pageBase < sizeof(COOKIE_PAGE_TAG) + sizeof(uint32_t)) {
+        fprintf(stderr, "Page %d too short for page tag and cookie count\n", pageIdx);
+        return EXIT_CODE_BAD_PARSE;
+    } else if (memcmp(pageBase, COOKIE_PAGE_TAG, sizeof(COOKIE_PAGE_TAG))) {
+        fprintf(stderr, "Bad page tag - is this a cookie file?\n");
+        return EXIT_CODE_BAD_MAGIC;
+    } else {
+        *cookieOffsetBase = pageBase + sizeof(COOKIE_PAGE_TAG);
+        *cookieCount = read32Lo(cookieOffsetBase);
+        const char * cookiePageHeaderEnd = *cookieOffsetBase + *cookieCount * sizeof(uint32_t);
+        if (pageEnd < cookiePageHeaderEnd + sizeof(COOKIE_PAGE_HEADER_END)) {
+            fprintf(stderr, "Page %d too short for cookie offsets\n", pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (memcmp(cookiePageHeaderEnd, COOKIE_PAGE_HEADER_END, sizeof(COOKIE_PAGE_HEADER_END))) {
+            fprintf(stderr, "Bad page header end - is this a cookie file?\n");
+            return EXIT_CODE_BAD_MAGIC;
+        } else {
+            return EXIT_CODE_OK;
+        }
+    }
+}
+
+int decodeCookie(off_t length, const char * data, const char * pageBase, const char * pageEnd,
+    uint32_t cookieOffset, int pageIdx, int cookieIdx, struct SafariCookie * cookie) {
+    const char * cookieBase = pageBase + cookieOffset;
+    const char * cookieCursor = cookieBase;
+    // Check enough space for the mandatory fields read below
+    if (data + length < cookieCursor + 10 * sizeof(uint32_t) + 2 * sizeof(uint64_t)) {
+        fprintf(stderr, "Cookie %d in Page %d too short for cookie header\n", cookieIdx, pageIdx);
+        return EXIT_CODE_BAD_PARSE;
+    } else {
+        // The size of the cookie record, which we use just for validation
+        const uint32_t cookieSize = read32Lo(&cookieCursor);
+        const uint32_t version = read32Lo(&cookieCursor);
+        const uint32_t flags = read32Lo(&cookieCursor);
+        read32Lo(&cookieCursor); // hasPort, extra field below ?
+        const uint32_t domain = read32Lo(&cookieCursor);
+        const uint32_t name = read32Lo(&cookieCursor);
+        const uint32_t path = read32Lo(&cookieCursor);
+        const uint32_t value = read32Lo(&cookieCursor);
+        const uint32_t comment = read32Lo(&cookieCursor);
+        const uint32_t commentUrl = read32Lo(&cookieCursor);
+        const double expiry = readDouble(&cookieCursor);
+        const double creation = readDouble(&cookieCursor);
+        // if hasPort, maybe there us a uint15_t port here ?
+        const char * cookieEnd = cookieBase + cookieSize;
+        if (pageEnd < cookieEnd) {
+            fprintf(stderr,
+                "Cookie %d in Page %d has end past end of page\n",
+                cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (0 != *(cookieEnd - 1)) {
+            fprintf(stderr,
+                "Cookie %d in Page %d does not end with null terminated string\n",
+                cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + domain) {
+            fprintf(stderr, "Cookie %d in Page %d domain out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + name) {
+            fprintf(stderr, "Cookie %d in Page %d name out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + path) {
+            fprintf(stderr, "Cookie %d in Page %d path out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + value) {
+            fprintf(stderr, "Cookie %d in Page %d value out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + comment) {
+            fprintf(stderr, "Cookie %d in Page %d comment out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else if (cookieEnd < cookieBase + commentUrl) {
+            fprintf(stderr, "Cookie %d in Page %d commentUrl out of range\n", cookieIdx, pageIdx);
+            return EXIT_CODE_BAD_PARSE;
+        } else {
+            cookie->version = version;
+            cookie->flags = flags;
+            cookie->domain = domain ? cookieBase + domain : 0;
+            cookie->name = name ? cookieBase + name : 0;
+            cookie->path = path ? cookieBase + path : 0;
+            cookie->value = value ? cookieBase + value : 0;
+            cookie->comment = comment ? cookieBase + comment : 0;
+            cookie->commentUrl = commentUrl ? cookieBase + commentUrl : 0;
+            cookie->expiry = expiry;
+            cookie->creation = creation;
+            return EXIT_CODE_OK;
+        }
+    }
+}
+
+// In windowed mode the file stays mapped, since that's just address space, but only a bounded window
+// of whole pages is resident at once. The window just walked is released, and the next one is
+// prefetched, so RSS stays around two windows however large the file is.
+struct Window {
+    uint32_t endPageIdx;
+    const char * base;
+    const char * end;
+};
+
+// The window starting at pageIdx, which is as many whole pages as fit in windowSize, but at least one
+void findWindow(const struct Run * run, const char * pageSizeCursor, uint32_t pageIdx, uint32_t pageCount,
+    const char * pageBase, struct Window * window) {
+    window->base = pageBase;
+    window->end = pageBase;
+    window->endPageIdx = pageIdx;
+    while (window->endPageIdx < pageCount) {
+        const uint32_t pageSize = read32Hi(&pageSizeCursor);
+        if (window->endPageIdx != pageIdx && run->windowSize < (window->end - window->base) + pageSize) {
+            break;
+        }
+        window->end += pageSize;
+        ++window->endPageIdx;
+    }
+}
+
+// Only a hint, so failures don't matter. Pages past the end of the file are reported by the walk.
+// Releasing stops short of a memory page shared with the next window, which is about to be used.
+void adviseWindow(off_t length, const char * data, const struct Window * window, int advice) {
+    const uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+    const char * end = window->end < data + length ? window->end : data + length;
+    if (MADV_DONTNEED == advice) {
+        end = (const char *)((uintptr_t)end & ~pageMask);
+    }
+    const char * base = (const char *)((uintptr_t)window->base & ~pageMask);
+    if (base < end) {
+        madvise((void *)base, end - base, advice);
+    }
+}
+
+// Check what follows the pages, which starts at pageBase, against the sum of the page checksums, and write
+// the plist if asked to
+int decodeFileTrailer(struct Run * run, off_t length, const char * data, const char * pageBase,
+    uint32_t checkSum) {
+    if (data + length < pageBase + sizeof(uint32_t) + sizeof(BINARY_COOKIE_FOOTER) + sizeof(uint32_t)) {
+        fprintf(stderr, "File too short, for checksum, footer, and plist size\n");
+        return EXIT_CODE_BAD_EOF;
+    } else {
+        uint32_t savedCheckSum = read32Hi(&pageBase);
+        if (savedCheckSum != checkSum) {
+            fprintf(stderr, "Bad file checksum\n");
+            return EXIT_CODE_BAD_PARSE;
+        } else
+        if (memcmp(pageBase, BINARY_COOKIE_FOOTER, sizeof(BINARY_COOKIE_FOOTER))) {
+            fprintf(stderr, "Bad file footer - is this a cookie file?\n");
+            return EXIT_CODE_BAD_MAGIC;
+        } else {
+            pageBase += sizeof(BINARY_COOKIE_FOOTER);
+            const uint32_t plistSize = read32Hi(&pageBase);
+            char * json = 0;
+            size_t jsonSize = 0;
+            if (data + length != pageBase + plistSize) {
+                fprintf(stderr, "File length and plist data length mismatch\n");
+                return EXIT_CODE_BAD_PARSE;
+            } else if (run->plist && !formatJsonPlist(pageBase, plistSize, &json, &jsonSize)) {
+                fprintf(stderr, "Bad binary plist after footer\n");
+                return EXIT_CODE_BAD_PLIST;
+            } else {
+                // It's not usually worth parsing the binary plist, so it's only done when asked for
+                if (run->plist) {
+                    runPlist(run, pageBase, plistSize, json, jsonSize);
+                    free(json);
+                }
+
+                return EXIT_CODE_OK;
+            }
+        }
+    }
+}
+
+int printCookiesFromMmap(struct Run * run, const char * filename, off_t length, const char * data) {
+    uint32_t pageCount;
+    const char * pageSizeBase;
+    const char * pageBase;
+    int exitCode = decodeFileHeader(length, data, &pageCount, &pageSizeBase, &pageBase);
+    if (exitCode) {
+        return exitCode;
+    }
+
+    // If there's no checksum, the walk below fails before any locator is used
+    struct CookieLocator locator = { 0 };
+    readFileTag(length, data, pageCount, pageSizeBase, pageBase, &locator);
+
+    struct Window window = { 0 };
+    struct Window nextWindow = { 0 };
+    if (run->windowSize) {
+        findWindow(run, pageSizeBase, 0, pageCount, pageBase, &nextWindow);
+        adviseWindow(length, data, &nextWindow, MADV_WILLNEED);
+    }
+
+    uint32_t checkSum = 0;
+    runBeginFile(run, filename, length);
+    for(int pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        if (run->windowSize && pageIdx == window.endPageIdx) {
+            // Move on to the window prefetched last time, and prefetch the one after
+            if (pageIdx) {
+                adviseWindow(length, data, &window, MADV_DONTNEED);
+            }
+            window = nextWindow;
+            findWindow(run, pageSizeBase + (window.endPageIdx - pageIdx) * sizeof(uint32_t), window.endPageIdx,
+                pageCount, window.end, &nextWindow);
+            // The first window was read with the file
+            if (pageIdx) {
+                throttleCpu(run->throttle);
+                throttleRead(run->throttle, nextWindow.end - nextWindow.base);
+            }
+            adviseWindow(length, data, &nextWindow, MADV_WILLNEED);
+        }
+        uint32_t pageSize = read32Hi(&pageSizeBase);
+        const char * pageEnd = pageBase + pageSize;
+        if (data + length < pageEnd) {
+            fprintf(stderr, "File too short, incomplete page %d\n", pageIdx);
+            return EXIT_CODE_BAD_EOF;
+        }
+        uint32_t cookieCount;
+        const char * cookieOffsetBase;
+        exitCode = decodePageHeader(pageBase, pageEnd, pageIdx, &cookieCount, &cookieOffsetBase);
+        if (exitCode) {
+            return exitCode;
+        }
+
+        // Process page
+        runBeginPage(run, pageIdx);
+        locator.pageIdx = pageIdx;
+        for(int cookieIdx = 0; cookieIdx < cookieCount; ++cookieIdx) {
+            const uint32_t cookieOffset = read32Lo(&cookieOffsetBase);
+            struct SafariCookie cookie;
+            exitCode = decodeCookie(length, data, pageBase, pageEnd, cookieOffset, pageIdx, cookieIdx, &cookie);
+            if (exitCode) {
+                return exitCode;
+            }
+            locator.cookieIdx = cookieIdx;
+            locator.offset = (pageBase - data) + (uint64_t)cookieOffset;
+            runCookie(run, &cookie, &locator);
+        }
+        runEndPage(run, pageIdx);
+
+        // Incorporate the page checksum into the running total
+        checkSum += kernels->pageCheckSum(pageBase, pageEnd);
+        pageBase = pageEnd;
+    }
+    return decodeFileTrailer(run, length, data, pageBase, checkSum);
+}
+
+// Decode just the cookies named by the locators. Each one's page header is validated, and its offset
+// must match the page's offset table, but the rest of the file isn't walked - so the file checksum isn't
+// verified here, the locator's copy of it is just compared to identify the file.
+int fetchCookiesFromMmap(struct Run * run, const char * filename, off_t length, const char * data,
+    const char * const * locators, int locatorCount) {
+    uint32_t pageCount;
+    const char * pageSizeBase;
+    const char * firstPageBase;
+    int exitCode = decodeFileHeader(length, data, &pageCount, &pageSizeBase, &firstPageBase);
+    if (exitCode) {
+        return exitCode;
+    }
+    struct CookieLocator tag;
+    if (!readFileTag(length, data, pageCount, pageSizeBase, firstPageBase, &tag)) {
+        fprintf(stderr, "File too short, for checksum\n");
+        return EXIT_CODE_BAD_EOF;
+    }
+
+    runBeginFile(run, filename, length);
+    for (int locatorIdx = 0; locatorIdx < locatorCount; ++locatorIdx) {
+        const uint64_t fetchStarted = monotonicNanoseconds();
+        struct CookieLocator locator;
+        if (!parseLocator(locators[locatorIdx], &locator)) {
+            fprintf(stderr, "Cannot parse locator %s\n", locators[locatorIdx]);
+            return EXIT_CODE_BAD_LOCATOR;
+        } else if (locator.fileCheckSum != tag.fileCheckSum || locator.fileLength != tag.fileLength) {
+            fprintf(stderr, "Locator %s is for a different file\n", locators[locatorIdx]);
+            return EXIT_CODE_BAD_LOCATOR;
+        } else if (pageCount <= locator.pageIdx) {
+            fprintf(stderr, "Locator %s page out of range\n", locators[locatorIdx]);
+            return EXIT_CODE_BAD_LOCATOR;
+        }
+
+        const char * sizeCursor = pageSizeBase;
+        const char * pageBase = firstPageBase;
+        for (uint32_t pageIdx = 0; pageIdx < locator.pageIdx; ++pageIdx) {
+            pageBase += read32Hi(&sizeCursor);
+        }
+        const char * pageEnd = pageBase + read32Hi(&sizeCursor);
+        if (data + length < pageEnd) {
+            fprintf(stderr, "File too short, incomplete page %d\n", locator.pageIdx);
+            return EXIT_CODE_BAD_EOF;
+        }
+        uint32_t cookieCount;
+        const char * cookieOffsetBase;
+        exitCode = decodePageHeader(pageBase, pageEnd, locator.pageIdx, &cookieCount, &cookieOffsetBase);
+        if (exitCode) {
+            return exitCode;
+        }
+        cookieOffsetBase += locator.cookieIdx * sizeof(uint32_t);
+        if (cookieCount <= locator.cookieIdx || locator.offset != (pageBase - data) + (uint64_t)read32Lo(&cookieOffsetBase)) {
+            fprintf(stderr, "Locator %s does not match the page's cookie offsets\n", locators[locatorIdx]);
+            return EXIT_CODE_BAD_LOCATOR;
+        }
+        struct SafariCookie cookie;
+        exitCode = decodeCookie(length, data, pageBase, pageEnd, locator.offset - (pageBase - data),
+            locator.pageIdx, locator.cookieIdx, &cookie);
+        if (exitCode) {
+            return exitCode;
+        }
+        runBeginPage(run, locator.pageIdx);
+        runCookie(run, &cookie, &locator);
+        runEndPage(run, locator.pageIdx);
+        recordLatency(&run->latency.phases[LATENCY_PHASE_FETCH], monotonicNanoseconds() - fetchStarted);
+    }
+    return EXIT_CODE_OK;
+}
+
+// Sampling picks cookies in a first pass which only reads page headers and offsets, plus the cookie
+// headers when sampling per domain, and then decodes and writes just the ones picked, in file order.
+// Each reservoir is Vitter's algorithm R. Like --fetch, the checksum and the rest of the file aren't
+// checked, since that would mean reading every page - except with --atomic or --stream, which promise to say
+// whether the file was good, so then every page is summed after all.
+uint64_t randomBelow(uint64_t limit) {
+    if (limit <= UINT32_MAX) {
+        return arc4random_uniform(limit);
+    }
+    // Reject the top partial range, to stay uniform
+    const uint64_t reject = UINT64_MAX - UINT64_MAX % limit;
+    uint64_t result;
+    do {
+        arc4random_buf(&result, sizeof(result));
+    } while (result >= reject);
+    return result % limit;
+}
+
+// Offer the seen'th item, counting from zero, to a reservoir of size slots
+void offerSample(struct CookieLocator * reservoir, uint64_t size, uint64_t seen, const struct CookieLocator * item) {
+    if (seen < size) {
+        reservoir[seen] = *item;
+    } else {
+        const uint64_t slot = randomBelow(seen + 1);
+        if (slot < size) {
+            reservoir[slot] = *item;
+        }
+    }
+}
+
+// Each domain gets its own reservoir, at slot * samplePerDomain in one shared array
+struct DomainSample {
+    const char * domain;
+    uint64_t seen;
+    uint64_t slot;
+};
+
+struct Sampler {
+    struct DomainSample * domains;
+    // Always a power of two, or zero
+    uint64_t domainCapacity;
+    uint64_t domainCount;
+    struct CookieLocator * picked;
+    // Only for the whole file reservoir, which grows as it fills, in case N is more than there are
+    uint64_t pickedCapacity;
+    uint64_t seen;
+};
+
+// Open addressing, doubling at half full, as for storagestate groups
+struct DomainSample * findDomainSample(struct Sampler * sampler, const char * domain, uint64_t perDomain) {
+    if (2 * (sampler->domainCount + 1) > sampler->domainCapacity) {
+        const uint64_t capacity = sampler->domainCapacity ? 2 * sampler->domainCapacity : 64;
+        if (SIZE_MAX / sizeof(struct CookieLocator) / perDomain < capacity / 2) {
+            errno = ENOMEM;
+            return 0;
+        }
+        struct DomainSample * domains = calloc(capacity, sizeof(*domains));
+        struct CookieLocator * picked = realloc(sampler->picked, capacity / 2 * perDomain * sizeof(*picked));
+        if (!domains || !picked) {
+            free(domains);
+            sampler->picked = picked ? picked : sampler->picked;
+            return 0;
+        }
+        for (uint64_t i = 0; i < sampler->domainCapacity; ++i) {
+            if (sampler->domains[i].domain) {
+                uint64_t slot = hashString(sampler->domains[i].domain) & (capacity - 1);
+                while (domains[slot].domain) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                domains[slot] = sampler->domains[i];
+            }
+        }
+        free(sampler->domains);
+        sampler->domains = domains;
+        sampler->domainCapacity = capacity;
+        sampler->picked = picked;
+    }
+    uint64_t slot = hashString(domain) & (sampler->domainCapacity - 1);
+    while (sampler->domains[slot].domain && strcmp(sampler->domains[slot].domain, domain)) {
+        slot = (slot + 1) & (sampler->domainCapacity - 1);
+    }
+    struct DomainSample * sample = &sampler->domains[slot];
+    if (!sample->domain) {
+        sample->domain = domain;
+        sample->slot = sampler->domainCount++;
+    }
+    return sample;
+}
+
+int compareLocatorOffsets(const void * left, const void * right) {
+    const uint64_t leftOffset = ((const struct CookieLocator *)left)->offset;
+    const uint64_t rightOffset = ((const struct CookieLocator *)right)->offset;
+    return (leftOffset > rightOffset) - (leftOffset < rightOffset);
+}
+
+int growSample(struct Sampler * sampler) {
+    const uint64_t capacity = sampler->pickedCapacity ? 2 * sampler->pickedCapacity : 1024;
+    struct CookieLocator * picked = capacity <= SIZE_MAX / sizeof(*picked)
+        ? realloc(sampler->picked, capacity * sizeof(*picked)) : 0;
+    if (!picked) {
+        return 0;
+    }
+    sampler->picked = picked;
+    sampler->pickedCapacity = capacity;
+    return 1;
+}
+
+// Picks into sampler->picked, in no particular order
+int pickSample(const struct Run * run, off_t length, const char * data, uint32_t pageCount,
+    const char * pageSizeBase, const char * pageBase, const struct CookieLocator * tag, struct Sampler * sampler,
+    uint64_t * pickedCount) {
+    struct CookieLocator locator = *tag;
+    for (uint32_t pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        const char * pageEnd = pageBase + read32Hi(&pageSizeBase);
+        if (data + length < pageEnd) {
+            fprintf(stderr, "File too short, incomplete page %d\n", pageIdx);
+            return EXIT_CODE_BAD_EOF;
+        }
+        uint32_t cookieCount;
+        const char * cookieOffsetBase;
+        int exitCode = decodePageHeader(pageBase, pageEnd, pageIdx, &cookieCount, &cookieOffsetBase);
+        if (exitCode) {
+            return exitCode;
+        }
+        locator.pageIdx = pageIdx;
+        for (uint32_t cookieIdx = 0; cookieIdx < cookieCount; ++cookieIdx) {
+            const uint32_t cookieOffset = read32Lo(&cookieOffsetBase);
+            locator.cookieIdx = cookieIdx;
+            locator.offset = (pageBase - data) + (uint64_t)cookieOffset;
+            // Filtering needs the cookie header, which is otherwise only read when sampling per domain
+            struct SafariCookie cookie;
+            if (run->samplePerDomain || cookieFilterIsSet(&run->filter)) {
+                exitCode = decodeCookie(length, data, pageBase, pageEnd, cookieOffset, pageIdx, cookieIdx, &cookie);
+                if (exitCode) {
+                    return exitCode;
+                } else if (!cookieMatchesFilter(&run->filter, &cookie)) {
+                    continue;
+                }
+            }
+            if (!run->samplePerDomain) {
+                if (sampler->seen == sampler->pickedCapacity && sampler->seen < run->sampleSize
+                    && !growSample(sampler)) {
+                    perror("Cannot sample");
+                    return EXIT_CODE_BAD_INVOCATION;
+                }
+                offerSample(sampler->picked, run->sampleSize, sampler->seen++, &locator);
+                continue;
+            }
+            struct DomainSample * sample = findDomainSample(sampler, cookie.domain ? cookie.domain : "",
+                run->samplePerDomain);
+            if (!sample) {
+                perror("Cannot sample by domain");
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            offerSample(sampler->picked + sample->slot * run->samplePerDomain, run->samplePerDomain, sample->seen++,
+                &locator);
+        }
+        pageBase = pageEnd;
+    }
+
+    if (!run->samplePerDomain) {
+        *pickedCount = sampler->seen < run->sampleSize ? sampler->seen : run->sampleSize;
+        return EXIT_CODE_OK;
+    }
+    // Pack the domain reservoirs down, which is safe walking them in slot order since nothing moves up,
+    // and then sample from those if asked to
+    uint64_t * counts = calloc(sampler->domainCount ? sampler->domainCount : 1, sizeof(*counts));
+    if (!counts) {
+        perror("Cannot sample by domain");
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+    for (uint64_t i = 0; i < sampler->domainCapacity; ++i) {
+        const struct DomainSample * sample = &sampler->domains[i];
+        if (sample->domain) {
+            counts[sample->slot] = sample->seen < run->samplePerDomain ? sample->seen : run->samplePerDomain;
+        }
+    }
+    *pickedCount = 0;
+    for (uint64_t slot = 0; slot < sampler->domainCount; ++slot) {
+        for (uint64_t j = 0; j < counts[slot]; ++j) {
+            sampler->picked[(*pickedCount)++] = sampler->picked[slot * run->samplePerDomain + j];
+        }
+    }
+    free(counts);
+    if (run->sampleSize && run->sampleSize < *pickedCount) {
+        for (uint64_t i = run->sampleSize; i < *pickedCount; ++i) {
+            offerSample(sampler->picked, run->sampleSize, i, &sampler->picked[i]);
+        }
+        *pickedCount = run->sampleSize;
+    }
+    return EXIT_CODE_OK;
+}
+
+int sampleCookiesFromMmap(struct Run * run, const char * filename, off_t length, const char * data) {
+    uint32_t pageCount;
+    const char * pageSizeBase;
+    const char * pageBase;
+    int exitCode = decodeFileHeader(length, data, &pageCount, &pageSizeBase, &pageBase);
+    if (exitCode) {
+        return exitCode;
+    }
+    struct CookieLocator tag = { 0 };
+    if (!readFileTag(length, data, pageCount, pageSizeBase, pageBase, &tag)) {
+        fprintf(stderr, "File too short, for checksum\n");
+        return EXIT_CODE_BAD_EOF;
+    }
+
+    struct Sampler sampler = { 0 };
+    uint64_t pickedCount = 0;
+    exitCode = pickSample(run, length, data, pageCount, pageSizeBase, pageBase, &tag, &sampler, &pickedCount);
+    free(sampler.domains);
+    if (exitCode) {
+        free(sampler.picked);
+        return exitCode;
+    }
+    qsort(sampler.picked, pickedCount, sizeof(*sampler.picked), compareLocatorOffsets);
+
+    // The pages were all checked while picking, so this just finds them again
+    const char * firstPageSizeBase = pageSizeBase;
+    const char * firstPageBase = pageBase;
+    runBeginFile(run, filename, length);
+    uint64_t pickedIdx = 0;
+    for (uint32_t pageIdx = 0; pageIdx < pageCount && pickedIdx < pickedCount; ++pageIdx) {
+        const char * pageEnd = pageBase + read32Hi(&pageSizeBase);
+        if (sampler.picked[pickedIdx].pageIdx == pageIdx) {
+            runBeginPage(run, pageIdx);
+            for (; pickedIdx < pickedCount && sampler.picked[pickedIdx].pageIdx == pageIdx; ++pickedIdx) {
+                const struct CookieLocator * locator = &sampler.picked[pickedIdx];
+                struct SafariCookie cookie;
+                exitCode = decodeCookie(length, data, pageBase, pageEnd, locator->offset - (pageBase - data),
+                    pageIdx, locator->cookieIdx, &cookie);
+                if (exitCode) {
+                    free(sampler.picked);
+                    return exitCode;
+                }
+                runCookie(run, &cookie, locator);
+            }
+            runEndPage(run, pageIdx);
+        }
+        pageBase = pageEnd;
+    }
+    free(sampler.picked);
+    if (OUTPUT_MODE_PARTIAL == run->outputMode) {
+        return EXIT_CODE_OK;
+    }
+    uint32_t checkSum = 0;
+    pageSizeBase = firstPageSizeBase;
+    pageBase = firstPageBase;
+    for (uint32_t pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        const char * pageEnd = pageBase + read32Hi(&pageSizeBase);
+        checkSum += kernels->pageCheckSum(pageBase, pageEnd);
+        pageBase = pageEnd;
+    }
+    return decodeFileTrailer(run, length, data, pageBase, checkSum);
+}
+
+int decodeBinaryCookiesFromMmap(struct Run * run, const char * filename, off_t length, const char * data) {
+    if (run->sampleSize || run->samplePerDomain) {
+        return sampleCookiesFromMmap(run, filename, length, data);
+    } else {
+        return printCookiesFromMmap(run, filename, length, data);
+    }
+}
+
+// Other browsers keep cookies in SQLite. Those stores are decoded into the same records as the binary
+// cookie format, so every output works the same way for them. Each schema's query converts to the
+// Safari conventions: times in seconds since the Mac epoch, and the secure and httpOnly flag bits.
+// Chromium keeps most values encrypted in encrypted_value, which we don't try to decrypt, so those
+// come out empty.
+const char SQLITE_MAGIC[] = "SQLite format 3";
+
+struct SqliteCookieSchema {
+    const char * name;
+    // Selects domain, name, value, path, expiry, creation, secure, httpOnly
+    const char * query;
+};
+
+const struct SqliteCookieSchema SQLITE_COOKIE_SCHEMAS[] = {
+    // Expiry is unix seconds, creation is unix microseconds
+    { "firefox",
+        "SELECT host AS domain, name, value, path, expiry - 978307200.0 AS expiry, "
+        "creationTime / 1000000.0 - 978307200.0 AS creation, isSecure AS secure, isHttpOnly AS httpOnly "
+        "FROM moz_cookies ORDER BY id" },
+    // Both are microseconds since 1601, and session cookies have no expiry
+    { "chromium",
+        "SELECT host_key AS domain, name, value, path, "
+        "CASE expires_utc WHEN 0 THEN 0 ELSE expires_utc / 1000000.0 - 12622780800.0 END AS expiry, "
+        "creation_utc / 1000000.0 - 12622780800.0 AS creation, is_secure AS secure, is_httponly AS httpOnly "
+        "FROM cookies ORDER BY creation_utc" },
+};
+
+int probeSqlite(off_t length, const char * data) {
+    return sizeof(SQLITE_MAGIC) <= length && !memcmp(data, SQLITE_MAGIC, sizeof(SQLITE_MAGIC));
+}
+
+// Open read only and immutable, so a browser holding the store open doesn't get in our way, and we
+// don't leave journal files behind. That needs a URI, so escape what URIs care about.
+sqlite3 * openSqliteCookieStore(const char * filename) {
+    char * uri = malloc(strlen("file:") + 3 * strlen(filename) + strlen("?immutable=1") + 1);
+    if (!uri) {
+        return 0;
+    }
+    char * cursor = uri + sprintf(uri, "file:");
+    for (const char * in = filename; *in; ++in) {
+        if ('%' == *in || '?' == *in || '#' == *in) {
+            cursor += sprintf(cursor, "%%%02X", (uint8_t)*in);
+        } else {
+            *cursor++ = *in;
+        }
+    }
+    strcpy(cursor, "?immutable=1");
+    sqlite3 * db = 0;
+    const int result = sqlite3_open_v2(uri, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, 0);
+    free(uri);
+    if (SQLITE_OK != result) {
+        fprintf(stderr, "Cannot open SQLite cookie store: %s\n", db ? sqlite3_errmsg(db) : sqlite3_errstr(result));
+        sqlite3_close(db);
+        return 0;
+    }
+    return db;
+}
+
+// The filter as SQL, for cookieMatchesFilter's rules, with the values bound by bindSqliteCookieFilter. A
+// missing domain is empty, and one leading dot is ignored on either side.
+const char SQLITE_COOKIE_FILTER[] = "SELECT * FROM (SELECT *, "
+    "lower(substr(coalesce(domain, ''), 1 + ('.' = substr(coalesce(domain, ''), 1, 1)))) AS filterDomain "
+    "FROM (%s)) WHERE (?1 IS NULL OR filterDomain = lower(?1) OR substr(filterDomain, -1 - length(?1)) = '.' || lower(?1)) "
+    "AND (?2 IS NULL OR name = ?2) AND (?3 IS NULL OR expiry >= ?3 OR (?4 AND 0 = expiry)) "
+    "AND (?5 IS NULL OR expiry <= ?5)";
+
+// Filtering and sampling are left to SQLite, by wrapping the schema's query, filter first so that samples
+// are picked from the cookies which match. runCookie checks the filter again, which costs little once
+// SQLite has done the work. Returns null if we're out of memory.
+char * sqliteCookieQuery(const struct Run * run, const char * query) {
+    char * result = sqlite3_mprintf("%s", query);
+    if (result && cookieFilterIsSet(&run->filter)) {
+        char * wrapped = sqlite3_mprintf(SQLITE_COOKIE_FILTER, result);
+        sqlite3_free(result);
+        result = wrapped;
+    }
+    if (result && run->samplePerDomain) {
+        char * wrapped = sqlite3_mprintf("SELECT * FROM (SELECT *, row_number() OVER "
+            "(PARTITION BY domain ORDER BY random()) AS sampleRank FROM (%s)) WHERE sampleRank <= %llu",
+            result, (unsigned long long)run->samplePerDomain);
+        sqlite3_free(result);
+        result = wrapped;
+    }
+    if (result && run->sampleSize) {
+        char * wrapped = sqlite3_mprintf("SELECT * FROM (%s) ORDER BY random() LIMIT %llu",
+            result, (unsigned long long)run->sampleSize);
+        sqlite3_free(result);
+        result = wrapped;
+    }
+    return result;
+}
+
+int bindSqliteCookieFilter(sqlite3_stmt * statement, const struct CookieFilter * filter) {
+    int result = SQLITE_OK;
+    if (filter->domain) {
+        result = sqlite3_bind_text(statement, 1, filter->domain + ('.' == *filter->domain), -1, SQLITE_STATIC);
+    }
+    if (SQLITE_OK == result && filter->name) {
+        result = sqlite3_bind_text(statement, 2, filter->name, -1, SQLITE_STATIC);
+    }
+    if (SQLITE_OK == result && filter->hasMinExpiry) {
+        result = sqlite3_bind_double(statement, 3, filter->minExpiry);
+    }
+    if (SQLITE_OK == result) {
+        result = sqlite3_bind_int(statement, 4, filter->keepsSessions);
+    }
+    if (SQLITE_OK == result && filter->hasMaxExpiry) {
+        result = sqlite3_bind_double(statement, 5, filter->maxExpiry);
+    }
+    return result;
+}
+
+const char * sqliteColumnText(sqlite3_stmt * statement, int column) {
+    return (const char *)sqlite3_column_text(statement, column);
+}
+
+// Each row is its own page, since SQLite only keeps a row's strings valid until the next step, and
+// plugins hold on to a page of cookies. There is nothing to locate them with, or any plist.
+int printCookiesFromSqlite(struct Run * run, const char * filename, off_t length, const char * data) {
+    sqlite3 * db = openSqliteCookieStore(filename);
+    if (!db) {
+        return EXIT_CODE_BAD_SQLITE;
+    }
+    sqlite3_stmt * statement = 0;
+    for (int i = 0; i < sizeof(SQLITE_COOKIE_SCHEMAS) / sizeof(SQLITE_COOKIE_SCHEMAS[0]) && !statement; ++i) {
+        // Preparing fails if the table or columns aren't there, which is how we recognise the schema
+        char * query = sqliteCookieQuery(run, SQLITE_COOKIE_SCHEMAS[i].query);
+        if (!query || SQLITE_OK != sqlite3_prepare_v2(db, query, -1, &statement, 0)) {
+            statement = 0;
+        }
+        sqlite3_free(query);
+    }
+    if (!statement) {
+        fprintf(stderr, "No known cookie table in SQLite file\n");
+        sqlite3_close(db);
+        return EXIT_CODE_BAD_SQLITE;
+    } else if (cookieFilterIsSet(&run->filter) && SQLITE_OK != bindSqliteCookieFilter(statement, &run->filter)) {
+        fprintf(stderr, "Cannot filter SQLite cookie store: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(statement);
+        sqlite3_close(db);
+        return EXIT_CODE_BAD_SQLITE;
+    }
+
+    runBeginFile(run, filename, length);
+    int result;
+    uint32_t rowIdx = 0;
+    while (SQLITE_ROW == (result = sqlite3_step(statement))) {
+        const struct SafariCookie cookie = {
+            .version = 0,
+            .flags = (sqlite3_column_int(statement, 6) ? COOKIE_FLAG_SECURE : 0)
+                | (sqlite3_column_int(statement, 7) ? COOKIE_FLAG_HTTP_ONLY : 0),
+            .domain = sqliteColumnText(statement, 0),
+            .name = sqliteColumnText(statement, 1),
+            .value = sqliteColumnText(statement, 2),
+            .path = sqliteColumnText(statement, 3),
+            .expiry = sqlite3_column_double(statement, 4),
+            .creation = sqlite3_column_double(statement, 5),
+        };
+        runBeginPage(run, rowIdx);
+        runCookie(run, &cookie, 0);
+        runEndPage(run, rowIdx);
+        ++rowIdx;
+    }
+    int exitCode = EXIT_CODE_OK;
+    if (SQLITE_DONE != result) {
+        fprintf(stderr, "Cannot read SQLite cookie store: %s\n", sqlite3_errmsg(db));
+        exitCode = EXIT_CODE_BAD_SQLITE;
+    }
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+    return exitCode;
+}
+
+int probeBinaryCookies(off_t length, const char * data) {
+    return sizeof(BINARY_COOKIE_MAGIC) <= length && !memcmp(data, BINARY_COOKIE_MAGIC, sizeof(BINARY_COOKIE_MAGIC));
+}
+
+// Input decoders, recognised by their first bytes. They all produce the same records, so everything
+// downstream works the same whichever browser the file came from.
+struct CookieDecoder {
+    const char * name;
+    int (*probe)(off_t length, const char * data);
+    int (*decode)(struct Run * run, const char * filename, off_t length, const char * data);
+};
+
+const struct CookieDecoder COOKIE_DECODERS[] = {
+    { "binarycookies", probeBinaryCookies, decodeBinaryCookiesFromMmap },
+    { "sqlite", probeSqlite, printCookiesFromSqlite },
+};
+
+// Anything unrecognised goes to the binary cookie decoder, which explains what's wrong with it
+int decodeCookiesFromMmap(struct Run * run, const char * filename, off_t length, const char * data) {
+    for (int i = 0; i < sizeof(COOKIE_DECODERS) / sizeof(COOKIE_DECODERS[0]); ++i) {
+        if (COOKIE_DECODERS[i].probe(length, data)) {
+            return COOKIE_DECODERS[i].decode(run, filename, length, data);
+        }
+    }
+    return decodeBinaryCookiesFromMmap(run, filename, length, data);
+}
+
+struct MappedFile {
+    const char * filename;
+    int fd;
+    off_t length;
+    void * data;
+    // Non zero if the file couldn't be opened or mapped
+    int exitCode;
+    // How long the reader took to open, map, and fault it in
+    uint64_t openNanoseconds;
+};
+
+// With a window, only the start of the file is faulted in, the walk prefetches the rest as it goes.
+// It's a chunk at a time, for --max-read-rate.
+void prefaultMappedFile(const struct Run * run, const struct MappedFile * file) {
+    const off_t length = run->windowSize && run->windowSize < file->length ? run->windowSize : file->length;
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    volatile char sum = 0;
+    for (off_t chunk = 0; chunk < length; chunk += THROTTLE_CHUNK_SIZE) {
+        const off_t chunkEnd = length - chunk < THROTTLE_CHUNK_SIZE ? length : chunk + THROTTLE_CHUNK_SIZE;
+        throttleRead(run->throttle, chunkEnd - chunk);
+        madvise((char *)file->data + chunk, chunkEnd - chunk, MADV_WILLNEED);
+        for (off_t offset = chunk; offset < chunkEnd; offset += pageSize) {
+            sum += ((const char *)file->data)[offset];
+        }
+    }
+}
+
+int mapFd(struct MappedFile * file) {
+    struct stat statResult;
+    if (fstat(file->fd, &statResult)) {
+        perror("Cannot stat file");
+        return EXIT_CODE_BAD_STAT;
+    }
+
+    file->length = statResult.st_size;
+
+    file->data = mmap(0, file->length, PROT_READ, MAP_PRIVATE | MAP_NOCACHE, file->fd, 0);
+    if (MAP_FAILED == file->data) {
+        perror("Cannot mmap file");
+        return EXIT_CODE_BAD_MMAP;
+    } else {
+        return EXIT_CODE_OK;
+    }
+}
+
+int unmapFd(struct MappedFile * file, int exitCode) {
+    if (munmap(file->data, file->length)) {
+        perror("Cannot munmap file");
+        return exitCode ? exitCode : EXIT_CODE_BAD_MUNMAP;
+    } else {
+        return exitCode;
+    }
+}
+
+int printCookiesFromFd(struct Run * run, const char * filename, int fd) {
+    struct MappedFile file = { .filename = filename, .fd = fd };
+    int exitCode = mapFd(&file);
+    if (exitCode) {
+        return exitCode;
+    }
+    addRelaxed(&run->bytesRead, file.length);
+    // Unthrottled, the walk just faults pages in as it goes
+    if (run->throttle) {
+        prefaultMappedFile(run, &file);
+    }
+    recordPhase(run, LATENCY_PHASE_OPEN);
+    exitCode = unmapFd(&file, decodeCookiesFromMmap(run, filename, file.length, file.data));
+    recordPhase(run, LATENCY_PHASE_WALK);
+    throttleCpu(run->throttle);
+    return exitCode;
+}
+
+int closeFile(int fd, int exitCode) {
+    if (close(fd)) {
+        // Not much we can actually do, but interesting to know maybe
+        perror("Cannot close file");
+        return exitCode ? exitCode : EXIT_CODE_BAD_CLOSE;
+    } else {
+        return exitCode;
+    }
+}
+
+int printCookiesFromFilename(struct Run * run, const char * filename) {
+    run->phaseStarted = monotonicNanoseconds();
+    const int fd = open(filename, O_RDONLY);
+    if (-1 == fd) {
+        perror("Cannot open file");
+        return EXIT_CODE_BAD_OPEN;
+    } else {
+        return closeFile(fd, printCookiesFromFd(run, filename, fd));
+    }
+}
+
+int fetchCookiesFromFilename(struct Run * run, const char * filename, const char * const * locators,
+    int locatorCount) {
+    const int fd = open(filename, O_RDONLY);
+    if (-1 == fd) {
+        perror("Cannot open file");
+        return runFinishFile(run, filename, EXIT_CODE_BAD_OPEN);
+    }
+    struct MappedFile file = { .filename = filename, .fd = fd };
+    int exitCode = mapFd(&file);
+    if (!exitCode) {
+        exitCode = fetchCookiesFromMmap(run, filename, file.length, file.data, locators, locatorCount);
+        exitCode = unmapFd(&file, exitCode);
+    }
+    return runFinishFile(run, filename, closeFile(fd, exitCode));
+}
+
+// The pipelined batch mode overlaps I/O with parsing. Reader threads open and map the next files, and fault
+// their pages in, while the main thread validates, formats and writes the current one, in order. Files go
+// through a ring of slots, and a reader only claims a file once it's within the read ahead depth of the one
+// being parsed. The sinks are only ever touched from the main thread, so they need no locking.
+//
+// How many readers and how deep to read ahead depends on where the files are. Warm local files want one
+// reader and a short queue, since parsing is the bottleneck and more just holds more memory, while cold
+// network mounts want many reads in flight. So the main thread adjusts both as it goes: when it spends much
+// of its time waiting for files it adds a reader and doubles the depth, and when it never waits it backs
+// off. If adding didn't improve throughput it's undone, and left alone for a while.
+enum {
+    MAX_PIPELINE_DEPTH = 64,
+    MIN_PIPELINE_DEPTH = 2,
+    INITIAL_PIPELINE_DEPTH = 4,
+    MAX_PIPELINE_READER_COUNT = 16,
+    PIPELINE_INTERVAL_NANOSECONDS = 100 * 1000 * 1000,
+    // After undoing a step which didn't help, how many intervals to leave things be
+    PIPELINE_HOLD_INTERVALS = 10,
+};
+
+// Waiting more than this much of the time means reads are the bottleneck, and less than the other, parsing
+const double PIPELINE_IO_BOUND_STARVED = 0.10;
+const double PIPELINE_CPU_BOUND_STARVED = 0.02;
+// A step has to gain at least this much throughput to be kept
+const double PIPELINE_MIN_GAIN = 1.05;
+
+struct MappedFileQueue {
+    struct MappedFile files[MAX_PIPELINE_DEPTH];
+    _Atomic uint32_t ready[MAX_PIPELINE_DEPTH];
+    // The next file for a reader to claim, and the next for the main thread to parse
+    _Atomic uint64_t claimed;
+    _Atomic uint64_t tail;
+    // Waits are on a condition variable rather than the ring's futex, which on macOS is a sleep poll. A reader
+    // waits for fileTaken when there's nothing it may claim, and the main thread for fileReady.
+    pthread_mutex_t lock;
+    pthread_cond_t fileReady;
+    pthread_cond_t fileTaken;
+    // Set by the main thread. Readers numbered past readerCount wait.
+    _Atomic uint32_t depth;
+    _Atomic uint32_t readerCount;
+    const char * const * filenames;
+    int fileCount;
+    const struct Run * run;
+};
+
+struct PipelineReader {
+    struct MappedFileQueue * queue;
+    uint32_t readerIdx;
+    pthread_t thread;
+    // Merged into the run's once the reader is done
+    struct LatencyHistogram openLatency;
+    _Atomic uint64_t bytesRead;
+};
+
+// Several readers can be waiting at once. Taking the lock means a reader can't miss the wake between
+// checking and waiting.
+void wakeAllReaders(struct MappedFileQueue * queue) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->fileTaken);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// How many CPUs we may use, which in a container is usually the cgroup quota rather than what's online
+double availableCpuCount(void) {
+    double cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    double quota = 0;
+    double period = 0;
+    char limit[32];
+    FILE * in = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (in) {
+        // cgroup v2 is "QUOTA PERIOD", or "max PERIOD" for no quota
+        if (2 == fscanf(in, "%31s %lf", limit, &period) && strcmp(limit, "max")) {
+            quota = strtod(limit, 0);
+        }
+        fclose(in);
+    } else if ((in = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        // cgroup v1 has them in separate files, and -1 for no quota
+        if (1 != fscanf(in, "%lf", &quota)) {
+            quota = 0;
+        }
+        fclose(in);
+        if ((in = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (1 != fscanf(in, "%lf", &period)) {
+                period = 0;
+            }
+            fclose(in);
+        }
+    }
+    if (0 < quota && 0 < period && quota / period < cpuCount) {
+        cpuCount = quota / period;
+    }
+#endif
+    return 0 < cpuCount ? cpuCount : 1;
+}
+
+void readMappedFile(const struct Run * run, struct MappedFile * file, const char * filename) {
+    const uint64_t started = monotonicNanoseconds();
+    memset(file, 0, sizeof(*file));
+    file->filename = filename;
+    file->fd = open(file->filename, O_RDONLY);
+    if (-1 == file->fd) {
+        perror("Cannot open file");
+        file->exitCode = EXIT_CODE_BAD_OPEN;
+    } else {
+        file->exitCode = mapFd(file);
+        if (file->exitCode) {
+            file->exitCode = closeFile(file->fd, file->exitCode);
+        } else {
+            prefaultMappedFile(run, file);
+        }
+    }
+    file->openNanoseconds = monotonicNanoseconds() - started;
+}
+
+void * readerStage(void * argument) {
+    struct PipelineReader * reader = argument;
+    struct MappedFileQueue * queue = reader->queue;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        uint64_t claimed = atomic_load(&queue->claimed);
+        while (claimed < (uint64_t)queue->fileCount && (atomic_load(&queue->readerCount) <= reader->readerIdx
+            || atomic_load(&queue->depth) <= claimed - atomic_load(&queue->tail))) {
+            pthread_cond_wait(&queue->fileTaken, &queue->lock);
+            claimed = atomic_load(&queue->claimed);
+        }
+        if ((uint64_t)queue->fileCount <= claimed) {
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+        atomic_store(&queue->claimed, claimed + 1);
+        pthread_mutex_unlock(&queue->lock);
+        struct MappedFile * file = &queue->files[claimed % MAX_PIPELINE_DEPTH];
+        readMappedFile(queue->run, file, queue->filenames[claimed]);
+        if (!file->exitCode) {
+            recordLatency(&reader->openLatency, file->openNanoseconds);
+            addRelaxed(&reader->bytesRead, file->length);
+        }
+        pthread_mutex_lock(&queue->lock);
+        atomic_store_explicit(&queue->ready[claimed % MAX_PIPELINE_DEPTH], 1, memory_order_release);
+        pthread_cond_signal(&queue->fileReady);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void recordPipelineDecision(struct PipelineReport * report, uint64_t started, uint32_t readerCount,
+    uint32_t depth, const char * reason) {
+    if (report->decisionCount < MAX_PIPELINE_DECISIONS) {
+        struct PipelineDecision * decision = &report->decisions[report->decisionCount];
+        decision->seconds = (monotonicNanoseconds() - started) / 1e9;
+        decision->readerCount = readerCount;
+        decision->depth = depth;
+        decision->reason = reason;
+    }
+    ++report->decisionCount;
+}
+
+struct PipelineController {
+    uint64_t started;
+    uint64_t intervalStarted;
+    uint64_t intervalBytes;
+    uint64_t intervalStarvedNanoseconds;
+    double previousBytesPerSecond;
+    // Whether the last interval ended by adding readers
+    int grew;
+    int holdIntervals;
+};
+
+// Called by the main thread after each file, to decide the readers and depth for what's next
+void adjustPipeline(struct MappedFileQueue * queue, struct PipelineController * controller,
+    struct PipelineReport * report) {
+    const uint64_t now = monotonicNanoseconds();
+    const uint64_t elapsed = now - controller->intervalStarted;
+    if (elapsed < PIPELINE_INTERVAL_NANOSECONDS) {
+        return;
+    }
+    const double bytesPerSecond = controller->intervalBytes * 1e9 / elapsed;
+    const double starved = (double)controller->intervalStarvedNanoseconds / elapsed;
+    uint32_t readerCount = atomic_load(&queue->readerCount);
+    uint32_t depth = atomic_load(&queue->depth);
+    const char * reason = 0;
+    if (controller->grew && bytesPerSecond < controller->previousBytesPerSecond * PIPELINE_MIN_GAIN) {
+        reason = "noGain";
+        --readerCount;
+        depth = depth / 2 < MIN_PIPELINE_DEPTH ? MIN_PIPELINE_DEPTH : depth / 2;
+        controller->holdIntervals = PIPELINE_HOLD_INTERVALS;
+    } else if (controller->holdIntervals) {
+        --controller->holdIntervals;
+    } else if (PIPELINE_IO_BOUND_STARVED < starved && readerCount < report->maxReaderCount) {
+        reason = "ioBound";
+        ++readerCount;
+        depth = MAX_PIPELINE_DEPTH < 2 * depth ? MAX_PIPELINE_DEPTH : 2 * depth;
+    } else if (starved < PIPELINE_CPU_BOUND_STARVED && (1 < readerCount || MIN_PIPELINE_DEPTH < depth)) {
+        reason = "cpuBound";
+        readerCount = 1 < readerCount ? readerCount - 1 : 1;
+        depth = depth / 2 < MIN_PIPELINE_DEPTH ? MIN_PIPELINE_DEPTH : depth / 2;
+    }
+    // Every reader needs a slot to read into
+    depth = depth < readerCount ? readerCount : depth;
+    controller->grew = reason && !strcmp(reason, "ioBound");
+    if (reason) {
+        atomic_store(&queue->readerCount, readerCount);
+        atomic_store(&queue->depth, depth);
+        wakeAllReaders(queue);
+        recordPipelineDecision(report, controller->started, readerCount, depth, reason);
+    }
+    controller->previousBytesPerSecond = bytesPerSecond;
+    controller->intervalStarted = now;
+    controller->intervalBytes = 0;
+    controller->intervalStarvedNanoseconds = 0;
+}
+
+// For SIGUSR1, the histograms so far, including what the readers have yet to merge
+void dumpLatency(const struct Run * run, const struct PipelineReader * readers, uint32_t readerCount) {
+    static struct Latency snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    for (int phase = 0; phase < LATENCY_PHASE_COUNT; ++phase) {
+        mergeLatency(&snapshot.phases[phase], &run->latency.phases[phase]);
+    }
+    for (uint32_t readerIdx = 0; readerIdx < readerCount; ++readerIdx) {
+        mergeLatency(&snapshot.phases[LATENCY_PHASE_OPEN], &readers[readerIdx].openLatency);
+    }
+    emitLatency(stderr, &snapshot);
+    fflush(stderr);
+}
+
+enum {
+    METRICS_FILE_INTERVAL_NANOSECONDS = 1000 * 1000 * 1000,
+    METRICS_POLL_MILLISECONDS = 100,
+    METRICS_REQUEST_SIZE = 4096,
+};
+
+void emitMetric(FILE * out, const char * name, const char * type, const char * help, unsigned long long value) {
+    fprintf(out, "# HELP safari_cookie_json_%s %s\n# TYPE safari_cookie_json_%s %s\nsafari_cookie_json_%s %llu\n",
+        name, help, name, type, name, value);
+}
+
+// Adds up the counters of the main thread and any readers, so a scrape costs the run nothing until it happens
+void emitMetrics(FILE * out, struct Metrics * metrics) {
+    static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+    const struct Run * run = metrics->run;
+    struct Latency * latency = calloc(1, sizeof(*latency));
+    if (!latency) {
+        return;
+    }
+    pthread_mutex_lock(&metrics->lock);
+    uint64_t bytesRead = atomic_load_explicit(&run->bytesRead, memory_order_relaxed);
+    for (int phase = 0; phase < LATENCY_PHASE_COUNT; ++phase) {
+        mergeLatency(&latency->phases[phase], &run->latency.phases[phase]);
+    }
+    for (uint32_t readerIdx = 0; readerIdx < metrics->readerCount; ++readerIdx) {
+        bytesRead += atomic_load_explicit(&metrics->readers[readerIdx].bytesRead, memory_order_relaxed);
+        mergeLatency(&latency->phases[LATENCY_PHASE_OPEN], &metrics->readers[readerIdx].openLatency);
+    }
+    const struct MappedFileQueue * queue = metrics->queue;
+    const uint32_t readerCount = queue ? atomic_load(&queue->readerCount) : 0;
+    const uint32_t depth = queue ? atomic_load(&queue->depth) : 0;
+    const uint64_t queued = queue ? atomic_load(&queue->claimed) - atomic_load(&queue->tail) : 0;
+    pthread_mutex_unlock(&metrics->lock);
+
+    emitMetric(out, "files_total", "counter", "Files finished, good or bad.",
+        atomic_load_explicit(&run->fileCount, memory_order_relaxed));
+    emitMetric(out, "failed_files_total", "counter", "Files which failed to open or decode.",
+        atomic_load_explicit(&run->failedFileCount, memory_order_relaxed));
+    emitMetric(out, "read_bytes_total", "counter", "Bytes of files mapped for walking.", bytesRead);
+    emitMetric(out, "cookies_total", "counter", "Cookies passed to the outputs, after filtering.",
+        atomic_load_explicit(&run->cookieCount, memory_order_relaxed));
+    if (queue) {
+        emitMetric(out, "pipeline_readers", "gauge", "Reader threads in use.", readerCount);
+        emitMetric(out, "pipeline_depth", "gauge", "How many files ahead the readers may read.", depth);
+        emitMetric(out, "pipeline_queued_files", "gauge", "Files claimed by readers and not yet walked.", queued);
+    }
+    if (atomic_load_explicit(&run->watchedFileCount, memory_order_relaxed)) {
+        emitMetric(out, "watched_files", "gauge", "Files being watched.",
+            atomic_load_explicit(&run->watchedFileCount, memory_order_relaxed));
+        emitMetric(out, "rewrites_total", "counter", "Rewrites of watched files which were diffed.",
+            atomic_load_explicit(&run->rewriteCount, memory_order_relaxed));
+        emitMetric(out, "reused_pages_total", "counter", "Pages of rewrites unchanged, so not decoded again.",
+            atomic_load_explicit(&run->reusedPageCount, memory_order_relaxed));
+        emitMetric(out, "decoded_pages_total", "counter", "Pages of rewrites which changed, and were decoded.",
+            atomic_load_explicit(&run->decodedPageCount, memory_order_relaxed));
+        emitMetric(out, "subscribers", "gauge", "Subscribers connected.",
+            atomic_load_explicit(&run->subscriberCount, memory_order_relaxed));
+        emitMetric(out, "events_total", "counter", "Change events, each counted once however many subscribers get it.",
+            atomic_load_explicit(&run->eventCount, memory_order_relaxed));
+    }
+    fputs("# HELP safari_cookie_json_latency_seconds Time spent on each file, by phase.\n"
+        "# TYPE safari_cookie_json_latency_seconds summary\n", out);
+    for (int phase = 0; phase < LATENCY_PHASE_COUNT; ++phase) {
+        const struct LatencyHistogram * histogram = &latency->phases[phase];
+        const uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        const char * name = LATENCY_PHASE_NAMES[phase];
+        if (!count) {
+            continue;
+        }
+        for (int i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); ++i) {
+            fprintf(out, "safari_cookie_json_latency_seconds{phase=\"%c%s\",quantile=\"%g\"} %.9f\n",
+                tolower(*name), name + 1, QUANTILES[i], latencyQuantile(histogram, QUANTILES[i]) / 1e9);
+        }
+        fprintf(out, "safari_cookie_json_latency_seconds_sum{phase=\"%c%s\"} %.9f\n", tolower(*name), name + 1,
+            atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e9);
+        fprintf(out, "safari_cookie_json_latency_seconds_count{phase=\"%c%s\"} %llu\n", tolower(*name), name + 1,
+            (unsigned long long)count);
+    }
+    free(latency);
+}
+
+// Written beside and renamed over the file, so a collector never reads half of it
+int writeMetricsFile(struct Metrics * metrics) {
+    char * temporaryFilename = 0;
+    FILE * out = openOutputFile(metrics->filename, OUTPUT_MODE_ATOMIC, &temporaryFilename);
+    if (out) {
+        emitMetrics(out, metrics);
+    }
+    if (!out || !closeOutputFile(out, metrics->filename, temporaryFilename)) {
+        perror("Cannot write metrics");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    metrics->written = monotonicNanoseconds();
+    return EXIT_CODE_OK;
+}
+
+// Called by the main thread between files
+void refreshMetrics(struct Metrics * metrics) {
+    if (metrics && metrics->filename
+        && METRICS_FILE_INTERVAL_NANOSECONDS <= monotonicNanoseconds() - metrics->written) {
+        writeMetricsFile(metrics);
+    }
+}
+
+// The pipeline's readers are on its stack, so they're only scraped between these
+void publishPipeline(struct Metrics * metrics, const struct MappedFileQueue * queue,
+    const struct PipelineReader * readers, uint32_t readerCount) {
+    if (metrics) {
+        pthread_mutex_lock(&metrics->lock);
+        metrics->queue = queue;
+        metrics->readers = readers;
+        metrics->readerCount = readerCount;
+        pthread_mutex_unlock(&metrics->lock);
+    }
+}
+
+// Once the readers are done, their counts move to the run's, in one step as far as a scrape can tell
+void retirePipeline(struct Run * run, const struct PipelineReader * readers, uint32_t readerCount) {
+    if (run->metrics) {
+        pthread_mutex_lock(&run->metrics->lock);
+    }
+    for (uint32_t readerIdx = 0; readerIdx < readerCount; ++readerIdx) {
+        mergeLatency(&run->latency.phases[LATENCY_PHASE_OPEN], &readers[readerIdx].openLatency);
+        addRelaxed(&run->bytesRead, atomic_load_explicit(&readers[readerIdx].bytesRead, memory_order_relaxed));
+    }
+    if (run->metrics) {
+        run->metrics->queue = 0;
+        run->metrics->readers = 0;
+        run->metrics->readerCount = 0;
+        pthread_mutex_unlock(&run->metrics->lock);
+    }
+}
+
+int sendAll(int fd, const char * data, size_t length) {
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (length) {
+        const ssize_t sent = send(fd, data, length, flags);
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+// Answers each connection with a minimal HTTP response, so curl --unix-socket or a proxy can scrape it. The
+// request itself doesn't matter, and a client which never sends one gets answered anyway.
+void serveMetricsClient(struct Metrics * metrics, int fd) {
+#ifdef SO_NOSIGPIPE
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    struct pollfd request = { .fd = fd, .events = POLLIN };
+    char buffer[METRICS_REQUEST_SIZE];
+    if (0 < poll(&request, 1, METRICS_POLL_MILLISECONDS)) {
+        recv(fd, buffer, sizeof(buffer), 0);
+    }
+    char * body = 0;
+    size_t bodyLength = 0;
+    FILE * out = open_memstream(&body, &bodyLength);
+    if (!out) {
+        return;
+    }
+    emitMetrics(out, metrics);
+    if (!fclose(out)) {
+        const int headerLength = snprintf(buffer, sizeof(buffer), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLength);
+        if (sendAll(fd, buffer, headerLength)) {
+            sendAll(fd, body, bodyLength);
+        }
+    }
+    free(body);
+}
+
+void * metricsServer(void * argument) {
+    struct Metrics * metrics = argument;
+    struct pollfd listener = { .fd = metrics->listenFd, .events = POLLIN };
+    while (!atomic_load(&metrics->stopping)) {
+        if (poll(&listener, 1, METRICS_POLL_MILLISECONDS) <= 0) {
+            continue;
+        }
+        const int fd = accept(metrics->listenFd, 0, 0);
+        if (-1 != fd) {
+            serveMetricsClient(metrics, fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// Replaces any stale socket at path. Returns -1 on failure, having said why.
+int listenUnixSocket(const char * path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (sizeof(address.sun_path) <= strlen(path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == fd || bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        if (-1 != fd) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// FILE, or unix:PATH for a socket, which replaces any stale one
+int startMetrics(struct Metrics * metrics, const char * spec, const struct Run * run) {
+    metrics->run = run;
+    pthread_mutex_init(&metrics->lock, 0);
+    if (strncmp(spec, "unix:", strlen("unix:"))) {
+        metrics->filename = spec;
+        return writeMetricsFile(metrics);
+    }
+    metrics->socketPath = spec + strlen("unix:");
+    metrics->listenFd = listenUnixSocket(metrics->socketPath);
+    if (-1 == metrics->listenFd) {
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    if (pthread_create(&metrics->server, 0, metricsServer, metrics)) {
+        perror("Cannot start metrics thread");
+        return EXIT_CODE_BAD_THREAD;
+    }
+    return EXIT_CODE_OK;
+}
+
+// The file gets the final counts, while the socket goes away with the run
+int stopMetrics(struct Metrics * metrics) {
+    if (metrics->filename) {
+        return writeMetricsFile(metrics);
+    }
+    atomic_store(&metrics->stopping, 1);
+    pthread_join(metrics->server, 0);
+    close(metrics->listenFd);
+    unlink(metrics->socketPath);
+    return EXIT_CODE_OK;
+}
+
+int printCookiesFromFilenamesPipelined(struct Run * run, const char * const * filenames, int fileCount) {
+    struct MappedFileQueue queue = {
+        .filenames = filenames, .fileCount = fileCount, .run = run, .depth = INITIAL_PIPELINE_DEPTH, .readerCount = 1,
+    };
+    pthread_mutex_init(&queue.lock, 0);
+    pthread_cond_init(&queue.fileReady, 0);
+    pthread_cond_init(&queue.fileTaken, 0);
+
+    // Readers mostly wait on I/O, but faulting pages in takes some CPU, so don't run far more than we have
+    struct PipelineReport * report = &run->pipeline;
+    report->used = 1;
+    report->cpuCount = availableCpuCount();
+    report->maxReaderCount = 2 * report->cpuCount < 1 ? 1 : 2 * report->cpuCount;
+    if (MAX_PIPELINE_READER_COUNT < report->maxReaderCount) {
+        report->maxReaderCount = MAX_PIPELINE_READER_COUNT;
+    }
+    struct PipelineReader readers[MAX_PIPELINE_READER_COUNT];
+    uint32_t readerCount = 0;
+    for (; readerCount < report->maxReaderCount; ++readerCount) {
+        readers[readerCount].queue = &queue;
+        readers[readerCount].readerIdx = readerCount;
+        memset(&readers[readerCount].openLatency, 0, sizeof(readers[readerCount].openLatency));
+        atomic_init(&readers[readerCount].bytesRead, 0);
+        if (pthread_create(&readers[readerCount].thread, 0, readerStage, &readers[readerCount])) {
+            break;
+        }
+    }
+    if (!readerCount) {
+        perror("Cannot start reader thread");
+        return EXIT_CODE_BAD_THREAD;
+    }
+    report->maxReaderCount = readerCount;
+    publishPipeline(run->metrics, &queue, readers, readerCount);
+
+    struct PipelineController controller = { 0 };
+    controller.started = monotonicNanoseconds();
+    controller.intervalStarted = controller.started;
+    int exitCode = EXIT_CODE_OK;
+    for (int fileIdx = 0; fileIdx < fileCount; ++fileIdx) {
+        const uint64_t tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+        const uint32_t slot = tail % MAX_PIPELINE_DEPTH;
+        if (!atomic_load_explicit(&queue.ready[slot], memory_order_acquire)) {
+            const uint64_t waitStarted = monotonicNanoseconds();
+            pthread_mutex_lock(&queue.lock);
+            while (!atomic_load_explicit(&queue.ready[slot], memory_order_acquire)) {
+                pthread_cond_wait(&queue.fileReady, &queue.lock);
+            }
+            pthread_mutex_unlock(&queue.lock);
+            const uint64_t waited = monotonicNanoseconds() - waitStarted;
+            controller.intervalStarvedNanoseconds += waited;
+            report->starvedNanoseconds += waited;
+        }
+        struct MappedFile * file = &queue.files[slot];
+        int fileExitCode = file->exitCode;
+        if (!fileExitCode) {
+            controller.intervalBytes += file->length;
+            run->fileNanoseconds += file->openNanoseconds;
+            run->phaseStarted = monotonicNanoseconds();
+            fileExitCode = decodeCookiesFromMmap(run, file->filename, file->length, file->data);
+            fileExitCode = closeFile(file->fd, unmapFd(file, fileExitCode));
+            recordPhase(run, LATENCY_PHASE_WALK);
+        }
+        runFinishFile(run, file->filename, fileExitCode);
+        exitCode = exitCode ? exitCode : fileExitCode;
+        pthread_mutex_lock(&queue.lock);
+        atomic_store(&queue.ready[slot], 0);
+        atomic_store(&queue.tail, tail + 1);
+        pthread_cond_broadcast(&queue.fileTaken);
+        pthread_mutex_unlock(&queue.lock);
+        adjustPipeline(&queue, &controller, report);
+        throttleCpu(run->throttle);
+        if (latencyDumpRequested) {
+            latencyDumpRequested = 0;
+            dumpLatency(run, readers, readerCount);
+        }
+        refreshMetrics(run->metrics);
+    }
+    // Readers left waiting have to see that everything's been claimed
+    wakeAllReaders(&queue);
+    for (uint32_t readerIdx = 0; readerIdx < readerCount; ++readerIdx) {
+        pthread_join(readers[readerIdx].thread, 0);
+    }
+    retirePipeline(run, readers, readerCount);
+    report->readerCount = atomic_load(&queue.readerCount);
+    report->depth = atomic_load(&queue.depth);
+    return exitCode;
+}
+
+// --watch keeps running, and tells subscribers on a Unix socket how the cookies in the watched files change
+// as they're rewritten. Files are polled with stat, and a rewrite is diffed a page at a time against the last
+// good version. A page which is byte for byte the same as one of the old pages, found by size and checksum and
+// then compared, holds the same cookies, so only the pages which changed are decoded, and diffed by key as
+// --diff does. Each event is formatted once, and written to every subscriber whose filter it matches, so more
+// subscribers cost no more decoding. A bad version is reported and ignored, keeping the last good one, and the
+// first is only good once all of it has decoded, so each later good version has decoded in full too.
+//
+// A subscriber connects, and sends one line of any of --domain DOMAIN, --name NAME and --unexpired, which
+// filter as on the command line, and --snapshot, to first be sent the current cookies as added. It gets a
+// {"op":"subscribed"} line, and then a line in the diff format, plus the file, for each change.
+enum {
+    WATCH_INTERVAL_MILLISECONDS = 250,
+    MAX_SUBSCRIBER_COUNT = 256,
+    SUBSCRIPTION_SIZE = 1024,
+    // Sends never block, and what a subscriber can't take yet waits in its backlog. One which falls this far
+    // behind is dropped, rather than holding up the rest. It's enough for a snapshot of a big file.
+    MAX_SUBSCRIBER_BACKLOG_SIZE = 1 << 24,
+};
+
+struct WatchedPage {
+    const char * base;
+    uint32_t size;
+    uint32_t checkSum;
+    // Paired with a page of the other version
+    int matched;
+};
+
+struct WatchedFile {
+    const char * filename;
+    // How it looked when it was last read, to notice a rewrite
+    struct stat seen;
+    // The last good version, which is a copy, since the file may be rewritten in place. Null until there is one.
+    char * data;
+    off_t length;
+    struct WatchedPage * pages;
+    uint32_t pageCount;
+};
+
+struct Subscriber {
+    // -1 for a free slot. Slots don't move, since the filter points into the request.
+    int fd;
+    char request[SUBSCRIPTION_SIZE];
+    size_t requestLength;
+    int subscribed;
+    struct CookieFilter filter;
+    // Written but not yet sent, from backlogOffset to backlogLength
+    char * backlog;
+    size_t backlogOffset;
+    size_t backlogLength;
+    size_t backlogCapacity;
+};
+
+// Pointing into the new version's data and the diff base, so only good until they're freed
+struct WatchEvent {
+    const char * op;
+    const struct SafariCookie * old;
+    struct SafariCookie cookie;
+};
+
+struct WatchEvents {
+    struct WatchEvent * events;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+struct Watch {
+    struct Run * run;
+    struct WatchedFile * files;
+    int fileCount;
+    int listenFd;
+    struct Subscriber subscribers[MAX_SUBSCRIBER_COUNT];
+};
+
+// Set by SIGINT and SIGTERM, so the socket is cleaned up
+volatile sig_atomic_t watchStopRequested = 0;
+
+void requestWatchStop(int signal) {
+    watchStopRequested = 1;
+}
+
+// Checks the whole file's structure, as the walk does, and finds its pages, but doesn't decode any cookies
+int readCookieFileLayout(off_t length, const char * data, struct WatchedPage ** pages, uint32_t * pageCount) {
+    const char * pageSizeBase;
+    const char * pageBase;
+    int exitCode = decodeFileHeader(length, data, pageCount, &pageSizeBase, &pageBase);
+    if (exitCode) {
+        return exitCode;
+    }
+    *pages = calloc(*pageCount ? *pageCount : 1, sizeof(**pages));
+    if (!*pages) {
+        perror("Cannot watch file");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    uint32_t checkSum = 0;
+    for (uint32_t pageIdx = 0; !exitCode && pageIdx < *pageCount; ++pageIdx) {
+        struct WatchedPage * page = &(*pages)[pageIdx];
+        page->base = pageBase;
+        page->size = read32Hi(&pageSizeBase);
+        uint32_t cookieCount;
+        const char * cookieOffsetBase;
+        if (data + length - pageBase < page->size) {
+            fprintf(stderr, "File too short, incomplete page %u\n", pageIdx);
+            exitCode = EXIT_CODE_BAD_EOF;
+        } else if (!(exitCode = decodePageHeader(pageBase, pageBase + page->size, pageIdx, &cookieCount,
+            &cookieOffsetBase))) {
+            page->checkSum = kernels->pageCheckSum(pageBase, pageBase + page->size);
+            checkSum += page->checkSum;
+            pageBase += page->size;
+        }
+    }
+    if (exitCode) {
+    } else if (data + length - pageBase < sizeof(uint32_t) + sizeof(BINARY_COOKIE_FOOTER) + sizeof(uint32_t)) {
+        fprintf(stderr, "File too short, for checksum, footer, and plist size\n");
+        exitCode = EXIT_CODE_BAD_EOF;
+    } else if (read32Hi(&pageBase) != checkSum) {
+        fprintf(stderr, "Bad file checksum\n");
+        exitCode = EXIT_CODE_BAD_PARSE;
+    } else if (memcmp(pageBase, BINARY_COOKIE_FOOTER, sizeof(BINARY_COOKIE_FOOTER))) {
+        fprintf(stderr, "Bad file footer - is this a cookie file?\n");
+        exitCode = EXIT_CODE_BAD_MAGIC;
+    } else {
+        pageBase += sizeof(BINARY_COOKIE_FOOTER);
+        const uint32_t plistSize = read32Hi(&pageBase);
+        if (data + length - pageBase != plistSize) {
+            fprintf(stderr, "File length and plist data length mismatch\n");
+            exitCode = EXIT_CODE_BAD_PARSE;
+        }
+    }
+    if (exitCode) {
+        free(*pages);
+        *pages = 0;
+    }
+    return exitCode;
+}
+
+// Every cookie on the page, in a malloced array
+int decodeWatchedPage(off_t length, const char * data, const struct WatchedPage * page, uint32_t pageIdx,
+    struct SafariCookie ** cookies, uint32_t * cookieCount) {
+    const char * cookieOffsetBase;
+    int exitCode = decodePageHeader(page->base, page->base + page->size, pageIdx, cookieCount, &cookieOffsetBase);
+    *cookies = exitCode ? 0 : malloc((*cookieCount ? *cookieCount : 1) * sizeof(**cookies));
+    if (!exitCode && !*cookies) {
+        perror("Cannot decode page");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    for (uint32_t cookieIdx = 0; !exitCode && cookieIdx < *cookieCount; ++cookieIdx) {
+        exitCode = decodeCookie(length, data, page->base, page->base + page->size, read32Lo(&cookieOffsetBase),
+            pageIdx, cookieIdx, &(*cookies)[cookieIdx]);
+    }
+    if (exitCode) {
+        free(*cookies);
+        *cookies = 0;
+    }
+    return exitCode;
+}
+
+// A version is only kept once every page has decoded, since later diffs only decode the pages which changed,
+// and trust the others decoded when they were new
+int checkWatchedPages(off_t length, const char * data, const struct WatchedPage * pages, uint32_t pageCount) {
+    int exitCode = EXIT_CODE_OK;
+    for (uint32_t pageIdx = 0; !exitCode && pageIdx < pageCount; ++pageIdx) {
+        struct SafariCookie * cookies;
+        uint32_t cookieCount;
+        exitCode = decodeWatchedPage(length, data, &pages[pageIdx], pageIdx, &cookies, &cookieCount);
+        free(cookies);
+    }
+    return exitCode;
+}
+
+int addWatchEvent(struct WatchEvents * events, const char * op, const struct SafariCookie * old,
+    const struct SafariCookie * cookie) {
+    if (events->count == events->capacity) {
+        const uint64_t capacity = events->capacity ? 2 * events->capacity : 256;
+        struct WatchEvent * grown = realloc(events->events, capacity * sizeof(*grown));
+        if (!grown) {
+            perror("Cannot diff file");
+            return 0;
+        }
+        events->events = grown;
+        events->capacity = capacity;
+    }
+    events->events[events->count++] = (struct WatchEvent){ op, old, *cookie };
+    return 1;
+}
+
+uint64_t hashWatchedPage(const struct WatchedPage * page) {
+    return ((uint64_t)page->checkSum << 32 | page->size) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Pairs each new page with an unpaired old page holding the same bytes, if there is one. The old pages are
+// hashed by checksum and size, with open addressing at under half full, so pairing is linear in pages. Equal
+// keys sit in the same run of slots, and a page is only paired after comparing it with memcmp.
+int pairWatchedPages(struct Run * run, struct WatchedPage * oldPages, uint32_t oldPageCount,
+    struct WatchedPage * pages, uint32_t pageCount) {
+    uint64_t capacity = 16;
+    while (capacity < 2 * (uint64_t)oldPageCount + 1) {
+        capacity *= 2;
+    }
+    uint32_t * slots = malloc(capacity * sizeof(*slots));
+    if (!slots) {
+        perror("Cannot diff file");
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    memset(slots, 0xFF, capacity * sizeof(*slots));
+    for (uint32_t oldIdx = 0; oldIdx < oldPageCount; ++oldIdx) {
+        oldPages[oldIdx].matched = 0;
+        uint64_t slot = hashWatchedPage(&oldPages[oldIdx]) & (capacity - 1);
+        while (UINT32_MAX != slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = oldIdx;
+    }
+    for (uint32_t pageIdx = 0; pageIdx < pageCount; ++pageIdx) {
+        struct WatchedPage * page = &pages[pageIdx];
+        for (uint64_t slot = hashWatchedPage(page) & (capacity - 1); !page->matched && UINT32_MAX != slots[slot];
+            slot = (slot + 1) & (capacity - 1)) {
+            struct WatchedPage * old = &oldPages[slots[slot]];
+            if (!old->matched && old->size == page->size && old->checkSum == page->checkSum
+                && !memcmp(old->base, page->base, page->size)) {
+                old->matched = 1;
+                page->matched = 1;
+            }
+        }
+        addRelaxed(page->matched ? &run->reusedPageCount : &run->decodedPageCount, 1);
+    }
+    free(slots);
+    return EXIT_CODE_OK;
+}
+
+// Diffs a good new version against the last one. Sets lastFailed if it was the last version which couldn't
+// be decoded.
+int diffWatchedFile(struct Run * run, struct WatchedFile * file, off_t length, const char * data,
+    struct WatchedPage * pages, uint32_t pageCount, struct DiffBase * base, struct WatchEvents * events,
+    int * lastFailed) {
+    int exitCode = pairWatchedPages(run, file->pages, file->pageCount, pages, pageCount);
+    if (exitCode) {
+        return exitCode;
+    }
+
+    // What was on the old pages which went, against what's on the new pages which came
+    struct SafariCookie * cookies;
+    uint32_t cookieCount;
+    for (uint32_t oldIdx = 0; !exitCode && oldIdx < file->pageCount; ++oldIdx) {
+        if (file->pages[oldIdx].matched) {
+            continue;
+        }
+        exitCode = decodeWatchedPage(file->length, file->data, &file->pages[oldIdx], oldIdx, &cookies, &cookieCount);
+        *lastFailed = !!exitCode;
+        for (uint32_t cookieIdx = 0; !exitCode && cookieIdx < cookieCount; ++cookieIdx) {
+            if (!insertDiffEntry(base, &cookies[cookieIdx])) {
+                perror("Cannot diff file");
+                exitCode = EXIT_CODE_BAD_OUTPUT;
+            }
+        }
+        free(cookies);
+    }
+    for (uint32_t pageIdx = 0; !exitCode && pageIdx < pageCount; ++pageIdx) {
+        if (pages[pageIdx].matched) {
+            continue;
+        }
+        exitCode = decodeWatchedPage(length, data, &pages[pageIdx], pageIdx, &cookies, &cookieCount);
+        for (uint32_t cookieIdx = 0; !exitCode && cookieIdx < cookieCount; ++cookieIdx) {
+            struct DiffEntry * entry = findDiffEntry(base, &cookies[cookieIdx]);
+            if (!entry) {
+                exitCode = addWatchEvent(events, "added", 0, &cookies[cookieIdx]) ? exitCode : EXIT_CODE_BAD_OUTPUT;
+            } else {
+                entry->seen = 1;
+                if (!cookiesEqual(&entry->cookie, &cookies[cookieIdx])) {
+                    exitCode = addWatchEvent(events, "changed", &entry->cookie, &cookies[cookieIdx])
+                        ? exitCode : EXIT_CODE_BAD_OUTPUT;
+                }
+            }
+        }
+        free(cookies);
+    }
+    for (uint64_t entryIdx = 0; !exitCode && entryIdx < base->count; ++entryIdx) {
+        if (!base->entries[entryIdx].seen && !addWatchEvent(events, "removed", 0, &base->entries[entryIdx].cookie)) {
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+        }
+    }
+    return exitCode;
+}
+
+int watchEventMatches(const struct CookieFilter * filter, const struct WatchEvent * event) {
+    return cookieMatchesFilter(filter, &event->cookie) || (event->old && cookieMatchesFilter(filter, event->old));
+}
+
+void dropSubscriber(struct Watch * watch, struct Subscriber * subscriber) {
+    close(subscriber->fd);
+    subscriber->fd = -1;
+    free(subscriber->backlog);
+    subscriber->backlog = 0;
+    if (subscriber->subscribed) {
+        atomic_fetch_sub(&watch->run->subscriberCount, 1);
+    }
+}
+
+// Sends as much of the backlog as the socket will take now. Returns zero if the subscriber has gone.
+int flushSubscriber(struct Subscriber * subscriber) {
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (subscriber->backlogOffset < subscriber->backlogLength) {
+        const ssize_t sent = send(subscriber->fd, subscriber->backlog + subscriber->backlogOffset,
+            subscriber->backlogLength - subscriber->backlogOffset, flags);
+        if (sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+            return 1;
+        } else if (sent <= 0) {
+            return 0;
+        }
+        subscriber->backlogOffset += sent;
+    }
+    subscriber->backlogOffset = 0;
+    subscriber->backlogLength = 0;
+    return 1;
+}
+
+// Queues data behind whatever the subscriber hasn't taken yet, and sends what it can. Returns zero if the
+// subscriber has gone, or is too far behind to keep.
+int sendToSubscriber(struct Subscriber * subscriber, const char * data, size_t length) {
+    if (subscriber->backlogOffset) {
+        memmove(subscriber->backlog, subscriber->backlog + subscriber->backlogOffset,
+            subscriber->backlogLength - subscriber->backlogOffset);
+        subscriber->backlogLength -= subscriber->backlogOffset;
+        subscriber->backlogOffset = 0;
+    }
+    if (MAX_SUBSCRIBER_BACKLOG_SIZE - subscriber->backlogLength < length) {
+        return 0;
+    } else if (subscriber->backlogCapacity - subscriber->backlogLength < length) {
+        size_t capacity = subscriber->backlogCapacity ? subscriber->backlogCapacity : 1 << 16;
+        while (capacity - subscriber->backlogLength < length) {
+            capacity *= 2;
+        }
+        char * backlog = realloc(subscriber->backlog, capacity);
+        if (!backlog) {
+            return 0;
+        }
+        subscriber->backlog = backlog;
+        subscriber->backlogCapacity = capacity;
+    }
+    memcpy(subscriber->backlog + subscriber->backlogLength, data, length);
+    subscriber->backlogLength += length;
+    return flushSubscriber(subscriber);
+}
+
+// --unexpired means unexpired now, not when subscribed, so the cutoff moves on with each batch of events
+void refreshExpiryCutoff(struct CookieFilter * filter) {
+    if (filter->hasMinExpiry) {
+        filter->minExpiry = time(0) - MAC_EPOCH_UNIX_SECONDS;
+    }
+}
+
+// Formats each event once, then writes each subscriber the ones it matches, or just the one subscriber
+void publishWatchEvents(struct Watch * watch, const char * filename, const struct WatchEvents * events,
+    struct Subscriber * only) {
+    if (!events->count) {
+        return;
+    }
+    char * text = 0;
+    size_t size = 0;
+    long * ends = malloc(events->count * sizeof(*ends));
+    FILE * out = ends ? open_memstream(&text, &size) : 0;
+    if (!out) {
+        perror("Cannot format events");
+        free(ends);
+        return;
+    }
+    for (uint64_t eventIdx = 0; eventIdx < events->count; ++eventIdx) {
+        const struct WatchEvent * event = &events->events[eventIdx];
+        emitJsonDiff(out, filename, event->op, event->old, &event->cookie, 0);
+        ends[eventIdx] = ftell(out);
+    }
+    if (fclose(out)) {
+        perror("Cannot format events");
+    } else {
+        refreshExpiryCutoff(&watch->run->filter);
+        for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+            struct Subscriber * subscriber = &watch->subscribers[subscriberIdx];
+            if (-1 == subscriber->fd || !subscriber->subscribed || (only && only != subscriber)) {
+                continue;
+            }
+            refreshExpiryCutoff(&subscriber->filter);
+            // Runs of matching events are queued together
+            long start = 0;
+            long end = 0;
+            int sent = 1;
+            for (uint64_t eventIdx = 0; sent && eventIdx < events->count; ++eventIdx) {
+                const struct WatchEvent * event = &events->events[eventIdx];
+                if (!watchEventMatches(&watch->run->filter, event) || !watchEventMatches(&subscriber->filter, event)) {
+                    sent = start == end || sendToSubscriber(subscriber, text + start, end - start);
+                    start = ends[eventIdx];
+                }
+                end = ends[eventIdx];
+            }
+            if (!sent || (start != end && !sendToSubscriber(subscriber, text + start, end - start))) {
+                fprintf(stderr, "Dropping a subscriber which has gone, or fallen too far behind\n");
+                dropSubscriber(watch, subscriber);
+            }
+        }
+    }
+    if (!only) {
+        addRelaxed(&watch->run->eventCount, events->count);
+    }
+    free(text);
+    free(ends);
+}
+
+// Every cookie in the file's last good version, as added, for one subscriber or all of them. Events copy the
+// cookies, which point into the file's data, so each page's array can go as soon as it's added.
+void publishWatchedFile(struct Watch * watch, const struct WatchedFile * file, struct Subscriber * only) {
+    struct WatchEvents events = { 0 };
+    int exitCode = EXIT_CODE_OK;
+    for (uint32_t pageIdx = 0; !exitCode && pageIdx < file->pageCount; ++pageIdx) {
+        struct SafariCookie * cookies;
+        uint32_t cookieCount;
+        exitCode = decodeWatchedPage(file->length, file->data, &file->pages[pageIdx], pageIdx, &cookies,
+            &cookieCount);
+        for (uint32_t cookieIdx = 0; !exitCode && cookieIdx < cookieCount; ++cookieIdx) {
+            exitCode = addWatchEvent(&events, "added", 0, &cookies[cookieIdx]) ? exitCode : EXIT_CODE_BAD_OUTPUT;
+        }
+        free(cookies);
+    }
+    if (!exitCode) {
+        publishWatchEvents(watch, file->filename, &events, only);
+    }
+    free(events.events);
+}
+
+void sendWatchSnapshot(struct Watch * watch, struct Subscriber * subscriber) {
+    for (int fileIdx = 0; -1 != subscriber->fd && fileIdx < watch->fileCount; ++fileIdx) {
+        publishWatchedFile(watch, &watch->files[fileIdx], subscriber);
+    }
+}
+
+// When the last version can't be diffed against, subscribers are told to forget the file's cookies, and then
+// sent all of the new version as added
+void resetWatchedFile(struct Watch * watch, const struct WatchedFile * file) {
+    char * text = 0;
+    size_t size = 0;
+    FILE * out = open_memstream(&text, &size);
+    if (!out) {
+        perror("Cannot format events");
+        return;
+    }
+    emitJsonBeginObject(out);
+    emitJsonString(out, "file");
+    emitJsonNameSeparator(out);
+    emitJsonString(out, file->filename);
+    emitJsonValueSeparator(out);
+    emitJsonString(out, "op");
+    emitJsonNameSeparator(out);
+    emitJsonString(out, "reset");
+    emitJsonEndObject(out);
+    putc('\n', out);
+    if (fclose(out)) {
+        perror("Cannot format events");
+        free(text);
+        return;
+    }
+    for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+        struct Subscriber * subscriber = &watch->subscribers[subscriberIdx];
+        if (-1 != subscriber->fd && subscriber->subscribed && !sendToSubscriber(subscriber, text, size)) {
+            fprintf(stderr, "Dropping a subscriber which has gone, or fallen too far behind\n");
+            dropSubscriber(watch, subscriber);
+        }
+    }
+    free(text);
+    publishWatchedFile(watch, file, 0);
+}
+
+void acceptSubscriber(struct Watch * watch) {
+    const int fd = accept(watch->listenFd, 0, 0);
+    if (-1 == fd) {
+        return;
+    }
+    for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+        struct Subscriber * subscriber = &watch->subscribers[subscriberIdx];
+        if (-1 == subscriber->fd) {
+            memset(subscriber, 0, sizeof(*subscriber));
+            subscriber->fd = fd;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+            const int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            return;
+        }
+    }
+    fprintf(stderr, "Too many subscribers, refusing another\n");
+    close(fd);
+}
+
+// Called when the subscriber has something to read. Until the subscription line is complete that's more of it,
+// and after, anything is ignored, except the end, which drops the subscriber.
+void readSubscription(struct Watch * watch, struct Subscriber * subscriber) {
+    static const char SUBSCRIBED[] = "{\"op\":\"subscribed\"}\n";
+    static const char REFUSED[] = "{\"op\":\"error\",\"message\":\"Bad subscription\"}\n";
+    char discard[SUBSCRIPTION_SIZE];
+    const ssize_t got = subscriber->subscribed ? recv(subscriber->fd, discard, sizeof(discard), 0)
+        : recv(subscriber->fd, subscriber->request + subscriber->requestLength,
+            sizeof(subscriber->request) - 1 - subscriber->requestLength, 0);
+    if (got <= 0) {
+        if (got || (EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno)) {
+            dropSubscriber(watch, subscriber);
+        }
+        return;
+    } else if (subscriber->subscribed) {
+        return;
+    }
+    subscriber->requestLength += got;
+    subscriber->request[subscriber->requestLength] = 0;
+    char * end = strchr(subscriber->request, '\n');
+    if (!end) {
+        if (subscriber->requestLength == sizeof(subscriber->request) - 1) {
+            sendToSubscriber(subscriber, REFUSED, strlen(REFUSED));
+            dropSubscriber(watch, subscriber);
+        }
+        return;
+    }
+    *end = 0;
+    struct CookieFilter * filter = &subscriber->filter;
+    int snapshot = 0;
+    int refused = 0;
+    char * position;
+    for (char * word = strtok_r(subscriber->request, " \t\r", &position); !refused && word;
+        word = strtok_r(0, " \t\r", &position)) {
+        if (!strcmp(word, "--domain")) {
+            refused = !(filter->domain = strtok_r(0, " \t\r", &position));
+        } else if (!strcmp(word, "--name")) {
+            refused = !(filter->name = strtok_r(0, " \t\r", &position));
+        } else if (!strcmp(word, "--unexpired")) {
+            filter->hasMinExpiry = 1;
+            filter->keepsSessions = 1;
+        } else if (!strcmp(word, "--snapshot")) {
+            snapshot = 1;
+        } else {
+            refused = 1;
+        }
+    }
+    if (refused) {
+        // The refusal is best effort, since the subscriber goes either way
+        sendToSubscriber(subscriber, REFUSED, strlen(REFUSED));
+        dropSubscriber(watch, subscriber);
+        return;
+    }
+    subscriber->subscribed = 1;
+    atomic_fetch_add(&watch->run->subscriberCount, 1);
+    if (!sendToSubscriber(subscriber, SUBSCRIBED, strlen(SUBSCRIBED))) {
+        dropSubscriber(watch, subscriber);
+    } else if (snapshot) {
+        sendWatchSnapshot(watch, subscriber);
+    }
+}
+
+int sameVersion(const struct stat * left, const struct stat * right) {
+#ifdef __APPLE__
+    const struct timespec * leftModified = &left->st_mtimespec;
+    const struct timespec * rightModified = &right->st_mtimespec;
+#else
+    const struct timespec * leftModified = &left->st_mtim;
+    const struct timespec * rightModified = &right->st_mtim;
+#endif
+    return left->st_dev == right->st_dev && left->st_ino == right->st_ino && left->st_size == right->st_size
+        && leftModified->tv_sec == rightModified->tv_sec && leftModified->tv_nsec == rightModified->tv_nsec;
+}
+
+// Reads the file again if it's changed, and unless it's the first read, diffs it and publishes the changes.
+// While a file is missing, as it may be briefly while it's replaced, the last good version stands.
+void reloadWatchedFile(struct Watch * watch, struct WatchedFile * file, int publish) {
+    struct stat statResult;
+    if (stat(file->filename, &statResult) || sameVersion(&statResult, &file->seen)) {
+        return;
+    }
+    file->seen = statResult;
+    const uint64_t started = monotonicNanoseconds();
+    struct MappedFile mapped = { .filename = file->filename, .fd = open(file->filename, O_RDONLY) };
+    if (-1 == mapped.fd) {
+        perror("Cannot open file");
+        return;
+    }
+    char * data = 0;
+    int exitCode = mapFd(&mapped);
+    if (!exitCode) {
+        data = malloc(mapped.length ? mapped.length : 1);
+        if (data) {
+            memcpy(data, mapped.data, mapped.length);
+        } else {
+            perror("Cannot watch file");
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+        }
+        exitCode = unmapFd(&mapped, exitCode);
+    }
+    exitCode = closeFile(mapped.fd, exitCode);
+    struct WatchedPage * pages = 0;
+    uint32_t pageCount = 0;
+    if (!exitCode) {
+        exitCode = readCookieFileLayout(mapped.length, data, &pages, &pageCount);
+    }
+    int reset = 0;
+    if (!exitCode && !publish) {
+        exitCode = checkWatchedPages(mapped.length, data, pages, pageCount);
+    } else if (!exitCode) {
+        struct DiffBase base = { 0 };
+        struct WatchEvents events = { 0 };
+        int lastFailed = 0;
+        exitCode = diffWatchedFile(watch->run, file, mapped.length, data, pages, pageCount, &base, &events,
+            &lastFailed);
+        if (!exitCode) {
+            publishWatchEvents(watch, file->filename, &events, 0);
+            addRelaxed(&watch->run->rewriteCount, 1);
+        } else if (lastFailed && !(exitCode = checkWatchedPages(mapped.length, data, pages, pageCount))) {
+            fprintf(stderr, "Cannot diff against the last version of %s, sending this one whole\n", file->filename);
+            reset = 1;
+            addRelaxed(&watch->run->rewriteCount, 1);
+        }
+        free(events.events);
+        freeDiffBase(&base);
+    }
+    if (exitCode) {
+        fprintf(stderr, "Keeping the last good version of %s\n", file->filename);
+        free(data);
+        free(pages);
+    } else {
+        free(file->data);
+        free(file->pages);
+        file->data = data;
+        file->length = mapped.length;
+        file->pages = pages;
+        file->pageCount = pageCount;
+        if (reset) {
+            resetWatchedFile(watch, file);
+        }
+    }
+    recordLatency(&watch->run->latency.phases[LATENCY_PHASE_FILE], monotonicNanoseconds() - started);
+    addRelaxed(&watch->run->fileCount, 1);
+    addRelaxed(&watch->run->failedFileCount, !!exitCode);
+    addRelaxed(&watch->run->bytesRead, mapped.length);
+}
+
+// Runs until SIGINT or SIGTERM
+int watchFiles(struct Run * run, const char * socketPath, const char * const * filenames, int fileCount) {
+    struct Watch * watch = calloc(1, sizeof(*watch));
+    struct WatchedFile * files = watch ? calloc(fileCount, sizeof(*files)) : 0;
+    if (!files) {
+        perror("Cannot watch files");
+        free(watch);
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    watch->run = run;
+    watch->files = files;
+    watch->fileCount = fileCount;
+    for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+        watch->subscribers[subscriberIdx].fd = -1;
+    }
+    for (int fileIdx = 0; fileIdx < fileCount; ++fileIdx) {
+        files[fileIdx].filename = filenames[fileIdx];
+        reloadWatchedFile(watch, &files[fileIdx], 0);
+    }
+    atomic_store(&run->watchedFileCount, fileCount);
+    watch->listenFd = listenUnixSocket(socketPath);
+    if (-1 == watch->listenFd) {
+        free(files);
+        free(watch);
+        return EXIT_CODE_BAD_OUTPUT;
+    }
+    // Without SA_RESTART, so poll returns
+    struct sigaction stopAction = { .sa_handler = requestWatchStop };
+    sigemptyset(&stopAction.sa_mask);
+    sigaction(SIGINT, &stopAction, 0);
+    sigaction(SIGTERM, &stopAction, 0);
+
+    uint64_t checked = monotonicNanoseconds();
+    while (!watchStopRequested) {
+        struct pollfd fds[1 + MAX_SUBSCRIBER_COUNT] = { { .fd = watch->listenFd, .events = POLLIN } };
+        int subscriberIdxs[1 + MAX_SUBSCRIBER_COUNT];
+        int fdCount = 1;
+        for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+            const struct Subscriber * subscriber = &watch->subscribers[subscriberIdx];
+            if (-1 != subscriber->fd) {
+                fds[fdCount] = (struct pollfd){ .fd = subscriber->fd,
+                    .events = POLLIN | (subscriber->backlogLength ? POLLOUT : 0) };
+                subscriberIdxs[fdCount++] = subscriberIdx;
+            }
+        }
+        const uint64_t elapsed = (monotonicNanoseconds() - checked) / 1000000;
+        if (0 < poll(fds, fdCount, elapsed < WATCH_INTERVAL_MILLISECONDS ? WATCH_INTERVAL_MILLISECONDS - elapsed : 0)) {
+            for (int fdIdx = 1; fdIdx < fdCount; ++fdIdx) {
+                struct Subscriber * subscriber = &watch->subscribers[subscriberIdxs[fdIdx]];
+                if ((fds[fdIdx].revents & POLLOUT) && !flushSubscriber(subscriber)) {
+                    dropSubscriber(watch, subscriber);
+                }
+                if (-1 != subscriber->fd && (fds[fdIdx].revents & ~POLLOUT)) {
+                    readSubscription(watch, subscriber);
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                acceptSubscriber(watch);
+            }
+        }
+        if (WATCH_INTERVAL_MILLISECONDS * 1000000ULL <= monotonicNanoseconds() - checked) {
+            checked = monotonicNanoseconds();
+            for (int fileIdx = 0; fileIdx < fileCount; ++fileIdx) {
+                reloadWatchedFile(watch, &files[fileIdx], 1);
+            }
+            refreshMetrics(run->metrics);
+        }
+        if (latencyDumpRequested) {
+            latencyDumpRequested = 0;
+            dumpLatency(run, 0, 0);
+        }
+    }
+
+    for (int subscriberIdx = 0; subscriberIdx < MAX_SUBSCRIBER_COUNT; ++subscriberIdx) {
+        if (-1 != watch->subscribers[subscriberIdx].fd) {
+            dropSubscriber(watch, &watch->subscribers[subscriberIdx]);
+        }
+    }
+    close(watch->listenFd);
+    unlink(socketPath);
+    for (int fileIdx = 0; fileIdx < fileCount; ++fileIdx) {
+        free(files[fileIdx].data);
+        free(files[fileIdx].pages);
+    }
+    free(files);
+    free(watch);
+    return EXIT_CODE_OK;
+}
+
+// For archives too big for one host, --manifest N splits the input files into N partitions of about the
+// same weight, which hosts can then each run with --partition, and --merge puts their outputs back together.
+// A file's weight is its size, rounded up to a 4KiB page, since that's the least a read costs. Files are taken
+// heaviest first, each going to the lightest partition so far, which is within a third of the best split. Ties
+// are broken by path and partition number, so the same files always give the same manifest, wherever it's run.
+enum {
+    MANIFEST_PAGE_SIZE = 4096,
+    MAX_PARTITION_COUNT = 1 << 16,
+};
+
+struct ManifestFile {
+    char * path;
+    uint64_t size;
+    uint64_t weight;
+    uint32_t partition;
+};
+
+struct Manifest {
+    struct ManifestFile * files;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+int addManifestFile(struct Manifest * manifest, const char * path, uint64_t size) {
+    if (strchr(path, '\n')) {
+        fprintf(stderr, "Cannot put %s in a manifest, it has a line break\n", path);
+        return EXIT_CODE_BAD_MANIFEST;
+    }
+    if (manifest->count == manifest->capacity) {
+        const uint64_t capacity = manifest->capacity ? 2 * manifest->capacity : 1024;
+        struct ManifestFile * files = realloc(manifest->files, capacity * sizeof(*files));
+        if (!files) {
+            perror("Cannot scan files");
+            return EXIT_CODE_BAD_MANIFEST;
+        }
+        manifest->files = files;
+        manifest->capacity = capacity;
+    }
+    struct ManifestFile * file = &manifest->files[manifest->count];
+    if (!(file->path = strdup(path))) {
+        perror("Cannot scan files");
+        return EXIT_CODE_BAD_MANIFEST;
+    }
+    file->size = size;
+    file->weight = (size + MANIFEST_PAGE_SIZE - 1) / MANIFEST_PAGE_SIZE * MANIFEST_PAGE_SIZE;
+    file->partition = 0;
+    ++manifest->count;
+    return EXIT_CODE_OK;
+}
+
+// Files, and everything under directories. Symlinks are followed to files, but not to directories, so there
+// are no loops.
+int scanManifestInput(struct Manifest * manifest, const char * path, int followDirectory) {
+    struct stat statResult;
+    if (stat(path, &statResult)) {
+        fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+        return EXIT_CODE_BAD_STAT;
+    } else if (S_ISREG(statResult.st_mode)) {
+        return addManifestFile(manifest, path, statResult.st_size);
+    } else if (!S_ISDIR(statResult.st_mode) || (!followDirectory && (lstat(path, &statResult)
+        || !S_ISDIR(statResult.st_mode)))) {
+        return EXIT_CODE_OK;
+    }
+    DIR * directory = opendir(path);
+    if (!directory) {
+        fprintf(stderr, "Cannot scan %s: %s\n", path, strerror(errno));
+        return EXIT_CODE_BAD_OPEN;
+    }
+    int exitCode = EXIT_CODE_OK;
+    for (struct dirent * entry = readdir(directory); !exitCode && entry; entry = readdir(directory)) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        char * child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (!child) {
+            perror("Cannot scan files");
+            exitCode = EXIT_CODE_BAD_MANIFEST;
+            break;
+        }
+        sprintf(child, "%s%s%s", path, '/' == path[strlen(path) - 1] ? "" : "/", entry->d_name);
+        exitCode = scanManifestInput(manifest, child, 0);
+        free(child);
+    }
+    closedir(directory);
+    return exitCode;
+}
+
+int compareManifestFilesByWeight(const void * left, const void * right) {
+    const struct ManifestFile * leftFile = left;
+    const struct ManifestFile * rightFile = right;
+    if (leftFile->weight != rightFile->weight) {
+        return leftFile->weight < rightFile->weight ? 1 : -1;
+    }
+    return strcmp(leftFile->path, rightFile->path);
+}
+
+int compareManifestFilesByPartition(const void * left, const void * right) {
+    const struct ManifestFile * leftFile = left;
+    const struct ManifestFile * rightFile = right;
+    if (leftFile->partition != rightFile->partition) {
+        return leftFile->partition < rightFile->partition ? -1 : 1;
+    }
+    return strcmp(leftFile->path, rightFile->path);
+}
+
+// The partitions as a min heap on weight and then number, so the lightest is always at the root
+struct PartitionLoad {
+    uint64_t weight;
+    uint64_t size;
+    uint64_t fileCount;
+    uint32_t partition;
+};
+
+int partitionLoadLess(const struct PartitionLoad * left, const struct PartitionLoad * right) {
+    return left->weight != right->weight ? left->weight < right->weight : left->partition < right->partition;
+}
+
+// Only the root ever gets heavier, so it only ever has to move down
+void siftPartitionLoad(struct PartitionLoad * loads, uint32_t count) {
+    uint32_t parent = 0;
+    for (;;) {
+        uint32_t least = parent;
+        const uint32_t left = 2 * parent + 1;
+        const uint32_t right = left + 1;
+        if (left < count && partitionLoadLess(&loads[left], &loads[least])) {
+            least = left;
+        }
+        if (right < count && partitionLoadLess(&loads[right], &loads[least])) {
+            least = right;
+        }
+        if (least == parent) {
+            return;
+        }
+        const struct PartitionLoad swap = loads[parent];
+        loads[parent] = loads[least];
+        loads[least] = swap;
+        parent = least;
+    }
+}
+
+// Writes the manifest to stdout, as PARTITION, BYTES and PATH separated by tabs, a line per file, grouped by
+// partition and in path order within each. Comment lines give each partition's totals.
+int writeManifest(const char * const * inputs, int inputCount, uint32_t partitionCount) {
+    struct Manifest manifest = { 0 };
+    int exitCode = EXIT_CODE_OK;
+    for (int inputIdx = 0; !exitCode && inputIdx < inputCount; ++inputIdx) {
+        exitCode = scanManifestInput(&manifest, inputs[inputIdx], 1);
+    }
+    struct PartitionLoad * loads = exitCode ? 0 : calloc(partitionCount, sizeof(*loads));
+    if (!exitCode && !loads) {
+        perror("Cannot partition files");
+        exitCode = EXIT_CODE_BAD_MANIFEST;
+    }
+    if (!exitCode) {
+        // All zero, so already a heap in number order
+        for (uint32_t partition = 0; partition < partitionCount; ++partition) {
+            loads[partition].partition = partition;
+        }
+        qsort(manifest.files, manifest.count, sizeof(*manifest.files), compareManifestFilesByWeight);
+        uint64_t totalSize = 0;
+        for (uint64_t fileIdx = 0; fileIdx < manifest.count; ++fileIdx) {
+            manifest.files[fileIdx].partition = loads[0].partition;
+            loads[0].weight += manifest.files[fileIdx].weight;
+            loads[0].size += manifest.files[fileIdx].size;
+            ++loads[0].fileCount;
+            totalSize += manifest.files[fileIdx].size;
+            siftPartitionLoad(loads, partitionCount);
+        }
+        qsort(manifest.files, manifest.count, sizeof(*manifest.files), compareManifestFilesByPartition);
+        printf("# safari-cookie-json manifest of %llu files, %llu bytes, in %u partitions\n",
+            (unsigned long long)manifest.count, (unsigned long long)totalSize, partitionCount);
+        // Back in number order for the totals
+        struct PartitionLoad * totals = calloc(partitionCount, sizeof(*totals));
+        for (uint32_t i = 0; totals && i < partitionCount; ++i) {
+            totals[loads[i].partition] = loads[i];
+        }
+        for (uint32_t partition = 0; totals && partition < partitionCount; ++partition) {
+            printf("# partition %u has %llu files, %llu bytes\n", partition,
+                (unsigned long long)totals[partition].fileCount, (unsigned long long)totals[partition].size);
+        }
+        free(totals);
+        for (uint64_t fileIdx = 0; fileIdx < manifest.count; ++fileIdx) {
+            printf("%u\t%llu\t%s\n", manifest.files[fileIdx].partition,
+                (unsigned long long)manifest.files[fileIdx].size, manifest.files[fileIdx].path);
+        }
+        if (fflush(stdout)) {
+            perror("Cannot write manifest");
+            exitCode = EXIT_CODE_BAD_OUTPUT;
+        }
+    }
+    for (uint64_t fileIdx = 0; fileIdx < manifest.count; ++fileIdx) {
+        free(manifest.files[fileIdx].path);
+    }
+    free(manifest.files);
+    free(loads);
+    return exitCode;
+}
+
+// The paths in the partition, in manifest order, as a malloced array of malloced strings
+int readManifestPartition(const char * manifestFilename, uint32_t partition, const char *** filenames,
+    int * fileCount) {
+    FILE * in = fopen(manifestFilename, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open manifest %s: %s\n", manifestFilename, strerror(errno));
+        return EXIT_CODE_BAD_OPEN;
+    }
+    *filenames = 0;
+    *fileCount = 0;
+    int capacity = 0;
+    int exitCode = EXIT_CODE_OK;
+    char * line = 0;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    for (unsigned long long lineIdx = 1; !exitCode && 0 < (lineLength = getline(&line, &lineCapacity, in));
+        ++lineIdx) {
+        if ('\n' == line[lineLength - 1]) {
+            line[--lineLength] = 0;
+        }
+        if (!lineLength || '#' == *line) {
+            continue;
+        }
+        char * sizeText = strchr(line, '\t');
+        char * path = sizeText ? strchr(sizeText + 1, '\t') : 0;
+        char * end;
+        const unsigned long linePartition = strtoul(line, &end, 10);
+        if (!path || end != sizeText || sizeText == line || !path[1]) {
+            fprintf(stderr, "Bad manifest line %llu in %s\n", lineIdx, manifestFilename);
+            exitCode = EXIT_CODE_BAD_MANIFEST;
+        } else if (linePartition == partition) {
+            if (*fileCount == capacity) {
+                capacity = capacity ? 2 * capacity : 1024;
+                const char ** grown = realloc(*filenames, capacity * sizeof(**filenames));
+                if (!grown) {
+                    perror("Cannot read manifest");
+                    exitCode = EXIT_CODE_BAD_MANIFEST;
+                    break;
+                }
+                *filenames = grown;
+            }
+            if (!((*filenames)[*fileCount] = strdup(path + 1))) {
+                perror("Cannot read manifest");
+                exitCode = EXIT_CODE_BAD_MANIFEST;
+            } else {
+                ++*fileCount;
+            }
+        }
+    }
+    if (!exitCode && ferror(in)) {
+        fprintf(stderr, "Cannot read manifest %s\n", manifestFilename);
+        exitCode = EXIT_CODE_BAD_MANIFEST;
+    }
+    free(line);
+    fclose(in);
+    return exitCode;
+}
+
+// How --merge combines a stats line from each partition. The partitions run side by side, so elapsed time
+// and peak memory are the slowest and biggest of them. Latency quantiles can't be merged without the
+// histograms, which stats doesn't write, so they're the largest partition's, an upper bound on the whole
+// run's, and renamed so they can't be mistaken for the real thing.
+enum StatsMerge {
+    STATS_MERGE_SUM,
+    STATS_MERGE_MAX,
+    // The max, written with STATS_QUANTILE_SUFFIX
+    STATS_MERGE_QUANTILE,
+    // Worked out again from the merged bytes and seconds
+    STATS_MERGE_RATE,
+    // Only meaningful for the one host
+    STATS_MERGE_DROP,
+};
+
+const char STATS_QUANTILE_SUFFIX[] = "MaxOfPartitions";
+
+// As in latencyWalkP99Seconds
+int isLatencyQuantile(const char * name) {
+    const size_t length = strlen(name);
+    if (strncmp(name, "latency", strlen("latency")) || length < strlen("latencyP0Seconds")
+        || strcmp(name + length - strlen("Seconds"), "Seconds")) {
+        return 0;
+    }
+    const char * cursor = name + length - strlen("Seconds");
+    const char * digitsEnd = cursor;
+    while (cursor > name && isdigit((uint8_t)cursor[-1])) {
+        --cursor;
+    }
+    return cursor < digitsEnd && 'P' == cursor[-1];
+}
+
+enum StatsMerge statsMergeFor(const char * name) {
+    static const char * const MAXIMA[] = {
+        "seconds", "maxRssBytes", "pipelineCpus", "pipelineMaxReaders", "pipelineReaders", "pipelineDepth",
+    };
+    if (!strcmp(name, "bytesPerSecond")) {
+        return STATS_MERGE_RATE;
+    } else if (!strcmp(name, "pipelineDecision")) {
+        return STATS_MERGE_DROP;
+    }
+    for (int i = 0; i < sizeof(MAXIMA) / sizeof(MAXIMA[0]); ++i) {
+        if (!strcmp(name, MAXIMA[i])) {
+            return STATS_MERGE_MAX;
+        }
+    }
+    if (isLatencyQuantile(name)) {
+        return STATS_MERGE_QUANTILE;
+    }
+    // The largest of the partitions' maxima is exactly the whole run's
+    const size_t length = strlen(name);
+    if (!strncmp(name, "latency", strlen("latency")) && strlen("MaxSeconds") < length
+        && !strcmp(name + length - strlen("MaxSeconds"), "MaxSeconds")) {
+        return STATS_MERGE_MAX;
+    }
+    return STATS_MERGE_SUM;
+}
+
+enum {
+    MAX_STATS_LINE_COUNT = 256,
+    // Including the null, and room for a STATS_QUANTILE_SUFFIX
+    MAX_STATS_NAME_LENGTH = 64,
+};
+
+struct StatsLine {
+    char name[MAX_STATS_NAME_LENGTH];
+    double value;
+    // As many as the most precise input, so counts stay integers
+    int decimals;
+};
+
+// Lines keep the order they were first seen in
+int mergeStatsFile(FILE * in, const char * filename, struct StatsLine * lines, int * lineCount) {
+    char * line = 0;
+    size_t lineCapacity = 0;
+    int exitCode = EXIT_CODE_OK;
+    while (!exitCode && 0 < getline(&line, &lineCapacity, in)) {
+        char name[MAX_STATS_NAME_LENGTH];
+        const size_t nameLength = strcspn(line, " \t\r\n");
+        // Merged outputs can be merged again, so they go by the name they had in the first place
+        size_t baseLength = nameLength;
+        if (strlen(STATS_QUANTILE_SUFFIX) < nameLength && !strncmp(line + nameLength - strlen(STATS_QUANTILE_SUFFIX),
+            STATS_QUANTILE_SUFFIX, strlen(STATS_QUANTILE_SUFFIX))) {
+            baseLength -= strlen(STATS_QUANTILE_SUFFIX);
+        }
+        if (!nameLength) {
+            continue;
+        } else if (sizeof(name) - sizeof(STATS_QUANTILE_SUFFIX) < baseLength) {
+            fprintf(stderr, "Stats name too long in %s: %.*s\n", filename, (int)nameLength, line);
+            exitCode = EXIT_CODE_BAD_MANIFEST;
+            break;
+        }
+        memcpy(name, line, baseLength);
+        name[baseLength] = 0;
+        const size_t valueOffset = nameLength + strspn(line + nameLength, " \t");
+        if (STATS_MERGE_DROP == statsMergeFor(name)) {
+            continue;
+        }
+        char * end;
+        const double value = strtod(line + valueOffset, &end);
+        if (end == line + valueOffset) {
+            fprintf(stderr, "Bad stats line in %s: %s", filename, line);
+            exitCode = EXIT_CODE_BAD_MANIFEST;
+            break;
+        }
+        const char * point = memchr(line + valueOffset, '.', end - (line + valueOffset));
+        const int decimals = point ? end - point - 1 : 0;
+        int lineIdx = 0;
+        while (lineIdx < *lineCount && strcmp(lines[lineIdx].name, name)) {
+            ++lineIdx;
+        }
+        if (lineIdx == *lineCount) {
+            if (MAX_STATS_LINE_COUNT == *lineCount) {
+                fprintf(stderr, "Too many stats lines in %s\n", filename);
+                exitCode = EXIT_CODE_BAD_MANIFEST;
+                break;
+            }
+            strcpy(lines[lineIdx].name, name);
+            lines[lineIdx].value = value;
+            lines[lineIdx].decimals = decimals;
+            ++*lineCount;
+        } else {
+            struct StatsLine * merged = &lines[lineIdx];
+            merged->value = STATS_MERGE_SUM != statsMergeFor(name) ? (value < merged->value ? merged->value : value)
+                : merged->value + value;
+            merged->decimals = merged->decimals < decimals ? decimals : merged->decimals;
+        }
+    }
+    free(line);
+    return exitCode;
+}
+
+void emitMergedStats(FILE * out, const struct StatsLine * lines, int lineCount) {
+    double fileBytes = 0;
+    double seconds = 0;
+    for (int lineIdx = 0; lineIdx < lineCount; ++lineIdx) {
+        if (!strcmp(lines[lineIdx].name, "fileBytes")) {
+            fileBytes = lines[lineIdx].value;
+        } else if (!strcmp(lines[lineIdx].name, "seconds")) {
+            seconds = lines[lineIdx].value;
+        }
+    }
+    for (int lineIdx = 0; lineIdx < lineCount; ++lineIdx) {
+        const enum StatsMerge merge = statsMergeFor(lines[lineIdx].name);
+        const double value = STATS_MERGE_RATE == merge ? (seconds > 0 ? fileBytes / seconds : 0) : lines[lineIdx].value;
+        fprintf(out, "%s%s %.*f\n", lines[lineIdx].name, STATS_MERGE_QUANTILE == merge ? STATS_QUANTILE_SUFFIX : "",
+            lines[lineIdx].decimals, value);
+    }
+}
+
+// Copies in to out, less the first line if skipHeader, returning the last character copied, or -1 for none
+int copyMergedOutput(FILE * in, FILE * out, int skipHeader) {
+    int last = -1;
+    int character;
+    while (skipHeader && EOF != (character = getc(in)) && '\n' != character) {
+    }
+    char buffer[SINK_BUFFER_SIZE];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in))) {
+        fwrite(buffer, 1, got, out);
+        last = (uint8_t)buffer[got - 1];
+    }
+    return last;
+}
+
+// Combines the outputs of partitions, in the order given, into what one run over all their files would have
+// written. Line based formats are joined, with one header for csv and tsv, and stats are added up.
+int mergeOutputs(const char * format, const char * const * filenames, int fileCount) {
+    const int stats = !strcmp(format, "stats");
+    const int csv = !strcmp(format, "csv") || !strcmp(format, "tsv");
+    if (!stats && !csv && strcmp(format, "json") && strcmp(format, "ndjson") && strcmp(format, "diff")) {
+        fprintf(stderr, "Cannot merge %s, only json, ndjson, diff, csv, tsv and stats\n", format);
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+    struct StatsLine * lines = stats ? calloc(MAX_STATS_LINE_COUNT, sizeof(*lines)) : 0;
+    if (stats && !lines) {
+        perror("Cannot merge stats");
+        return EXIT_CODE_BAD_MANIFEST;
+    }
+    int lineCount = 0;
+    int last = -1;
+    int headerWritten = 0;
+    int exitCode = EXIT_CODE_OK;
+    for (int fileIdx = 0; !exitCode && fileIdx < fileCount; ++fileIdx) {
+        FILE * in = fopen(filenames[fileIdx], "r");
+        if (!in) {
+            fprintf(stderr, "Cannot open %s: %s\n", filenames[fileIdx], strerror(errno));
+            exitCode = EXIT_CODE_BAD_OPEN;
+            break;
+        }
+        if (stats) {
+            exitCode = mergeStatsFile(in, filenames[fileIdx], lines, &lineCount);
+        } else {
+            // Several json documents go a line each, as they would from one run
+            const int first = getc(in);
+            if (EOF != first) {
+                if (-1 != last && '\n' != last) {
+                    putchar('\n');
+                }
+                ungetc(first, in);
+                const int copied = copyMergedOutput(in, stdout, csv && headerWritten);
+                last = -1 == copied ? last : copied;
+                headerWritten = 1;
+            }
+        }
+        if (ferror(in)) {
+            fprintf(stderr, "Cannot read %s\n", filenames[fileIdx]);
+            exitCode = EXIT_CODE_BAD_OPEN;
+        }
+        fclose(in);
+    }
+    if (stats && !exitCode) {
+        emitMergedStats(stdout, lines, lineCount);
+    }
+    free(lines);
+    if (fflush(stdout)) {
+        perror("Cannot write output");
+        return exitCode ? exitCode : EXIT_CODE_BAD_OUTPUT;
+    }
+    return exitCode;
+}
+
+// The SQLite extension builds all of the above in, but has no use for a command line
+#ifndef SAFARI_COOKIE_JSON_NO_MAIN
+void usage(const char * argv0) {
+    fprintf(stderr, "Usage: %s [--format FORMAT[=FILE]]... [--plugin PATH[=ARGUMENT]]... [--ring NAME[=BYTES]]...\n", argv0);
+    fprintf(stderr, "    [--pipeline] [--window BYTES] [--locators] [--utf8 pass|replace|ascii] [--plist]\n");
+    fprintf(stderr, "    [--atomic|--stream] [--sample N] [--sample-per-domain K] [--max-read-rate BYTES] [--cpu-duty FRACTION]\n");
+    fprintf(stderr, "    [--domain DOMAIN] [--name NAME] [--unexpired] [--diff OLDFILENAME] [--kernel KERNEL]\n");
+    fprintf(stderr, "    [--metrics FILE|unix:PATH] FILENAME...\n");
+    fprintf(stderr, "   or: %s [--kernel KERNEL] --kernels\n", argv0);
+    fprintf(stderr, "   or: %s [OPTIONS] --fetch FILENAME LOCATOR...\n", argv0);
+    fprintf(stderr, "   or: %s [--domain DOMAIN] [--name NAME] [--unexpired] [--metrics FILE|unix:PATH] --watch SOCKET FILENAME...\n", argv0);
+    fprintf(stderr, "   or: %s --manifest N FILENAME|DIRECTORY... > MANIFEST\n", argv0);
+    fprintf(stderr, "   or: %s [OPTIONS] --partition K MANIFEST\n", argv0);
+    fprintf(stderr, "   or: %s --merge FORMAT OUTPUT...\n", argv0);
+    fprintf(stderr, "  FORMAT is one of json, ndjson, stats, storagestate, csv, tsv, diff, and FILE defaults to stdout.\n");
+    fprintf(stderr, "  storagestate writes Playwright storageState, and a file per domain if FILE is a directory.\n");
+    fprintf(stderr, "  Every --format is written from a single parse of each FILENAME. The default is json.\n");
+    fprintf(stderr, "  --atomic only writes a file's output once it's validated, and renames output files into place.\n");
+    fprintf(stderr, "  --stream writes as it goes, and ends each file in json and ndjson with its status.\n");
+    fprintf(stderr, "  --domain, --name and --unexpired only write matching cookies, DOMAIN includes subdomains.\n");
+    fprintf(stderr, "  --diff writes the cookies added, changed and removed since OLDFILENAME, as the diff format.\n");
+    fprintf(stderr, "  --sample picks N cookies uniformly at random, and --sample-per-domain K from each domain.\n");
+    fprintf(stderr, "  --pipeline maps and reads ahead the next files on separate threads, as many as keep up.\n");
+    fprintf(stderr, "  --max-read-rate limits reading to BYTES a second, and --cpu-duty CPU time to FRACTION of the time.\n");
+    fprintf(stderr, "  stats includes latency quantiles per file, which SIGUSR1 also writes to stderr mid run.\n");
+    fprintf(stderr, "  --metrics writes Prometheus text to FILE every second, or serves it on a Unix socket at PATH.\n");
+    fprintf(stderr, "  --window bounds memory use by only keeping about BYTES of pages resident at once.\n");
+    fprintf(stderr, "  --kernel forces the scalar, swar, sse2 or avx2 string and checksum loops, --kernels lists them.\n");
+    fprintf(stderr, "  --utf8 replace substitutes U+FFFD for invalid UTF8, ascii also escapes all non ASCII.\n");
+    fprintf(stderr, "  --plist decodes the binary plist at the end of the file, with NSHTTPCookieAcceptPolicy.\n");
+    fprintf(stderr, "  --locators adds a locator to each record, which --fetch decodes without walking the file.\n");
+    fprintf(stderr, "  --watch runs until stopped, sending subscribers on SOCKET diffs of each rewrite of a FILENAME.\n");
+    fprintf(stderr, "    Subscribers send a line of --domain DOMAIN, --name NAME, --unexpired or --snapshot.\n");
+    fprintf(stderr, "  --manifest splits the files, and those under each DIRECTORY, into N partitions of equal size.\n");
+    fprintf(stderr, "  --partition runs over the files of partition K, counting from 0, in MANIFEST.\n");
+    fprintf(stderr, "  --merge combines the json, ndjson, diff, csv, tsv or stats OUTPUT of each partition.\n");
+    fprintf(stderr, "  FILENAME may also be a Firefox cookies.sqlite or Chromium Cookies SQLite store.\n");
+    fprintf(stderr, "  Plugins are shared libraries implementing safari-cookie-json-plugin.h.\n");
+    fprintf(stderr, "  Rings are POSIX shared memory for a co-located consumer, see safari-cookie-json-ring.h.\n");
+    fprintf(stderr, "  For example,\n");
+    fprintf(stderr,
+        "  %s \"${HOME}\"/Library/Containers/com.apple.Safari/Data/Library/Cookies/Cookies.binarycookies\n",
+        argv0);
+}
+
+int main(int argc, const char **argv) {
+    struct Run run = { 0 };
+    int pipelined = 0;
+    int locators = 0;
+    int fetch = 0;
+    const char * diffFilename = 0;
+    int reportKernels = 0;
+    struct Throttle throttle = { 0 };
+    const char * metricsSpec = 0;
+    const char * watchSocket = 0;
+    struct Metrics metrics = { 0 };
+    unsigned long manifestPartitionCount = 0;
+    const char * mergeFormat = 0;
+    const char * partitionManifest = 0;
+    unsigned long partition = 0;
+    selectKernels(0);
+    int argIdx = 1;
+    while (argIdx < argc && '-' == argv[argIdx][0]) {
+        if (!strcmp(argv[argIdx], "--format") && argIdx + 1 < argc && run.sinkCount < MAX_SINK_COUNT) {
+            const int exitCode = openSink(&run.sinks[run.sinkCount], argv[argIdx + 1]);
+            if (exitCode) {
+                return exitCode;
+            }
+            ++run.sinkCount;
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--locators")) {
+            locators = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--fetch")) {
+            fetch = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--window") && argIdx + 1 < argc) {
+            run.windowSize = strtoll(argv[argIdx + 1], 0, 0);
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--utf8") && argIdx + 1 < argc) {
+            if (!strcmp(argv[argIdx + 1], "pass")) {
+                utf8Mode = UTF8_MODE_PASS;
+            } else if (!strcmp(argv[argIdx + 1], "replace")) {
+                utf8Mode = UTF8_MODE_REPLACE;
+            } else if (!strcmp(argv[argIdx + 1], "ascii")) {
+                utf8Mode = UTF8_MODE_ASCII;
+            } else {
+                usage(*argv);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--plist")) {
+            run.plist = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--diff") && argIdx + 1 < argc) {
+            diffFilename = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--domain") && argIdx + 1 < argc) {
+            run.filter.domain = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--name") && argIdx + 1 < argc) {
+            run.filter.name = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--unexpired")) {
+            run.filter.hasMinExpiry = 1;
+            run.filter.minExpiry = time(0) - MAC_EPOCH_UNIX_SECONDS;
+            run.filter.keepsSessions = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--sample") && argIdx + 1 < argc) {
+            run.sampleSize = strtoull(argv[argIdx + 1], 0, 0);
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--sample-per-domain") && argIdx + 1 < argc) {
+            run.samplePerDomain = strtoull(argv[argIdx + 1], 0, 0);
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--atomic")) {
+            run.outputMode = OUTPUT_MODE_ATOMIC;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--stream")) {
+            run.outputMode = OUTPUT_MODE_STREAM;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--pipeline")) {
+            pipelined = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--max-read-rate") && argIdx + 1 < argc) {
+            throttle.readRate = strtod(argv[argIdx + 1], 0);
+            run.throttle = &throttle;
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--cpu-duty") && argIdx + 1 < argc) {
+            throttle.cpuDuty = strtod(argv[argIdx + 1], 0);
+            if (!(0 < throttle.cpuDuty && throttle.cpuDuty <= 1)) {
+                usage(*argv);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            run.throttle = &throttle;
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--watch") && argIdx + 1 < argc) {
+            watchSocket = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--metrics") && argIdx + 1 < argc) {
+            metricsSpec = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--kernel") && argIdx + 1 < argc) {
+            if (!selectKernels(argv[argIdx + 1])) {
+                fprintf(stderr, "No %s kernels for this CPU\n", argv[argIdx + 1]);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--manifest") && argIdx + 1 < argc) {
+            manifestPartitionCount = strtoul(argv[argIdx + 1], 0, 0);
+            if (!manifestPartitionCount || MAX_PARTITION_COUNT < manifestPartitionCount) {
+                usage(*argv);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--partition") && argIdx + 2 < argc) {
+            char * end;
+            partition = strtoul(argv[argIdx + 1], &end, 0);
+            if (end == argv[argIdx + 1] || *end || MAX_PARTITION_COUNT <= partition) {
+                usage(*argv);
+                return EXIT_CODE_BAD_INVOCATION;
+            }
+            partitionManifest = argv[argIdx + 2];
+            argIdx += 3;
+        } else if (!strcmp(argv[argIdx], "--merge") && argIdx + 1 < argc) {
+            mergeFormat = argv[argIdx + 1];
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--kernels")) {
+            reportKernels = 1;
+            ++argIdx;
+        } else if (!strcmp(argv[argIdx], "--ring") && argIdx + 1 < argc && run.sinkCount < MAX_SINK_COUNT) {
+            const int exitCode = openRingSink(&run.sinks[run.sinkCount], argv[argIdx + 1]);
+            if (exitCode) {
+                return exitCode;
+            }
+            ++run.sinkCount;
+            argIdx += 2;
+        } else if (!strcmp(argv[argIdx], "--plugin") && argIdx + 1 < argc && run.sinkCount < MAX_SINK_COUNT) {
+            const int exitCode = openPluginSink(&run.sinks[run.sinkCount], argv[argIdx + 1]);
+            if (exitCode) {
+                return exitCode;
+            }
+            ++run.sinkCount;
+            argIdx += 2;
+        } else {
+            usage(*argv);
+            return EXIT_CODE_BAD_INVOCATION;
+        }
+    }
+    if (reportKernels) {
+        printKernels(stdout);
+        return EXIT_CODE_OK;
+    }
+    if (manifestPartitionCount) {
+        if (argIdx == argc) {
+            usage(*argv);
+            return EXIT_CODE_BAD_INVOCATION;
+        }
+        return writeManifest(argv + argIdx, argc - argIdx, manifestPartitionCount);
+    }
+    if (mergeFormat) {
+        return mergeOutputs(mergeFormat, argv + argIdx, argc - argIdx);
+    }
+    // The partition's files stand in for the command line's, and may well be none
+    const char ** partitionFilenames = 0;
+    if (partitionManifest) {
+        if (argIdx != argc || fetch) {
+            usage(*argv);
+            return EXIT_CODE_BAD_INVOCATION;
+        }
+        int partitionFileCount;
+        const int exitCode = readManifestPartition(partitionManifest, partition, &partitionFilenames,
+            &partitionFileCount);
+        if (exitCode) {
+            return exitCode;
+        }
+        argv = partitionFilenames;
+        argc = partitionFileCount;
+        argIdx = 0;
+    } else if (argIdx == argc || (fetch && argIdx + 1 == argc)) {
+        usage(*argv);
+        return EXIT_CODE_BAD_INVOCATION;
+    }
+    if (!run.sinkCount) {
+        openSink(&run.sinks[run.sinkCount++], diffFilename ? "diff" : "json");
+    }
+    // The base goes through the same decoders and filters, so like is compared with like
+    struct DiffBase diffBase = { 0 };
+    if (diffFilename) {
+        struct Run baseRun = { .sinkCount = 1, .filter = run.filter };
+        openCollectSink(&baseRun.sinks[0], &diffBase);
+        int exitCode = runFinishFile(&baseRun, diffFilename, printCookiesFromFilename(&baseRun, diffFilename));
+        exitCode = exitCode ? exitCode : closeSink(&baseRun.sinks[0]);
+        if (exitCode) {
+            fprintf(stderr, "Cannot read %s to diff against\n", diffFilename);
+            return exitCode;
+        }
+    }
+    for (int sinkIdx = 0; sinkIdx < run.sinkCount; ++sinkIdx) {
+        run.sinks[sinkIdx].locators = locators;
+        run.sinks[sinkIdx].diffBase = &diffBase;
+        run.sinks[sinkIdx].pipeline = &run.pipeline;
+        run.sinks[sinkIdx].throttle = run.throttle;
+        run.sinks[sinkIdx].latency = &run.latency;
+        const int exitCode = startSink(&run.sinks[sinkIdx], run.outputMode);
+        if (exitCode) {
+            return exitCode;
+        }
+    }
+
+    if (run.throttle) {
+        startThrottle(run.throttle);
+    }
+    if (metricsSpec) {
+        const int exitCode = startMetrics(&metrics, metricsSpec, &run);
+        if (exitCode) {
+            return exitCode;
+        }
+        run.metrics = &metrics;
+    }
+    struct sigaction dumpAction = { .sa_handler = requestLatencyDump, .sa_flags = SA_RESTART };
+    sigemptyset(&dumpAction.sa_mask);
+    sigaction(SIGUSR1, &dumpAction, 0);
+
+    // Carry on past bad files in a batch, but report the first failure
+    int exitCode = EXIT_CODE_OK;
+    if (watchSocket) {
+        exitCode = watchFiles(&run, watchSocket, argv + argIdx, argc - argIdx);
+    } else if (fetch) {
+        exitCode = fetchCookiesFromFilename(&run, argv[argIdx], argv + argIdx + 1, argc - argIdx - 1);
+    } else if (pipelined) {
+        exitCode = printCookiesFromFilenamesPipelined(&run, argv + argIdx, argc - argIdx);
+    } else {
+        for (; argIdx < argc; ++argIdx) {
+            const int fileExitCode = runFinishFile(&run, argv[argIdx], printCookiesFromFilename(&run, argv[argIdx]));
+            exitCode = exitCode ? exitCode : fileExitCode;
+            if (latencyDumpRequested) {
+                latencyDumpRequested = 0;
+                dumpLatency(&run, 0, 0);
+            }
+            refreshMetrics(run.metrics);
+        }
+    }
+    if (run.metrics) {
+        const int metricsExitCode = stopMetrics(run.metrics);
+        exitCode = exitCode ? exitCode : metricsExitCode;
+    }
+    for (int sinkIdx = 0; sinkIdx < run.sinkCount; ++sinkIdx) {
+        const int closeExitCode = closeSink(&run.sinks[sinkIdx]);
+        exitCode = exitCode ? exitCode : closeExitCode;
+    }
+    freeDiffBase(&diffBase);
+    for (int fileIdx = 0; partitionFilenames && fileIdx < argc; ++fileIdx) {
+        free((char *)partitionFilenames[fileIdx]);
     }
+    free(partitionFilenames);
+    return exitCode;
 }
+#endif